@@ -0,0 +1,328 @@
+// PSRamFS Benchmark sketch
+#include "PSRamFS.h" // https://github.com/tobozo/ESP32-PsRamFS
+#include "pfs.h"
+#include <pthread.h>
+#include <sys/stat.h>
+
+// bring some signatures from the library
+extern "C" int pfs_find_file( const char * path );
+
+static const char TAG[] = "bench";
+
+#define LOOKUPS_COUNT 10000
+
+
+// what pfs_find_file() used to do before the hashed index: compare every
+// slot (names are now relative, all bench files share the same folder)
+static int legacyFindFile( const char * path )
+{
+  pfs_file_t ** files = pfs_get_files();
+  int max_items = pfs_get_max_items();
+  const char * name = strrchr( path, '/' ) + 1;
+  for( int i=0; i<max_items; i++ ) {
+    if( files[i]->name == NULL ) continue;
+    if( strcmp( name, files[i]->name ) == 0 ) return i;
+  }
+  return -1;
+}
+
+
+void benchLookups( int entries )
+{
+  char path[32];
+
+  PSRamFS.end();
+  pfs_set_max_items( entries );
+
+  if( !PSRamFS.begin() ) {
+    ESP_LOGE(TAG, "PSRamFS Mount Failed with %d entries", entries);
+    return;
+  }
+
+  // fill the table, one slot is left for the folder
+  for( int i=0; i<entries-1; i++ ) {
+    snprintf( path, sizeof(path), "/bench/file_%04d.txt", i );
+    File file = PSRamFS.open( path, FILE_WRITE );
+    if( !file ) {
+      ESP_LOGE(TAG, "Failed to create %s", path );
+      return;
+    }
+    file.close();
+  }
+
+  volatile int found = 0;
+
+  uint32_t start = micros();
+  for( int i=0; i<LOOKUPS_COUNT; i++ ) {
+    snprintf( path, sizeof(path), "/bench/file_%04d.txt", rand()%(entries-1) );
+    found += legacyFindFile( path ) > -1 ? 1 : 0;
+  }
+  uint32_t scan_us = micros() - start;
+
+  start = micros();
+  for( int i=0; i<LOOKUPS_COUNT; i++ ) {
+    snprintf( path, sizeof(path), "/bench/file_%04d.txt", rand()%(entries-1) );
+    found += pfs_find_file( path ) > -1 ? 1 : 0;
+  }
+  uint32_t hash_us = micros() - start;
+
+  if( found != 2*LOOKUPS_COUNT ) {
+    ESP_LOGE(TAG, "Lookup mismatch: found %d out of %d", found, 2*LOOKUPS_COUNT );
+  }
+
+  Serial.printf("[lookup] %5d entries: scan %8.3f us/op, hash %8.3f us/op\n",
+    entries,
+    float(scan_us)/LOOKUPS_COUNT,
+    float(hash_us)/LOOKUPS_COUNT
+  );
+}
+
+
+void benchAppend( bool chunked, size_t total_bytes )
+{
+  static uint8_t buf[512];
+
+  PSRamFS.end();
+  pfs_set_chunked( chunked );
+
+  if( !PSRamFS.begin() ) {
+    ESP_LOGE(TAG, "PSRamFS Mount Failed");
+    return;
+  }
+
+  File file = PSRamFS.open( "/append.bin", FILE_WRITE );
+  if( !file ) {
+    ESP_LOGE(TAG, "Failed to create /append.bin" );
+    return;
+  }
+
+  size_t written = 0;
+  uint32_t start = micros();
+  while( written < total_bytes ) {
+    size_t res = file.write( buf, sizeof(buf) );
+    if( res != sizeof(buf) ) break;
+    written += res;
+  }
+  file.close();
+  uint32_t append_us = micros() - start;
+
+  Serial.printf("[append] %s: %d bytes in %8.3f ms (%s)\n",
+    chunked ? "chunked   " : "contiguous",
+    written,
+    float(append_us)/1000.0,
+    written == total_bytes ? "ok" : "failed"
+  );
+}
+
+
+struct ReadTaskArgs
+{
+  const char * path;
+  size_t bytes;
+  uint8_t buf[512];
+};
+
+
+static void * readTask( void * arg )
+{
+  ReadTaskArgs * args = (ReadTaskArgs*)arg;
+  size_t total = 0;
+  char path[40];
+  snprintf( path, sizeof(path), "/psram%s", args->path ); // stdio goes through the vfs mount point
+  FILE * f = fopen( path, "r" );
+  if( f == NULL ) return NULL;
+  while( total < args->bytes ) {
+    size_t res = fread( args->buf, 1, sizeof(args->buf), f );
+    if( res == 0 ) {
+      rewind( f );
+      continue;
+    }
+    total += res;
+  }
+  fclose( f );
+  return NULL;
+}
+
+
+// [threads] readers pulling [bytes] each, from the same file or one file each
+void benchParallelReads( int threads, bool same_file, size_t bytes )
+{
+  static uint8_t buf[512];
+  char paths[4][32];
+  pthread_t tids[4];
+  static ReadTaskArgs args[4];
+
+  PSRamFS.end();
+  if( !PSRamFS.begin() ) {
+    ESP_LOGE(TAG, "PSRamFS Mount Failed");
+    return;
+  }
+
+  for( int t=0; t<threads; t++ ) {
+    snprintf( paths[t], sizeof(paths[t]), "/read_%d.bin", same_file ? 0 : t );
+    if( t > 0 && same_file ) continue;
+    File file = PSRamFS.open( paths[t], FILE_WRITE );
+    for( int i=0; i<128; i++ ) file.write( buf, sizeof(buf) ); // 64KB
+    file.close();
+  }
+
+  uint32_t start = micros();
+  for( int t=0; t<threads; t++ ) {
+    args[t].path = paths[t];
+    args[t].bytes = bytes;
+    pthread_create( &tids[t], NULL, readTask, &args[t] );
+  }
+  for( int t=0; t<threads; t++ ) {
+    pthread_join( tids[t], NULL );
+  }
+  uint32_t read_us = micros() - start;
+
+  Serial.printf("[read] %d thread(s), %s: %8.3f MB/s\n",
+    threads,
+    same_file ? "same file " : "own file  ",
+    float(threads*bytes)/read_us
+  );
+}
+
+
+static void * statTask( void * arg )
+{
+  char path[32];
+  struct stat st;
+  int * errors = (int*)arg;
+  for( int i=0; i<LOOKUPS_COUNT; i++ ) {
+    snprintf( path, sizeof(path), "/psram/stat/file_%04d.txt", i%256 );
+    if( stat( path, &st ) != 0 ) (*errors)++;
+  }
+  return NULL;
+}
+
+
+// [threads] tasks each doing LOOKUPS_COUNT stat() calls on existing files
+void benchParallelStat( int threads )
+{
+  char path[32];
+  pthread_t tids[4];
+  static int errors[4];
+
+  PSRamFS.end();
+  if( !PSRamFS.begin() ) {
+    ESP_LOGE(TAG, "PSRamFS Mount Failed");
+    return;
+  }
+
+  for( int i=0; i<256; i++ ) {
+    snprintf( path, sizeof(path), "/stat/file_%04d.txt", i );
+    File file = PSRamFS.open( path, FILE_WRITE );
+    file.close();
+  }
+
+  uint32_t start = micros();
+  for( int t=0; t<threads; t++ ) {
+    errors[t] = 0;
+    pthread_create( &tids[t], NULL, statTask, &errors[t] );
+  }
+  for( int t=0; t<threads; t++ ) {
+    pthread_join( tids[t], NULL );
+    if( errors[t] ) ESP_LOGE(TAG, "stat() failed %d times", errors[t] );
+  }
+  uint32_t stat_us = micros() - start;
+
+  Serial.printf("[stat] %d thread(s): %8.3f Kop/s\n",
+    threads,
+    float(threads*LOOKUPS_COUNT)*1000.0/stat_us
+  );
+}
+
+
+// writes then reads back [total_bytes] of JSON-like records, plain or compressed
+void benchCompression( bool compressed, size_t total_bytes )
+{
+  static char line[64];
+
+  PSRamFS.end();
+  if( !PSRamFS.begin() ) {
+    ESP_LOGE(TAG, "PSRamFS Mount Failed");
+    return;
+  }
+  PSRamFS.mkdir( "/logs" );
+  PSRamFS.setCompressed( "/logs", compressed );
+
+  File file = PSRamFS.open( "/logs/sensors.json", FILE_WRITE );
+  if( !file ) {
+    ESP_LOGE(TAG, "Failed to create /logs/sensors.json" );
+    return;
+  }
+  size_t written = 0;
+  uint32_t start = micros();
+  for( int i=0; written < total_bytes; i++ ) {
+    int len = snprintf( line, sizeof(line), "{\"id\":%d,\"temp\":%d.%d,\"rh\":%d},\n", i, 20+i%7, i%10, 40+i%13 );
+    if( file.write( (uint8_t*)line, len ) != len ) break;
+    written += len;
+  }
+  file.close();
+  uint32_t write_us = micros() - start;
+
+  file = PSRamFS.open( "/logs/sensors.json" );
+  size_t read = 0;
+  start = micros();
+  while( file.available() ) {
+    size_t res = file.read( (uint8_t*)line, sizeof(line) );
+    if( res == 0 ) break;
+    read += res;
+  }
+  file.close();
+  uint32_t read_us = micros() - start;
+
+  size_t raw = written, stored = PSRamFS.usedBytes();
+  if( compressed ) pfs_compression_stats( &raw, &stored );
+
+  Serial.printf("[compress] %s: write %8.3f MB/s, read %8.3f MB/s, %d -> %d bytes (ratio %.2f)%s\n",
+    compressed ? "compressed" : "plain     ",
+    float(written)/write_us,
+    float(read)/read_us,
+    raw,
+    stored,
+    stored ? float(raw)/stored : 0.0,
+    read == written ? "" : " (read mismatch)"
+  );
+}
+
+
+void setup()
+{
+  Serial.begin(115200);
+  Serial.println();
+
+  if( ! PSRamFS.setPartitionSize( ESP.getFreePsram()/2 ) ) { // try to allocate half of psram
+    Serial.println("Failed to allocate half of PSRam, will use heap instead");
+  }
+
+  benchLookups( 16 );
+  benchLookups( 256 );
+  benchLookups( 4096 );
+
+  benchAppend( false, 1024*1024 );
+  benchAppend( true, 1024*1024 );
+  pfs_set_chunked( false );
+
+  benchParallelReads( 1, true, 1024*1024 );
+  benchParallelReads( 2, true, 1024*1024 );
+  benchParallelReads( 2, false, 1024*1024 );
+
+  benchParallelStat( 1 );
+  benchParallelStat( 2 );
+
+  benchCompression( false, 1024*1024 );
+  benchCompression( true, 1024*1024 );
+
+  PSRamFS.end();
+
+  ESP_LOGD(TAG,  "Benchmark complete" );
+}
+
+
+void loop()
+{
+
+}
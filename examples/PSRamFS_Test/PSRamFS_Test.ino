@@ -39,14 +39,11 @@ void listDir(fs::FS &fs, const char * dirname, int levels = -1 )
 
     struct PSRAMDIR
     {
-      uint16_t dd_vfs_idx; /*!< VFS index, not to be used by applications */
-      uint16_t dd_rsv;     /*!< field reserved for future extension */
       int    dir_id; // dir descriptor
       char*  name;   // dir path
-      int    pos;    // position while reading dir (reset by opendir)
       int    itemscount;
       void*  parentdir;
-      void** dir_items;
+      void*  dir_items;
     };
 
     PSRAMFILE ** myFiles = (PSRAMFILE **)PSRamFS.getFiles();
@@ -432,6 +429,32 @@ void setup()
 
     RUN_TEST(test_setup_teardown);
     RUN_TEST(test_can_format_mounted_partition);
+    RUN_TEST(test_can_find_renamed_and_unlinked_files);
+    RUN_TEST(test_concurrent_readers_have_own_cursor);
+    RUN_TEST(test_can_store_files_in_chunks);
+    RUN_TEST(test_can_set_growth_policies);
+    RUN_TEST(test_can_preallocate_files);
+    RUN_TEST(test_used_bytes_match_a_recount);
+    RUN_TEST(test_can_grow_and_shrink_tables);
+    RUN_TEST(test_keeps_opened_dirs_when_shrinking);
+    RUN_TEST(test_survives_failed_table_growth);
+    RUN_TEST(test_can_empty_large_directory);
+    RUN_TEST(test_can_rename_populated_directory);
+    RUN_TEST(test_concurrent_access_from_threads);
+    RUN_TEST(test_positional_io_keeps_cursor);
+    RUN_TEST(test_can_map_file_contents);
+    RUN_TEST(test_can_adopt_and_detach_buffers);
+    RUN_TEST(test_can_truncate_in_place);
+    RUN_TEST(test_can_reclaim_slack_memory);
+    RUN_TEST(test_can_clone_files);
+    RUN_TEST(test_can_export_and_import_image);
+    RUN_TEST(test_can_serve_rom_files);
+    RUN_TEST(test_can_compress_files);
+    RUN_TEST(test_can_write_back_to_backing_store);
+    RUN_TEST(test_can_evict_lru_files);
+    RUN_TEST(test_can_place_small_files_in_internal_ram);
+    RUN_TEST(test_can_inline_tiny_files);
+    RUN_TEST(test_can_adopt_over_uncounted_files);
 
     Serial.printf("Free PSRAM: %d\n", ESP.getFreePsram() );
 
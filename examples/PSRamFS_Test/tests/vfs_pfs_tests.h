@@ -9,6 +9,8 @@
 int     vfs_pfs_fopen( const char * path, int flags, int mode );
 ssize_t vfs_pfs_read( int fd, void * dst, size_t size);
 ssize_t vfs_pfs_write( int fd, const void * data, size_t size);
+ssize_t vfs_pfs_pread( int fd, void * dst, size_t size, off_t offset);
+ssize_t vfs_pfs_pwrite( int fd, const void * data, size_t size, off_t offset);
 int     vfs_pfs_close(int fd);
 int     vfs_pfs_fsync(int fd);
 int     vfs_pfs_stat( const char * path, struct stat * st);
@@ -21,12 +23,21 @@ int     vfs_pfs_mkdir(const char* name, mode_t mode);
 DIR*    vfs_pfs_opendir(const char* name);
 struct dirent* vfs_pfs_readdir(DIR* pdir);
 int     vfs_pfs_closedir(DIR* pdir);
+// allocator hooks, swapped by the tests simulating low memory
+extern "C" {
+  extern void* (*pfs_malloc)(size_t size);
+  extern void* (*pfs_calloc)(size_t n, size_t size);
+  extern void* (*pfs_realloc)(void* ptr, size_t size);
+  bool pfs_grow_tables();
+  int pfs_find_file(const char* path);
+}
 
 
 #include <sys/stat.h>
 #include <sys/fcntl.h> // for macros AT_FDCWD / EBADF
 #include <errno.h> // for 'errno' support
 #include <unistd.h>
+#include <pthread.h>
 #include <esp_err.h>
 
 
@@ -96,6 +107,1058 @@ static void test_can_format_mounted_partition(void)
 }
 
 
+static void test_can_find_renamed_and_unlinked_files(void)
+{
+  struct stat st;
+  test_setup();
+  test_pfs_create_file_with_text(pfs_test_filename, pfs_test_hello_str);
+  TEST_ASSERT_EQUAL(0, stat(pfs_test_filename, &st));
+  TEST_ASSERT_EQUAL(strlen(pfs_test_hello_str), st.st_size);
+  TEST_ASSERT_EQUAL(0, rename(pfs_test_filename, pfs_base_path "/renamed.txt"));
+  TEST_ASSERT_NOT_EQUAL(0, stat(pfs_test_filename, &st));
+  TEST_ASSERT_EQUAL(0, stat(pfs_base_path "/renamed.txt", &st));
+  TEST_ASSERT_EQUAL(0, unlink(pfs_base_path "/renamed.txt"));
+  TEST_ASSERT_NOT_EQUAL(0, stat(pfs_base_path "/renamed.txt", &st));
+  test_teardown();
+}
+
+
+static void test_concurrent_readers_have_own_cursor(void)
+{
+  char a[8] = {0};
+  char b[8] = {0};
+  test_setup();
+  test_pfs_create_file_with_text(pfs_test_filename, pfs_test_hello_str);
+  FILE* f1 = fopen(pfs_test_filename, "r");
+  FILE* f2 = fopen(pfs_test_filename, "r");
+  TEST_ASSERT_NOT_NULL(f1);
+  TEST_ASSERT_NOT_NULL(f2);
+  setvbuf(f1, NULL, _IONBF, 0);
+  setvbuf(f2, NULL, _IONBF, 0);
+  TEST_ASSERT_EQUAL(5, fread(a, 1, 5, f1));
+  TEST_ASSERT_EQUAL(7, fread(b, 1, 7, f2));
+  TEST_ASSERT_EQUAL(5, ftell(f1));
+  TEST_ASSERT_EQUAL(7, ftell(f2));
+  TEST_ASSERT_EQUAL_STRING_LEN(pfs_test_hello_str, a, 5);
+  TEST_ASSERT_EQUAL_STRING_LEN(pfs_test_hello_str, b, 7);
+  TEST_ASSERT_EQUAL(0, fclose(f1));
+  TEST_ASSERT_EQUAL(2, fread(b, 1, 2, f2));
+  TEST_ASSERT_EQUAL_STRING_LEN(&pfs_test_hello_str[7], b, 2);
+  TEST_ASSERT_EQUAL(0, fclose(f2));
+  test_teardown();
+}
+
+
+static void test_positional_io_keeps_cursor(void)
+{
+  char buf[8] = {0};
+  test_setup();
+  test_pfs_create_file_with_text(pfs_test_filename, pfs_test_hello_str);
+  int fd = open(pfs_test_filename, O_RDWR);
+  TEST_ASSERT_TRUE(fd >= 0);
+  TEST_ASSERT_EQUAL(5, pread(fd, buf, 5, 7));
+  TEST_ASSERT_EQUAL_STRING_LEN(&pfs_test_hello_str[7], buf, 5);
+  TEST_ASSERT_EQUAL(0, lseek(fd, 0, SEEK_CUR));
+  TEST_ASSERT_EQUAL(5, pwrite(fd, "Earth", 5, 7));
+  TEST_ASSERT_EQUAL(0, lseek(fd, 0, SEEK_CUR));
+  TEST_ASSERT_EQUAL(0, pread(fd, buf, 5, 100));
+  TEST_ASSERT_EQUAL(5, read(fd, buf, 5));
+  TEST_ASSERT_EQUAL_STRING_LEN("Hello", buf, 5);
+  TEST_ASSERT_EQUAL(7, read(fd, buf, 7));
+  TEST_ASSERT_EQUAL_STRING_LEN(", Earth", buf, 7);
+  TEST_ASSERT_EQUAL(0, close(fd));
+  test_teardown();
+}
+
+
+static void test_can_map_file_contents(void)
+{
+  pfs_map_t map;
+  test_setup();
+  test_pfs_create_file_with_text(pfs_test_filename, pfs_test_hello_str);
+  TEST_ASSERT_EQUAL(0, pfs_map("/hello.txt", 7, 5, &map));
+  TEST_ASSERT_EQUAL(5, map.size);
+  TEST_ASSERT_EQUAL_STRING_LEN("World", map.data, 5);
+  // the mapping keeps the data alive after unlink
+  TEST_ASSERT_EQUAL(0, unlink(pfs_test_filename));
+  TEST_ASSERT_EQUAL_STRING_LEN("World", map.data, 5);
+  TEST_ASSERT_EQUAL(0, pfs_unmap(&map));
+  TEST_ASSERT_EQUAL(0, pfs_used_bytes());
+  TEST_ASSERT_NOT_EQUAL(0, pfs_map("/hello.txt", 0, 0, &map));
+  test_teardown();
+}
+
+
+static void test_can_adopt_and_detach_buffers(void)
+{
+  struct stat st;
+  void* buf = NULL;
+  size_t size = 0;
+  test_setup();
+  char* payload = (char*)malloc(strlen(pfs_test_hello_str));
+  TEST_ASSERT_NOT_NULL(payload);
+  memcpy(payload, pfs_test_hello_str, strlen(pfs_test_hello_str));
+  TEST_ASSERT_EQUAL(0, pfs_adopt("/hello.txt", payload, strlen(pfs_test_hello_str)));
+  TEST_ASSERT_EQUAL(0, stat(pfs_test_filename, &st));
+  TEST_ASSERT_EQUAL(strlen(pfs_test_hello_str), st.st_size);
+  TEST_ASSERT_EQUAL(0, pfs_detach("/hello.txt", &buf, &size));
+  TEST_ASSERT_EQUAL_PTR(payload, buf);
+  TEST_ASSERT_EQUAL(strlen(pfs_test_hello_str), size);
+  TEST_ASSERT_EQUAL(0, stat(pfs_test_filename, &st));
+  TEST_ASSERT_EQUAL(0, st.st_size);
+  free(buf);
+  test_teardown();
+}
+
+
+static void test_can_truncate_in_place(void)
+{
+  struct stat st;
+  static char buf[4096];
+  test_setup();
+  FILE* f = fopen(pfs_test_filename, "w");
+  TEST_ASSERT_NOT_NULL(f);
+  for (int i = 0; i < 16; i++) {
+    TEST_ASSERT_EQUAL(sizeof(buf), fwrite(buf, 1, sizeof(buf), f));
+  }
+  TEST_ASSERT_EQUAL(0, fclose(f));
+  size_t peak = pfs_used_bytes();
+  TEST_ASSERT_EQUAL(0, truncate(pfs_test_filename, 100));
+  TEST_ASSERT_EQUAL(0, stat(pfs_test_filename, &st));
+  TEST_ASSERT_EQUAL(100, st.st_size);
+  TEST_ASSERT_TRUE(pfs_used_bytes() < peak);
+  // growing is lazy, the new bytes read as zeroes
+  size_t used = pfs_used_bytes();
+  TEST_ASSERT_EQUAL(0, truncate(pfs_test_filename, 10000));
+  TEST_ASSERT_EQUAL(used, pfs_used_bytes());
+  f = fopen(pfs_test_filename, "r");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(0, fseek(f, 9000, SEEK_SET));
+  TEST_ASSERT_EQUAL(0, fgetc(f));
+  TEST_ASSERT_EQUAL(0, fclose(f));
+  test_teardown();
+}
+
+
+static void test_can_reclaim_slack_memory(void)
+{
+  char path[32];
+  test_setup();
+  for (int i = 0; i < 8; i++) {
+    snprintf(path, sizeof(path), pfs_base_path "/slack_%d.txt", i);
+    test_pfs_create_file_with_text(path, pfs_test_hello_str);
+  }
+  size_t used = pfs_used_bytes();
+  size_t reclaimed = pfs_compact(0);
+  TEST_ASSERT_EQUAL(8 * strlen(pfs_test_hello_str), pfs_used_bytes());
+  TEST_ASSERT_EQUAL(used - pfs_used_bytes(), reclaimed);
+  // the last writer closing trims the file too
+  pfs_set_shrink_on_close(true);
+  test_pfs_create_file_with_text(pfs_test_filename, pfs_test_hello_str);
+  pfs_set_shrink_on_close(false);
+  TEST_ASSERT_EQUAL(9 * strlen(pfs_test_hello_str), pfs_used_bytes());
+  TEST_ASSERT_EQUAL(0, pfs_compact(0));
+  test_teardown();
+}
+
+
+static void test_can_clone_files(void)
+{
+  static char blob[4096];
+  char buf[32] = {0};
+  struct stat st;
+  test_setup();
+  test_pfs_create_file_with_text(pfs_test_filename, pfs_test_hello_str);
+  size_t used = pfs_used_bytes();
+  TEST_ASSERT_EQUAL(0, pfs_clone("/hello.txt", "/backup/hello.txt"));
+  TEST_ASSERT_EQUAL(used, pfs_used_bytes());
+  // writing to the clone copies the data, the source is unchanged
+  FILE* f = fopen(pfs_base_path "/backup/hello.txt", "r+");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(5, fwrite("Howdy", 1, 5, f));
+  TEST_ASSERT_EQUAL(0, fclose(f));
+  TEST_ASSERT_EQUAL(2 * used, pfs_used_bytes());
+  f = fopen(pfs_test_filename, "r");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(strlen(pfs_test_hello_str), fread(buf, 1, sizeof(buf), f));
+  TEST_ASSERT_EQUAL(0, fclose(f));
+  TEST_ASSERT_EQUAL_STRING(pfs_test_hello_str, buf);
+  // compressed files can't be cloned, and no empty clone is left behind
+  memset(blob, 'z', sizeof(blob));
+  f = fopen(pfs_base_path "/packed.bin", "w");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(sizeof(blob), fwrite(blob, 1, sizeof(blob), f));
+  TEST_ASSERT_EQUAL(0, fclose(f));
+  TEST_ASSERT_EQUAL(0, pfs_set_compressed("/packed.bin", true));
+  TEST_ASSERT_EQUAL(-1, pfs_clone("/packed.bin", "/unpacked.bin"));
+  TEST_ASSERT_NOT_EQUAL(0, stat(pfs_base_path "/unpacked.bin", &st));
+  test_teardown();
+}
+
+
+typedef struct
+{
+  uint8_t buf[256];
+  size_t len;
+  size_t pos;
+} test_image_t;
+
+
+static size_t test_image_write(void* ctx, const void* data, size_t len)
+{
+  test_image_t* img = (test_image_t*)ctx;
+  if (img->len + len > sizeof(img->buf)) return 0;
+  memcpy(&img->buf[img->len], data, len);
+  img->len += len;
+  return len;
+}
+
+
+static size_t test_image_read(void* ctx, void* data, size_t len)
+{
+  test_image_t* img = (test_image_t*)ctx;
+  if (len > img->len - img->pos) len = img->len - img->pos;
+  memcpy(data, &img->buf[img->pos], len);
+  img->pos += len;
+  return len;
+}
+
+
+static void test_can_export_and_import_image(void)
+{
+  static test_image_t img;
+  char buf[32] = {0};
+  struct stat st;
+  img.len = img.pos = 0;
+  test_setup();
+  test_pfs_create_file_with_text(pfs_test_filename, pfs_test_hello_str);
+  test_pfs_create_file_with_text(pfs_base_path "/www/css/style.css", "body{}");
+  TEST_ASSERT_EQUAL(0, mkdir(pfs_base_path "/empty", 0755));
+  TEST_ASSERT_EQUAL(0, pfs_image_export(test_image_write, &img));
+  test_teardown();
+  // restore on a freshly formatted partition
+  test_setup();
+  TEST_ASSERT_NOT_EQUAL(0, stat(pfs_test_filename, &st));
+  TEST_ASSERT_EQUAL(0, pfs_image_import(test_image_read, &img));
+  TEST_ASSERT_EQUAL(img.len, img.pos);
+  FILE* f = fopen(pfs_test_filename, "r");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(strlen(pfs_test_hello_str), fread(buf, 1, sizeof(buf), f));
+  TEST_ASSERT_EQUAL(0, fclose(f));
+  TEST_ASSERT_EQUAL_STRING(pfs_test_hello_str, buf);
+  TEST_ASSERT_EQUAL(0, stat(pfs_base_path "/www/css/style.css", &st));
+  TEST_ASSERT_EQUAL(6, st.st_size);
+  TEST_ASSERT_EQUAL(0, stat(pfs_base_path "/empty", &st));
+  TEST_ASSERT_TRUE(S_ISDIR(st.st_mode));
+  // a truncated image is refused
+  img.len -= 3;
+  img.pos = 0;
+  TEST_ASSERT_NOT_EQUAL(0, pfs_image_import(test_image_read, &img));
+  test_teardown();
+}
+
+
+static void test_can_serve_rom_files(void)
+{
+  static const char rom[] = "Served from flash";
+  char buf[32] = {0};
+  test_setup();
+  TEST_ASSERT_EQUAL(0, pfs_link_rom("/rom.txt", rom, strlen(rom)));
+  TEST_ASSERT_EQUAL(0, pfs_used_bytes());
+  FILE* f = fopen(pfs_base_path "/rom.txt", "r+");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(strlen(rom), fread(buf, 1, sizeof(buf), f));
+  TEST_ASSERT_EQUAL_STRING(rom, buf);
+  // writing copies the data first, the array is left alone
+  TEST_ASSERT_EQUAL(0, fseek(f, 0, SEEK_SET));
+  TEST_ASSERT_EQUAL(6, fwrite("Copied", 1, 6, f));
+  TEST_ASSERT_EQUAL(0, fclose(f));
+  TEST_ASSERT_NOT_EQUAL(0, pfs_used_bytes());
+  TEST_ASSERT_EQUAL_STRING("Served from flash", rom);
+  test_teardown();
+}
+
+
+static void test_can_compress_files(void)
+{
+  char line[32];
+  char buf[32] = {0};
+  size_t raw, stored;
+  test_setup();
+  TEST_ASSERT_EQUAL(0, mkdir(pfs_base_path "/logs", 0755));
+  TEST_ASSERT_EQUAL(0, pfs_set_compressed("/logs", true));
+  FILE* f = fopen(pfs_base_path "/logs/data.csv", "w");
+  TEST_ASSERT_NOT_NULL(f);
+  for (int i = 0; i < 2000; i++) {
+    int len = snprintf(line, sizeof(line), "%04d,21.5,48\n", i);
+    TEST_ASSERT_EQUAL(len, fwrite(line, 1, len, f));
+  }
+  TEST_ASSERT_EQUAL(0, fclose(f));
+  TEST_ASSERT_EQUAL(1, pfs_compression_stats(&raw, &stored));
+  TEST_ASSERT_EQUAL(2000 * 13, raw);
+  TEST_ASSERT_LESS_THAN(raw / 2, stored);
+  // random access only decompresses the block holding the line
+  f = fopen(pfs_base_path "/logs/data.csv", "r");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(0, fseek(f, 1234 * 13, SEEK_SET));
+  TEST_ASSERT_EQUAL(13, fread(buf, 1, 13, f));
+  TEST_ASSERT_EQUAL(0, fclose(f));
+  TEST_ASSERT_EQUAL_STRING("1234,21.5,48\n", buf);
+  test_teardown();
+}
+
+
+// single file backing store kept in memory
+typedef struct
+{
+  char path[32];
+  test_image_t data;
+} test_backing_t;
+
+
+static void* test_backing_open(void* ctx, const char* path, bool write)
+{
+  test_backing_t* store = (test_backing_t*)ctx;
+  if (write) {
+    snprintf(store->path, sizeof(store->path), "%s", path);
+    store->data.len = 0;
+  } else if (strcmp(store->path, path) != 0) {
+    return NULL;
+  }
+  store->data.pos = 0;
+  return &store->data;
+}
+
+
+static int test_backing_close(void* handle)
+{
+  return 0;
+}
+
+
+static int test_backing_stat(void* ctx, const char* path, struct stat* st)
+{
+  test_backing_t* store = (test_backing_t*)ctx;
+  if (strcmp(store->path, path) != 0) return -1;
+  st->st_mode = S_IFREG;
+  st->st_size = store->data.len;
+  return 0;
+}
+
+
+static int test_backing_remove(void* ctx, const char* path)
+{
+  test_backing_t* store = (test_backing_t*)ctx;
+  if (strcmp(store->path, path) != 0) return -1;
+  store->path[0] = '\0';
+  return 0;
+}
+
+
+static int test_backing_rename(void* ctx, const char* from, const char* to)
+{
+  test_backing_t* store = (test_backing_t*)ctx;
+  if (strcmp(store->path, from) != 0) return -1;
+  snprintf(store->path, sizeof(store->path), "%s", to);
+  return 0;
+}
+
+
+static void test_can_write_back_to_backing_store(void)
+{
+  static test_backing_t store;
+  char buf[32] = {0};
+  struct stat st;
+  const pfs_backing_t backing = {
+    .ctx = &store,
+    .open = test_backing_open,
+    .read = test_image_read,
+    .write = test_image_write,
+    .close = test_backing_close,
+    .stat = test_backing_stat,
+    .remove = test_backing_remove,
+    .rename = test_backing_rename
+  };
+  snprintf(store.path, sizeof(store.path), "/cached.txt");
+  store.data.len = sprintf((char*)store.data.buf, "from store");
+  test_setup();
+  TEST_ASSERT_EQUAL(0, pfs_set_backing(&backing, 0));
+  // visible before being fetched
+  TEST_ASSERT_EQUAL(0, stat(pfs_base_path "/cached.txt", &st));
+  TEST_ASSERT_EQUAL(10, st.st_size);
+  FILE* f = fopen(pfs_base_path "/cached.txt", "r");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(10, fread(buf, 1, sizeof(buf), f));
+  TEST_ASSERT_EQUAL(0, fclose(f));
+  TEST_ASSERT_EQUAL_STRING("from store", buf);
+  f = fopen(pfs_base_path "/cached.txt", "a");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(5, fwrite(" & us", 1, 5, f));
+  TEST_ASSERT_EQUAL(0, fflush(f));
+  // written back on fsync only
+  TEST_ASSERT_EQUAL(10, store.data.len);
+  TEST_ASSERT_EQUAL(0, fsync(fileno(f)));
+  TEST_ASSERT_EQUAL(0, fclose(f));
+  TEST_ASSERT_EQUAL(15, store.data.len);
+  TEST_ASSERT_EQUAL(0, memcmp("from store & us", store.data.buf, 15));
+  TEST_ASSERT_EQUAL(0, rename(pfs_base_path "/cached.txt", pfs_base_path "/moved.txt"));
+  TEST_ASSERT_EQUAL_STRING("/moved.txt", store.path);
+  TEST_ASSERT_EQUAL(0, unlink(pfs_base_path "/moved.txt"));
+  TEST_ASSERT_EQUAL_STRING("", store.path);
+  TEST_ASSERT_EQUAL(0, pfs_set_backing(NULL, 0));
+  test_teardown();
+}
+
+
+static void test_can_evict_lru_files(void)
+{
+  static char blob[12000];
+  char path[32];
+  struct stat st;
+  size_t partition_size = pfs_get_partition_size();
+  memset(blob, 'x', sizeof(blob));
+  pfs_set_partition_size(64 * 1024);
+  test_setup();
+  for (int i = 0; i < 5; i++) {
+    snprintf(path, sizeof(path), pfs_base_path "/asset%d.bin", i);
+    FILE* f = fopen(path, "w");
+    TEST_ASSERT_NOT_NULL(f);
+    TEST_ASSERT_EQUAL(sizeof(blob), fwrite(blob, 1, sizeof(blob), f));
+    TEST_ASSERT_EQUAL(0, fclose(f));
+  }
+  TEST_ASSERT_EQUAL(0, pfs_pin("/asset0.bin", true));
+  // reading asset1 makes asset2 the least recently used one
+  FILE* f = fopen(pfs_base_path "/asset1.bin", "r");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(0, fclose(f));
+  pfs_set_cache_mode(true);
+  f = fopen(pfs_base_path "/asset5.bin", "w");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(sizeof(blob), fwrite(blob, 1, sizeof(blob), f));
+  TEST_ASSERT_EQUAL(0, fclose(f));
+  TEST_ASSERT_EQUAL(1, pfs_evictions());
+  TEST_ASSERT_NOT_EQUAL(0, stat(pfs_base_path "/asset2.bin", &st));
+  TEST_ASSERT_EQUAL(0, stat(pfs_base_path "/asset0.bin", &st));
+  TEST_ASSERT_EQUAL(0, stat(pfs_base_path "/asset1.bin", &st));
+  pfs_set_cache_mode(false);
+  test_teardown();
+  pfs_set_partition_size(partition_size);
+}
+
+
+static void test_can_place_small_files_in_internal_ram(void)
+{
+  static char blob[8192];
+  pfs_map_t map;
+  memset(blob, 'x', sizeof(blob));
+  test_setup();
+  // only known once mounted
+  if (!pfs_get_psram()) {
+    test_teardown();
+    TEST_IGNORE_MESSAGE("No psram, everything is in internal ram");
+  }
+  pfs_set_internal_threshold(4096);
+  test_pfs_create_file_with_text(pfs_base_path "/token", pfs_test_hello_str);
+  TEST_ASSERT_EQUAL(0, pfs_map("/token", 0, 0, &map));
+  TEST_ASSERT_TRUE(map.file->flags & PFS_F_INTERNAL);
+  TEST_ASSERT_EQUAL(0, pfs_unmap(&map));
+  TEST_ASSERT_EQUAL(pfs_used_bytes(), pfs_used_bytes_internal());
+  // growing past the threshold moves it to psram
+  FILE* f = fopen(pfs_base_path "/token", "a");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(sizeof(blob), fwrite(blob, 1, sizeof(blob), f));
+  TEST_ASSERT_EQUAL(0, fclose(f));
+  TEST_ASSERT_EQUAL(0, pfs_used_bytes_internal());
+  TEST_ASSERT_EQUAL(pfs_used_bytes(), pfs_used_bytes_psram());
+  // unless a rule says otherwise
+  TEST_ASSERT_EQUAL(0, pfs_set_placement("/token", pfs_place_internal));
+  TEST_ASSERT_EQUAL(pfs_used_bytes(), pfs_used_bytes_internal());
+  pfs_set_internal_threshold(0);
+  test_teardown();
+}
+
+
+static void test_can_inline_tiny_files(void)
+{
+  static char blob[8192];
+  char buf[32] = {0};
+  pfs_map_t map;
+  memset(blob, 'x', sizeof(blob));
+  test_setup();
+  pfs_set_inline_size(PFS_INLINE_SIZE);
+  test_pfs_create_file_with_text(pfs_base_path "/flag", pfs_test_hello_str);
+  TEST_ASSERT_EQUAL(0, pfs_used_bytes());
+  TEST_ASSERT_EQUAL(0, pfs_map("/flag", 0, 0, &map));
+  TEST_ASSERT_TRUE(map.file->flags & PFS_F_INLINE);
+  TEST_ASSERT_EQUAL(0, pfs_unmap(&map));
+  // growing past the entry moves it to the heap
+  FILE* f = fopen(pfs_base_path "/flag", "a");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(sizeof(blob), fwrite(blob, 1, sizeof(blob), f));
+  TEST_ASSERT_EQUAL(0, fclose(f));
+  TEST_ASSERT_NOT_EQUAL(0, pfs_used_bytes());
+  // and shrinking brings it back
+  TEST_ASSERT_EQUAL(0, truncate(pfs_base_path "/flag",
+                                strlen(pfs_test_hello_str)));
+  TEST_ASSERT_EQUAL(0, pfs_used_bytes());
+  f = fopen(pfs_base_path "/flag", "r");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(strlen(pfs_test_hello_str), fread(buf, 1, sizeof(buf), f));
+  TEST_ASSERT_EQUAL(0, fclose(f));
+  TEST_ASSERT_EQUAL_STRING(pfs_test_hello_str, buf);
+  pfs_set_inline_size(0);
+  test_teardown();
+}
+
+
+// the entry of [path], relative to the mount point
+static pfs_file_t* test_file_entry(const char* path)
+{
+  int file_id = pfs_find_file(path);
+  TEST_ASSERT_TRUE(file_id > -1);
+  return pfs_get_files()[file_id];
+}
+
+
+static uint8_t test_pattern(size_t offset)
+{
+  return (offset * 7 + 1) & 0xff;
+}
+
+
+// checks that [len] bytes of [fd] at [offset] are the pattern, or zeroes
+static void test_check_bytes(int fd, size_t offset, size_t len, bool zeroes)
+{
+  static uint8_t buf[256];
+  TEST_ASSERT_TRUE(len <= sizeof(buf));
+  TEST_ASSERT_EQUAL(len, pread(fd, buf, len, offset));
+  for (size_t i = 0; i < len; i++) {
+    TEST_ASSERT_EQUAL(zeroes ? 0 : test_pattern(offset + i), buf[i]);
+  }
+}
+
+
+static void test_can_store_files_in_chunks(void)
+{
+  static uint8_t data[2 * 4096 + 100];
+  struct stat st;
+  uint8_t buf[16];
+  test_setup();
+  size_t chunk = pfs_get_block_size(); // depends on the board
+  size_t size = 2 * chunk + 100; // the last chunk is partial
+  TEST_ASSERT_TRUE(size <= sizeof(data));
+  for (size_t i = 0; i < size; i++) {
+    data[i] = test_pattern(i);
+  }
+  pfs_set_chunked(true);
+  int fd = open(pfs_base_path "/chunked.bin", O_RDWR | O_CREAT);
+  TEST_ASSERT_TRUE(fd >= 0);
+  TEST_ASSERT_EQUAL(size, write(fd, data, size));
+  pfs_file_t* file = test_file_entry("/chunked.bin");
+  TEST_ASSERT_NOT_NULL(file->chunks);
+  TEST_ASSERT_EQUAL(chunk, file->chunk_size);
+  TEST_ASSERT_EQUAL(3 * chunk, file->memsize);
+  TEST_ASSERT_EQUAL(3 * chunk, pfs_used_bytes());
+  // reads across chunk boundaries and up to the partial end
+  test_check_bytes(fd, chunk - 10, 20, false);
+  test_check_bytes(fd, 2 * chunk - 1, 2, false);
+  TEST_ASSERT_EQUAL(10, pread(fd, buf, sizeof(buf), size - 10));
+  TEST_ASSERT_EQUAL(0, pread(fd, buf, sizeof(buf), size));
+  // a write across a boundary after a seek
+  TEST_ASSERT_EQUAL(chunk - 3, lseek(fd, chunk - 3, SEEK_SET));
+  TEST_ASSERT_EQUAL(6, write(fd, "ABCDEF", 6));
+  TEST_ASSERT_EQUAL(6, pread(fd, buf, 6, chunk - 3));
+  TEST_ASSERT_EQUAL_MEMORY("ABCDEF", buf, 6);
+  TEST_ASSERT_EQUAL(chunk + 3, lseek(fd, 0, SEEK_CUR));
+  TEST_ASSERT_EQUAL(size, lseek(fd, 0, SEEK_END));
+  TEST_ASSERT_EQUAL(3 * chunk, file->memsize);
+  // truncating down into the second chunk keeps what's before
+  TEST_ASSERT_EQUAL(0, ftruncate(fd, chunk + 5));
+  TEST_ASSERT_EQUAL(0, fstat(fd, &st));
+  TEST_ASSERT_EQUAL(chunk + 5, st.st_size);
+  test_check_bytes(fd, chunk + 3, 2, false);
+  TEST_ASSERT_EQUAL(0, pread(fd, buf, sizeof(buf), chunk + 5));
+  // growing leaves a hole that reads as zeroes
+  TEST_ASSERT_EQUAL(0, ftruncate(fd, 2 * chunk + 50));
+  test_check_bytes(fd, chunk + 3, 2, false);
+  test_check_bytes(fd, chunk + 5, 200, true);
+  test_check_bytes(fd, 2 * chunk - 100, 150, true);
+  // so does writing past the end
+  TEST_ASSERT_EQUAL(1, pwrite(fd, "Z", 1, 3 * chunk + 10));
+  test_check_bytes(fd, 3 * chunk - 100, 110, true);
+  TEST_ASSERT_EQUAL(1, pread(fd, buf, sizeof(buf), 3 * chunk + 10));
+  TEST_ASSERT_EQUAL('Z', buf[0]);
+  TEST_ASSERT_EQUAL(4 * chunk, file->memsize);
+  TEST_ASSERT_EQUAL(4 * chunk, pfs_used_bytes());
+  TEST_ASSERT_EQUAL(0, close(fd));
+  pfs_set_chunked(false);
+  test_teardown();
+}
+
+
+// appends [blocks] blocks to [path] one block per write()
+static void test_append_blocks(const char* path, int blocks)
+{
+  static char block[4096];
+  size_t block_size = pfs_get_block_size();
+  TEST_ASSERT_TRUE(block_size <= sizeof(block));
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND);
+  TEST_ASSERT_TRUE(fd >= 0);
+  for (int i = 0; i < blocks; i++) {
+    TEST_ASSERT_EQUAL(block_size, write(fd, block, block_size));
+  }
+  TEST_ASSERT_EQUAL(0, close(fd));
+}
+
+
+static void test_can_set_growth_policies(void)
+{
+  struct {
+    pfs_growth_policy_t policy;
+    size_t cap; // in blocks
+    size_t memsize; // in blocks, once 9 blocks were appended one by one
+  } cases[] = {
+    { pfs_growth_fixed, 0, 9 }, // 1, 2, 3... 9
+    { pfs_growth_geometric, 0, 16 }, // 1, 2, 4, 8, 16
+    { pfs_growth_capped, 2, 10 }, // 1, 2, 4, 6, 8, 10
+  };
+  char path[32];
+  struct stat st;
+  test_setup();
+  size_t block_size = pfs_get_block_size(); // depends on the board
+  for (int i = 0; i < 3; i++) {
+    pfs_set_growth_policy(cases[i].policy, cases[i].cap * block_size);
+    TEST_ASSERT_EQUAL(cases[i].policy, pfs_get_growth_policy());
+    snprintf(path, sizeof(path), pfs_base_path "/grown_%d.bin", i);
+    test_append_blocks(path, 9);
+    TEST_ASSERT_EQUAL(0, stat(path, &st));
+    TEST_ASSERT_EQUAL(9 * block_size, st.st_size);
+    pfs_file_t* file = test_file_entry(path + strlen(pfs_base_path));
+    TEST_ASSERT_EQUAL(cases[i].memsize * block_size, file->memsize);
+    TEST_ASSERT_EQUAL(cases[i].memsize * block_size, pfs_used_bytes());
+    TEST_ASSERT_EQUAL(0, unlink(path));
+    TEST_ASSERT_EQUAL(0, pfs_used_bytes());
+  }
+  pfs_set_growth_policy(pfs_growth_fixed, 64 * 1024); // the defaults
+  test_teardown();
+}
+
+
+static void test_can_preallocate_files(void)
+{
+  struct stat st;
+  test_setup();
+  size_t block_size = pfs_get_block_size(); // depends on the board
+  size_t expected = 3 * block_size + 5;
+  // memory is reserved, the file stays empty
+  TEST_ASSERT_EQUAL(0, pfs_preallocate("/big.bin", expected));
+  TEST_ASSERT_EQUAL(0, stat(pfs_base_path "/big.bin", &st));
+  TEST_ASSERT_EQUAL(0, st.st_size);
+  pfs_file_t* file = test_file_entry("/big.bin");
+  TEST_ASSERT_EQUAL(expected, file->memsize);
+  TEST_ASSERT_EQUAL(expected, pfs_used_bytes());
+  // and filled without growing
+  test_append_blocks(pfs_base_path "/big.bin", 3);
+  TEST_ASSERT_EQUAL(expected, file->memsize);
+  TEST_ASSERT_EQUAL(expected, pfs_used_bytes());
+  // never shrinks what's there
+  TEST_ASSERT_EQUAL(0, pfs_fallocate(file, block_size));
+  TEST_ASSERT_EQUAL(expected, file->memsize);
+  TEST_ASSERT_EQUAL(0, pfs_fallocate(file, 2 * expected));
+  TEST_ASSERT_EQUAL(2 * expected, file->memsize);
+  TEST_ASSERT_EQUAL(2 * expected, pfs_used_bytes());
+  TEST_ASSERT_EQUAL(0, stat(pfs_base_path "/big.bin", &st));
+  TEST_ASSERT_EQUAL(3 * block_size, st.st_size);
+  // the same through fcntl() on an opened file
+  int fd = open(pfs_base_path "/small.bin", O_WRONLY | O_CREAT);
+  TEST_ASSERT_TRUE(fd >= 0);
+  TEST_ASSERT_EQUAL(0, fcntl(fd, PFS_F_PREALLOCATE, (int)block_size));
+  TEST_ASSERT_EQUAL(-1, fcntl(fd, PFS_F_PREALLOCATE, -1));
+  TEST_ASSERT_EQUAL(0, fstat(fd, &st));
+  TEST_ASSERT_EQUAL(0, st.st_size);
+  TEST_ASSERT_EQUAL(0, close(fd));
+  TEST_ASSERT_EQUAL(block_size, test_file_entry("/small.bin")->memsize);
+  TEST_ASSERT_EQUAL(2 * expected + block_size, pfs_used_bytes());
+  test_teardown();
+}
+
+
+// counts the memory held by the files the long way, returns the internal
+// ram part in [internal]
+static size_t test_recount_used_bytes(size_t* internal)
+{
+  static const void* shared[64];
+  int shared_count = 0;
+  size_t used = 0;
+  *internal = 0;
+  pfs_file_t** files = pfs_get_files();
+  for (int i = 0; i < pfs_get_max_items(); i++) {
+    pfs_file_t* file = files[i];
+    // unlinked files hold memory until their last handle is closed
+    if (file->name == NULL && file->refcount == 0)
+      continue;
+    if (file->flags & (PFS_F_ROM | PFS_F_INLINE))
+      continue;
+    if (file->shared != NULL) { // clones count once
+      bool seen = false;
+      for (int s = 0; s < shared_count && !seen; s++)
+        seen = shared[s] == file->shared;
+      if (seen)
+        continue;
+      TEST_ASSERT_TRUE(shared_count < 64);
+      shared[shared_count++] = file->shared;
+    }
+    used += file->memsize;
+    if (file->flags & PFS_F_INTERNAL)
+      *internal += file->memsize;
+  }
+  return used;
+}
+
+
+static void test_used_bytes_match_a_recount(void)
+{
+  static char blob[3000];
+  char path[32], moved[32];
+  struct stat st;
+  size_t internal;
+  uint32_t seed = 1;
+  memset(blob, 'x', sizeof(blob));
+  test_setup();
+  for (int chunked = 0; chunked < 2; chunked++) {
+    pfs_set_chunked(chunked);
+    for (int step = 0; step < 300; step++) {
+      seed = seed * 1103515245 + 12345;
+      uint32_t r = seed >> 8;
+      snprintf(path, sizeof(path), pfs_base_path "/f%d", (int)(r % 8));
+      bool exists = stat(path, &st) == 0;
+      switch ((r >> 3) % 5) {
+        case 0:
+        case 1: {
+          int fd = open(path, O_WRONLY | O_CREAT);
+          TEST_ASSERT_TRUE(fd >= 0);
+          size_t len = (r >> 6) % sizeof(blob) + 1;
+          TEST_ASSERT_EQUAL(len, pwrite(fd, blob, len, (r >> 4) % 6000));
+          TEST_ASSERT_EQUAL(0, close(fd));
+        } break;
+        case 2:
+          if (exists)
+            TEST_ASSERT_EQUAL(0, truncate(path, (r >> 6) % 8000));
+          break;
+        case 3:
+          if (exists)
+            TEST_ASSERT_EQUAL(0, unlink(path));
+          break;
+        case 4:
+          snprintf(moved, sizeof(moved), pfs_base_path "/f%d",
+                   (int)((r >> 6) % 8));
+          if (exists && stat(moved, &st) != 0)
+            TEST_ASSERT_EQUAL(0, rename(path, moved));
+          break;
+      }
+      size_t used = test_recount_used_bytes(&internal);
+      TEST_ASSERT_EQUAL(used, pfs_used_bytes());
+      // without psram, it's all internal ram
+      TEST_ASSERT_EQUAL(pfs_get_psram() ? internal : used,
+                        pfs_used_bytes_internal());
+    }
+  }
+  // an unlinked file keeps its memory while it's opened
+  test_pfs_create_file_with_text(pfs_test_filename, pfs_test_hello_str);
+  int fd = open(pfs_test_filename, O_RDONLY);
+  TEST_ASSERT_TRUE(fd >= 0);
+  TEST_ASSERT_EQUAL(0, unlink(pfs_test_filename));
+  TEST_ASSERT_EQUAL(test_recount_used_bytes(&internal), pfs_used_bytes());
+  TEST_ASSERT_EQUAL(0, close(fd));
+  TEST_ASSERT_EQUAL(test_recount_used_bytes(&internal), pfs_used_bytes());
+  pfs_set_chunked(false);
+  test_teardown();
+}
+
+
+static void test_can_grow_and_shrink_tables(void)
+{
+  char path[32];
+  struct stat st;
+  test_setup();
+  int initial = pfs_get_max_items();
+  for (int i = 0; i < 3 * initial; i++) {
+    snprintf(path, sizeof(path), pfs_base_path "/item_%d.txt", i);
+    test_pfs_create_file_with_text(path, pfs_test_hello_str);
+  }
+  TEST_ASSERT_EQUAL(4 * initial, pfs_get_max_items());
+  for (int i = 0; i < 3 * initial; i++) {
+    snprintf(path, sizeof(path), pfs_base_path "/item_%d.txt", i);
+    TEST_ASSERT_EQUAL(0, stat(path, &st));
+    TEST_ASSERT_EQUAL(strlen(pfs_test_hello_str), st.st_size);
+  }
+  // the upper half is in use
+  TEST_ASSERT_EQUAL(4 * initial, pfs_shrink_tables());
+  for (int i = 0; i < 3 * initial; i++) {
+    snprintf(path, sizeof(path), pfs_base_path "/item_%d.txt", i);
+    TEST_ASSERT_EQUAL(0, unlink(path));
+  }
+  TEST_ASSERT_EQUAL(initial, pfs_shrink_tables());
+  test_pfs_create_file_with_text(pfs_test_filename, pfs_test_hello_str);
+  TEST_ASSERT_EQUAL(0, stat(pfs_test_filename, &st));
+  test_teardown();
+}
+
+
+static void test_keeps_opened_dirs_when_shrinking(void)
+{
+  char path[32];
+  test_setup();
+  int initial = pfs_get_max_items();
+  // the last one lands in the upper half of the grown tables
+  for (int i = 0; i < initial + 4; i++) {
+    snprintf(path, sizeof(path), pfs_base_path "/d%d", i);
+    TEST_ASSERT_EQUAL(0, mkdir(path, 0755));
+  }
+  TEST_ASSERT_EQUAL(2 * initial, pfs_get_max_items());
+  DIR* dir = opendir(path);
+  TEST_ASSERT_NOT_NULL(dir);
+  for (int i = 0; i < initial + 4; i++) {
+    snprintf(path, sizeof(path), pfs_base_path "/d%d", i);
+    TEST_ASSERT_EQUAL(0, rmdir(path));
+  }
+  // the opened dir keeps its slot, freed or reused it would be listed
+  TEST_ASSERT_EQUAL(2 * initial, pfs_shrink_tables());
+  for (int i = 0; i < initial + 4; i++) {
+    snprintf(path, sizeof(path), pfs_base_path "/e%d", i);
+    TEST_ASSERT_EQUAL(0, mkdir(path, 0755));
+    strcat(path, "/hello.txt");
+    test_pfs_create_file_with_text(path, pfs_test_hello_str);
+  }
+  TEST_ASSERT_NULL(readdir(dir));
+  TEST_ASSERT_EQUAL(0, closedir(dir));
+  for (int i = 0; i < initial + 4; i++) {
+    snprintf(path, sizeof(path), pfs_base_path "/e%d/hello.txt", i);
+    TEST_ASSERT_EQUAL(0, unlink(path));
+    snprintf(path, sizeof(path), pfs_base_path "/e%d", i);
+    TEST_ASSERT_EQUAL(0, rmdir(path));
+  }
+  TEST_ASSERT_EQUAL(initial, pfs_shrink_tables());
+  test_teardown();
+}
+
+
+static int test_allocs_left;
+static void* (*test_real_malloc)(size_t size);
+static void* (*test_real_calloc)(size_t n, size_t size);
+static void* (*test_real_realloc)(void* ptr, size_t size);
+
+static void* test_failing_malloc(size_t size)
+{
+  return test_allocs_left-- > 0 ? test_real_malloc(size) : NULL;
+}
+
+static void* test_failing_calloc(size_t n, size_t size)
+{
+  return test_allocs_left-- > 0 ? test_real_calloc(n, size) : NULL;
+}
+
+static void* test_failing_realloc(void* ptr, size_t size)
+{
+  return test_allocs_left-- > 0 ? test_real_realloc(ptr, size) : NULL;
+}
+
+// only the next [allocs] allocations of pfs succeed, -1 restores the allocator
+static void test_fail_allocs_after(int allocs)
+{
+  if (allocs < 0) {
+    pfs_malloc = test_real_malloc;
+    pfs_calloc = test_real_calloc;
+    pfs_realloc = test_real_realloc;
+    return;
+  }
+  test_allocs_left = allocs;
+  test_real_malloc = pfs_malloc;
+  test_real_calloc = pfs_calloc;
+  test_real_realloc = pfs_realloc;
+  pfs_malloc = test_failing_malloc;
+  pfs_calloc = test_failing_calloc;
+  pfs_realloc = test_failing_realloc;
+}
+
+
+static void test_survives_failed_table_growth(void)
+{
+  char path[32];
+  struct stat st;
+  test_setup();
+  int initial = pfs_get_max_items();
+  // each allocation of the growth fails in turn, until there are enough
+  bool grown = false;
+  for (int allocs = 0; !grown; allocs++) {
+    TEST_ASSERT_TRUE(allocs < 32);
+    test_fail_allocs_after(allocs);
+    grown = pfs_grow_tables();
+    test_fail_allocs_after(-1);
+    TEST_ASSERT_EQUAL(grown ? 2 * initial : initial, pfs_get_max_items());
+  }
+  // none of the slots handed out was given back by the failed attempts
+  for (int i = 0; i < 3 * initial; i++) {
+    snprintf(path, sizeof(path), pfs_base_path "/item_%d.txt", i);
+    test_pfs_create_file_with_text(path, pfs_test_hello_str);
+  }
+  for (int i = 0; i < 3 * initial; i++) {
+    snprintf(path, sizeof(path), pfs_base_path "/item_%d.txt", i);
+    TEST_ASSERT_EQUAL(0, stat(path, &st));
+    TEST_ASSERT_EQUAL(strlen(pfs_test_hello_str), st.st_size);
+  }
+  test_teardown();
+}
+
+
+// adopts [size] bytes as [path] with the partition [slack] bytes short of, or
+// exactly big enough for the memory used once it's adopted
+static void test_adopt_with_room(const char* path, size_t used, size_t size,
+                                 size_t slack)
+{
+  char* payload = (char*)calloc(1, size);
+  TEST_ASSERT_NOT_NULL(payload);
+  pfs_set_partition_size(used + size - slack);
+  if (slack > 0) {
+    TEST_ASSERT_EQUAL(-1, pfs_adopt(path, payload, size));
+    TEST_ASSERT_EQUAL(used, pfs_used_bytes());
+    free(payload);
+  } else {
+    TEST_ASSERT_EQUAL(0, pfs_adopt(path, payload, size));
+    TEST_ASSERT_EQUAL(used + size, pfs_used_bytes());
+  }
+}
+
+
+static void test_can_adopt_over_uncounted_files(void)
+{
+  char buf[32] = {0};
+  size_t partition_size = pfs_get_partition_size();
+  test_setup();
+  // an inline file never counted its entry
+  pfs_set_inline_size(PFS_INLINE_SIZE);
+  test_pfs_create_file_with_text(pfs_base_path "/flag", pfs_test_hello_str);
+  size_t used = pfs_used_bytes();
+  test_adopt_with_room("/flag", used, 1024, 1);
+  test_adopt_with_room("/flag", used, 1024, 0);
+  pfs_set_inline_size(0);
+  pfs_set_partition_size(partition_size);
+  // a clone's data stays counted for the original
+  test_pfs_create_file_with_text(pfs_base_path "/orig", pfs_test_hello_str);
+  TEST_ASSERT_EQUAL(0, pfs_clone("/orig", "/copy"));
+  used = pfs_used_bytes();
+  test_adopt_with_room("/copy", used, 1024, 1);
+  test_adopt_with_room("/copy", used, 1024, 0);
+  FILE* f = fopen(pfs_base_path "/orig", "r");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(strlen(pfs_test_hello_str), fread(buf, 1, sizeof(buf), f));
+  TEST_ASSERT_EQUAL(0, fclose(f));
+  TEST_ASSERT_EQUAL_STRING(pfs_test_hello_str, buf);
+  test_teardown();
+  pfs_set_partition_size(partition_size);
+}
+
+
+static void test_can_empty_large_directory(void)
+{
+  char path[64];
+  test_setup();
+  TEST_ASSERT_EQUAL(0, mkdir(pfs_base_path "/capture", 0755));
+  for (int i = 0; i < 512; i++) {
+    snprintf(path, sizeof(path), pfs_base_path "/capture/%03d.bin", i);
+    test_pfs_create_file_with_text(path, pfs_test_hello_str);
+  }
+  // unlink out of creation order so items get moved around
+  for (int i = 0; i < 512; i++) {
+    snprintf(path, sizeof(path), pfs_base_path "/capture/%03d.bin", (i * 7) % 512);
+    TEST_ASSERT_EQUAL(0, unlink(path));
+  }
+  DIR *dir = opendir(pfs_base_path "/capture");
+  TEST_ASSERT_NOT_NULL(dir);
+  TEST_ASSERT_NULL(readdir(dir));
+  TEST_ASSERT_EQUAL(0, closedir(dir));
+  TEST_ASSERT_EQUAL(0, rmdir(pfs_base_path "/capture"));
+  test_teardown();
+}
+
+
+static void test_can_rename_populated_directory(void)
+{
+  struct stat st;
+  test_setup();
+  test_pfs_create_file_with_text(pfs_base_path "/logs/2024/01/a.txt", pfs_test_hello_str);
+  test_pfs_create_file_with_text(pfs_base_path "/logs/2024/02/b.txt", pfs_test_hello_str);
+  TEST_ASSERT_EQUAL(0, rename(pfs_base_path "/logs/2024", pfs_base_path "/logs/archive"));
+  TEST_ASSERT_NOT_EQUAL(0, stat(pfs_base_path "/logs/2024/01/a.txt", &st));
+  TEST_ASSERT_EQUAL(0, stat(pfs_base_path "/logs/archive/01/a.txt", &st));
+  TEST_ASSERT_EQUAL(strlen(pfs_test_hello_str), st.st_size);
+  TEST_ASSERT_EQUAL(0, stat(pfs_base_path "/logs/archive/02/b.txt", &st));
+  // a directory can't be moved inside itself
+  TEST_ASSERT_NOT_EQUAL(0, rename(pfs_base_path "/logs", pfs_base_path "/logs/archive/logs"));
+  TEST_ASSERT_EQUAL(0, unlink(pfs_base_path "/logs/archive/01/a.txt"));
+  TEST_ASSERT_EQUAL(0, unlink(pfs_base_path "/logs/archive/02/b.txt"));
+  test_teardown();
+}
+
+
+#define PFS_STRESS_THREADS 4
+#define PFS_STRESS_ROUNDS  64
+
+static volatile int pfs_stress_errors = 0;
+
+// each thread rewrites its own files while reading a shared one
+static void* pfs_stress_task(void* arg)
+{
+  int id = (int)(intptr_t)arg;
+  char path[64];
+  char buf[128];
+  for (int r = 0; r < PFS_STRESS_ROUNDS; r++) {
+    snprintf(path, sizeof(path), pfs_base_path "/stress/%d/%d.bin", id, r % 4);
+    FILE* f = fopen(path, "w+");
+    if (f == NULL) {
+      __atomic_add_fetch(&pfs_stress_errors, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    memset(buf, 'a' + id, sizeof(buf));
+    for (int k = 0; k < 8; k++)
+      fwrite(buf, 1, sizeof(buf), f);
+    rewind(f);
+    for (int k = 0; k < 8; k++) {
+      if (fread(buf, 1, sizeof(buf), f) != sizeof(buf) || buf[0] != 'a' + id)
+        __atomic_add_fetch(&pfs_stress_errors, 1, __ATOMIC_RELAXED);
+    }
+    fclose(f);
+    f = fopen(pfs_test_filename, "r");
+    if (f == NULL || fread(buf, 1, 5, f) != 5 || memcmp(buf, pfs_test_hello_str, 5) != 0)
+      __atomic_add_fetch(&pfs_stress_errors, 1, __ATOMIC_RELAXED);
+    if (f != NULL)
+      fclose(f);
+    if (r % 4 == 3 && unlink(path) != 0)
+      __atomic_add_fetch(&pfs_stress_errors, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+static void test_concurrent_access_from_threads(void)
+{
+  pthread_t threads[PFS_STRESS_THREADS];
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, 4096);
+  test_setup();
+  test_pfs_create_file_with_text(pfs_test_filename, pfs_test_hello_str);
+  pfs_stress_errors = 0;
+  for (int i = 0; i < PFS_STRESS_THREADS; i++) {
+    TEST_ASSERT_EQUAL(0, pthread_create(&threads[i], &attr, pfs_stress_task, (void*)(intptr_t)i));
+  }
+  for (int i = 0; i < PFS_STRESS_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  TEST_ASSERT_EQUAL(0, pfs_stress_errors);
+  test_teardown();
+}
+
+
 /*
 static void test_ftell(void)
 {
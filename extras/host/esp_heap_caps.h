@@ -0,0 +1,16 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "esp_err.h"
+#define MALLOC_CAP_8BIT     (1 << 2)
+#define MALLOC_CAP_SPIRAM   (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+#define MALLOC_CAP_DEFAULT  (1 << 12)
+static inline void *heap_caps_malloc(size_t size, uint32_t caps) { (void)caps; return malloc(size); }
+static inline void *heap_caps_calloc(size_t n, size_t size, uint32_t caps) { (void)caps; return calloc(n, size); }
+static inline void *heap_caps_realloc(void *ptr, size_t size, uint32_t caps) { (void)caps; return realloc(ptr, size); }
+static inline size_t heap_caps_get_free_size(uint32_t caps) { (void)caps; return 64 * 1024 * 1024; }
+static inline size_t heap_caps_get_largest_free_block(uint32_t caps) { (void)caps; return 64 * 1024 * 1024; }
+static inline bool esp_ptr_external_ram(const void *ptr) { (void)ptr; return false; }
@@ -0,0 +1,9 @@
+#pragma once
+#include <stdio.h>
+// errors and warnings are expected (full partition), the rest is muted
+#define PFS_HOST_LOG(t, f, ...) do { if (0) fprintf(stderr, "%s: " f "\n", t, ##__VA_ARGS__); } while (0)
+#define ESP_LOGE(t, f, ...) PFS_HOST_LOG(t, f, ##__VA_ARGS__)
+#define ESP_LOGW(t, f, ...) PFS_HOST_LOG(t, f, ##__VA_ARGS__)
+#define ESP_LOGI(t, f, ...) PFS_HOST_LOG(t, f, ##__VA_ARGS__)
+#define ESP_LOGD(t, f, ...) PFS_HOST_LOG(t, f, ##__VA_ARGS__)
+#define ESP_LOGV(t, f, ...) PFS_HOST_LOG(t, f, ##__VA_ARGS__)
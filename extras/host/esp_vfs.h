@@ -0,0 +1,42 @@
+#pragma once
+#include <dirent.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "esp_err.h"
+#define ESP_VFS_FLAG_DEFAULT 0
+typedef struct {
+  int flags;
+  ssize_t (*write)(int, const void *, size_t);
+  off_t (*lseek)(int, off_t, int);
+  ssize_t (*read)(int, void *, size_t);
+  ssize_t (*pread)(int, void *, size_t, off_t);
+  ssize_t (*pwrite)(int, const void *, size_t, off_t);
+  int (*open)(const char *, int, int);
+  int (*close)(int);
+  int (*fstat)(int, struct stat *);
+  int (*stat)(const char *, struct stat *);
+  int (*link)(const char *, const char *);
+  int (*unlink)(const char *);
+  int (*rename)(const char *, const char *);
+  DIR *(*opendir)(const char *);
+  struct dirent *(*readdir)(DIR *);
+  int (*readdir_r)(DIR *, struct dirent *, struct dirent **);
+  long (*telldir)(DIR *);
+  void (*seekdir)(DIR *, long);
+  int (*closedir)(DIR *);
+  int (*mkdir)(const char *, mode_t);
+  int (*rmdir)(const char *);
+  int (*fcntl)(int, int, int);
+  int (*ioctl)(int, int, va_list);
+  int (*fsync)(int);
+  int (*access)(const char *, int);
+  int (*truncate)(const char *, off_t);
+  int (*ftruncate)(int, off_t);
+  int (*utime)(const char *, const void *);
+} esp_vfs_t;
+// the registered functions are called directly instead of through newlib
+extern esp_vfs_t pfs_host_vfs;
+static inline esp_err_t esp_vfs_register(const char *base, const esp_vfs_t *vfs, void *ctx) { (void)base; (void)ctx; pfs_host_vfs = *vfs; return ESP_OK; }
+static inline esp_err_t esp_vfs_unregister(const char *base) { (void)base; return ESP_OK; }
@@ -0,0 +1,9 @@
+// minimal esp-idf shims so that pfs.c builds on the host tools in extras/
+#pragma once
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <alloca.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
@@ -0,0 +1,179 @@
+/*\
+
+  MIT License
+
+  Copyright (c) 2021-now tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+\*/
+
+// Host benchmark for the block codec used by compressed files
+//
+//   pfsbench [-b block_size] <file>...
+//
+// Each file is compressed block by block like PSRamFS does, then
+// decompressed and checked. Prints the ratio and the speed of both ways.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pfs_lz.h"
+
+#define MIN_SECONDS 0.2 // each measure repeats until it lasts that long
+
+typedef struct
+{
+  size_t raw;
+  size_t stored;
+  double compress_s;   // per pass
+  double decompress_s; // per pass
+} result_t;
+
+
+static double now( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// compresses [len] bytes of [src] in [block] sized pieces, stored as is when
+// they don't shrink, returns the stored size
+static size_t compress_blocks( const uint8_t* src, size_t len, size_t block, uint8_t* dst, size_t* lens, uint16_t* table )
+{
+  size_t stored = 0;
+  for( size_t pos=0, i=0; pos<len; pos+=block, i++ ) {
+    size_t n = len - pos < block ? len - pos : block;
+    size_t c = pfs_lz_compress( &src[pos], n, &dst[stored], n - 1, table );
+    if( c == 0 ) {
+      memcpy( &dst[stored], &src[pos], n );
+      c = n;
+    }
+    lens[i] = c;
+    stored += c;
+  }
+  return stored;
+}
+
+
+static int decompress_blocks( const uint8_t* src, size_t len, size_t block, uint8_t* dst, const size_t* lens )
+{
+  size_t stored = 0;
+  for( size_t pos=0, i=0; pos<len; pos+=block, i++ ) {
+    size_t n = len - pos < block ? len - pos : block;
+    if( lens[i] == n ) memcpy( &dst[pos], &src[stored], n );
+    else if( pfs_lz_decompress( &src[stored], lens[i], &dst[pos], n ) != n ) return -1;
+    stored += lens[i];
+  }
+  return 0;
+}
+
+
+static int bench( const char* path, size_t block, result_t* res )
+{
+  static uint16_t table[PFS_LZ_HASH_SIZE];
+  FILE* f = fopen( path, "rb" );
+  if( f == NULL ) {
+    perror( path );
+    return -1;
+  }
+  fseek( f, 0, SEEK_END );
+  long len = ftell( f );
+  rewind( f );
+  uint8_t* src = malloc( len + 1 );
+  uint8_t* dst = malloc( len + 1 );
+  uint8_t* out = malloc( len + 1 );
+  size_t* lens = malloc( ( len / block + 1 ) * sizeof(size_t) );
+  int ok = src && dst && out && lens && fread( src, 1, len, f ) == (size_t)len;
+  fclose( f );
+
+  if( ok ) {
+    int passes = 0;
+    double start = now(), elapsed;
+    do {
+      res->stored = compress_blocks( src, len, block, dst, lens, table );
+      passes++;
+    } while( ( elapsed = now() - start ) < MIN_SECONDS );
+    res->compress_s = elapsed / passes;
+
+    passes = 0;
+    start = now();
+    do {
+      ok = decompress_blocks( dst, len, block, out, lens ) == 0;
+      passes++;
+    } while( ok && ( elapsed = now() - start ) < MIN_SECONDS );
+    res->decompress_s = elapsed / passes;
+    res->raw = len;
+    ok = ok && memcmp( src, out, len ) == 0;
+    if( !ok ) fprintf( stderr, "%s: round trip mismatch\n", path );
+  }
+  free( src );
+  free( dst );
+  free( out );
+  free( lens );
+  return ok ? 0 : -1;
+}
+
+
+static void print( const char* name, const result_t* res )
+{
+  double mb = res->raw / 1e6;
+  printf( "%-32s %10zu %10zu %6.2f %10.1f %10.1f\n", name, res->raw, res->stored,
+    res->stored ? (double)res->raw / res->stored : 0,
+    res->compress_s > 0 ? mb / res->compress_s : 0,
+    res->decompress_s > 0 ? mb / res->decompress_s : 0 );
+}
+
+
+int main( int argc, char** argv )
+{
+  size_t block = 4096; // PFS_Z_BLOCK_SIZE
+  int first = 1;
+  if( argc > 2 && strcmp( argv[1], "-b" ) == 0 ) {
+    block = strtoul( argv[2], NULL, 0 );
+    first = 3;
+  }
+  if( first >= argc || block < 16 || block > PFS_LZ_MAX_INPUT ) {
+    fprintf( stderr, "Usage: %s [-b block_size] <file>...\n", argv[0] );
+    return 2;
+  }
+
+  result_t total = {0};
+  int errors = 0;
+  printf( "%-32s %10s %10s %6s %10s %10s\n", "file", "raw", "stored", "ratio", "comp MB/s", "dec MB/s" );
+  for( int i=first; i<argc; i++ ) {
+    result_t res = {0};
+    if( bench( argv[i], block, &res ) != 0 ) {
+      errors++;
+      continue;
+    }
+    const char* name = strrchr( argv[i], '/' );
+    print( name ? name + 1 : argv[i], &res );
+    total.raw += res.raw;
+    total.stored += res.stored;
+    total.compress_s += res.compress_s;
+    total.decompress_s += res.decompress_s;
+  }
+  print( "total", &total );
+  return errors ? 1 : 0;
+}
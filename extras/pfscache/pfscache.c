@@ -0,0 +1,225 @@
+/*\
+
+  MIT License
+
+  Copyright (c) 2021-now tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+\*/
+
+// Host benchmark for the cache mode
+//
+//   pfscache [-n objects] [-r requests] [-s zipf_exponent] [-p phases]
+//
+// Replays a Zipf-distributed trace of object requests against pfs: a hit
+// reads the file back, a miss writes it (as if fetched from the network).
+// The popular objects change with each phase of the trace, like assets
+// being replaced by new versions. Each partition size runs with and without
+// cache mode ("lru" and "fill", which keeps what was stored first), and
+// prints the hit rate, the evictions and the time per request.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pfs.h"
+#include "esp_vfs.h"
+
+#define MIN_OBJECT_SIZE 512
+#define MAX_OBJECT_SIZE 16384
+
+esp_vfs_t pfs_host_vfs;
+
+typedef struct
+{
+  size_t hits;
+  size_t misses;
+  size_t rejected;  // misses that couldn't be stored
+  size_t evictions;
+  double seconds;
+} result_t;
+
+static uint8_t buf[MAX_OBJECT_SIZE];
+
+
+static double now( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static uint32_t xorshift( uint32_t* state )
+{
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+
+// cumulative distribution of ranks 1..n with weights 1/rank^s
+static double* zipf_cdf( size_t n, double s )
+{
+  double* cdf = malloc( n * sizeof(double) );
+  if( cdf == NULL ) return NULL;
+  double sum = 0;
+  for( size_t i=0; i<n; i++ ) {
+    sum += 1.0 / pow( i + 1, s );
+    cdf[i] = sum;
+  }
+  for( size_t i=0; i<n; i++ ) cdf[i] /= sum;
+  return cdf;
+}
+
+
+static size_t zipf_pick( const double* cdf, size_t n, uint32_t* state )
+{
+  double u = xorshift( state ) / 4294967296.0;
+  size_t lo = 0, hi = n - 1;
+  while( lo < hi ) {
+    size_t mid = ( lo + hi ) / 2;
+    if( cdf[mid] < u ) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+
+static bool store( const char* path, size_t id, size_t size )
+{
+  int fd = pfs_host_vfs.open( path, O_WRONLY | O_CREAT | O_TRUNC, 0 );
+  if( fd < 0 ) return false;
+  memset( buf, (uint8_t)id, size );
+  bool ok = pfs_host_vfs.write( fd, buf, size ) == (ssize_t)size;
+  pfs_host_vfs.close( fd );
+  if( !ok ) pfs_host_vfs.unlink( path ); // don't keep a partial object
+  return ok;
+}
+
+
+// returns 1 on hit, 0 on miss, -1 when the cached object is corrupted
+static int fetch( const char* path, size_t id, size_t size )
+{
+  int fd = pfs_host_vfs.open( path, O_RDONLY, 0 );
+  if( fd < 0 ) return 0;
+  ssize_t len = pfs_host_vfs.read( fd, buf, sizeof(buf) );
+  pfs_host_vfs.close( fd );
+  if( len != (ssize_t)size || buf[0] != (uint8_t)id || buf[size - 1] != (uint8_t)id ) return -1;
+  return 1;
+}
+
+
+static int replay( const double* cdf, const size_t* sizes, size_t objects, size_t requests, size_t phases, size_t partition, bool cache_mode, result_t* res )
+{
+  char path[32];
+  uint32_t state = 2463534242u; // same trace for every run
+  memset( res, 0, sizeof(result_t) );
+  pfs_set_partition_size( partition );
+  esp_vfs_pfs_conf_t conf = { .base_path = "/cache", .partition_label = "psram" };
+  if( esp_vfs_pfs_register( &conf ) != ESP_OK ) return -1;
+  pfs_set_cache_mode( cache_mode );
+
+  int ret = 0;
+  double start = now();
+  for( size_t i=0; i<requests; i++ ) {
+    size_t phase = i * phases / requests;
+    size_t id = ( zipf_pick( cdf, objects, &state ) + phase * objects / phases ) % objects;
+    snprintf( path, sizeof(path), "/obj%zu", id );
+    int hit = fetch( path, id, sizes[id] );
+    if( hit < 0 ) {
+      fprintf( stderr, "%s: corrupted object\n", path );
+      ret = -1;
+      break;
+    }
+    if( hit ) {
+      res->hits++;
+    } else {
+      res->misses++;
+      if( !store( path, id, sizes[id] ) ) res->rejected++;
+    }
+  }
+  res->seconds = now() - start;
+  res->evictions = pfs_evictions();
+
+  pfs_set_cache_mode( false );
+  esp_vfs_pfs_unregister( "/cache" );
+  return ret;
+}
+
+
+static void print( size_t partition, size_t total, const char* mode, const result_t* res, size_t requests )
+{
+  printf( "%10zu %5.1f%% %-9s %7.2f%% %10zu %10zu %8.2f\n", partition, 100.0 * partition / total, mode,
+    100.0 * res->hits / requests, res->rejected, res->evictions, 1e6 * res->seconds / requests );
+}
+
+
+int main( int argc, char** argv )
+{
+  size_t objects = 2000;
+  size_t requests = 200000;
+  double s = 0.9;
+  size_t phases = 4;
+  for( int i=1; i<argc; i+=2 ) {
+    if( i + 1 >= argc ) goto usage;
+    if( strcmp( argv[i], "-n" ) == 0 ) objects = strtoul( argv[i+1], NULL, 0 );
+    else if( strcmp( argv[i], "-r" ) == 0 ) requests = strtoul( argv[i+1], NULL, 0 );
+    else if( strcmp( argv[i], "-s" ) == 0 ) s = strtod( argv[i+1], NULL );
+    else if( strcmp( argv[i], "-p" ) == 0 ) phases = strtoul( argv[i+1], NULL, 0 );
+    else goto usage;
+  }
+  if( objects == 0 || requests == 0 || s <= 0 || phases == 0 || phases > objects ) goto usage;
+
+  double* cdf = zipf_cdf( objects, s );
+  size_t* sizes = malloc( objects * sizeof(size_t) );
+  if( cdf == NULL || sizes == NULL ) return 1;
+  uint32_t state = 88172645u;
+  size_t total = 0;
+  for( size_t i=0; i<objects; i++ ) {
+    sizes[i] = MIN_OBJECT_SIZE + xorshift( &state ) % ( MAX_OBJECT_SIZE - MIN_OBJECT_SIZE + 1 );
+    total += sizes[i];
+  }
+  pfs_set_max_open_files( 4 );
+
+  printf( "%zu objects (%zu bytes), %zu requests, zipf s=%.2f, %zu phases\n\n", objects, total, requests, s, phases );
+  printf( "%10s %6s %-9s %8s %10s %10s %8s\n", "partition", "", "mode", "hits", "rejected", "evictions", "us/req" );
+  static const double fractions[] = { 0.05, 0.1, 0.25, 0.5 };
+  int ret = 0;
+  for( size_t f=0; f<sizeof(fractions)/sizeof(fractions[0]) && ret==0; f++ ) {
+    size_t partition = total * fractions[f];
+    result_t res;
+    ret |= replay( cdf, sizes, objects, requests, phases, partition, false, &res );
+    print( partition, total, "fill", &res, requests );
+    ret |= replay( cdf, sizes, objects, requests, phases, partition, true, &res );
+    print( partition, total, "lru", &res, requests );
+  }
+  free( cdf );
+  free( sizes );
+  return ret ? 1 : 0;
+
+usage:
+  fprintf( stderr, "Usage: %s [-n objects] [-r requests] [-s zipf_exponent] [-p phases]\n", argv[0] );
+  return 2;
+}
@@ -0,0 +1,295 @@
+/*\
+
+  MIT License
+
+  Copyright (c) 2021-now tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+\*/
+
+// Host tool for PSRamFS images (see src/pfs_image.h for the format)
+//
+//   pfsimage pack <dir> <image>    builds an image from a host directory
+//   pfsimage unpack <image> <dir>  restores an image into a host directory
+//   pfsimage list <image>          prints the image contents
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "pfs_image.h"
+
+// host path of each directory, indexed by directory number
+typedef struct
+{
+  char** paths;
+  size_t count;
+  size_t capacity;
+} dir_list_t;
+
+
+static int dir_list_add( dir_list_t* list, const char* path )
+{
+  if( list->count == list->capacity ) {
+    size_t capacity = list->capacity ? list->capacity * 2 : 16;
+    char** paths = realloc( list->paths, capacity * sizeof(char*) );
+    if( paths == NULL ) return -1;
+    list->paths = paths;
+    list->capacity = capacity;
+  }
+  list->paths[list->count] = strdup( path );
+  if( list->paths[list->count] == NULL ) return -1;
+  list->count++;
+  return 0;
+}
+
+
+static void dir_list_free( dir_list_t* list )
+{
+  for( size_t i=0; i<list->count; i++ ) free( list->paths[i] );
+  free( list->paths );
+}
+
+
+static size_t file_write( void* ctx, const void* data, size_t len )
+{
+  return fwrite( data, 1, len, (FILE*)ctx );
+}
+
+
+static size_t file_read( void* ctx, void* data, size_t len )
+{
+  return fread( data, 1, len, (FILE*)ctx );
+}
+
+
+static int put_record( FILE* out, uint8_t type, uint32_t parent, const char* name )
+{
+  uint8_t record[PFS_IMAGE_RECORD_SIZE];
+  size_t len = name ? strlen( name ) : 0;
+  if( len > PFS_IMAGE_NAME_MAX ) {
+    fprintf( stderr, "Name too long: %s\n", name );
+    return -1;
+  }
+  record[0] = type;
+  pfs_image_put_u32( &record[1], parent );
+  pfs_image_put_u16( &record[5], len );
+  if( file_write( out, record, sizeof(record) ) != sizeof(record) ) return -1;
+  if( len > 0 && file_write( out, name, len ) != len ) return -1;
+  return 0;
+}
+
+
+static int put_contents( FILE* out, const char* path, off_t size )
+{
+  uint8_t buf[4096];
+  uint8_t size_le[4];
+  if( size > UINT32_MAX ) {
+    fprintf( stderr, "File too large: %s\n", path );
+    return -1;
+  }
+  FILE* in = fopen( path, "rb" );
+  if( in == NULL ) {
+    fprintf( stderr, "Can't open %s: %s\n", path, strerror(errno) );
+    return -1;
+  }
+  pfs_image_put_u32( size_le, size );
+  int res = file_write( out, size_le, sizeof(size_le) ) == sizeof(size_le) ? 0 : -1;
+  while( res == 0 && size > 0 ) {
+    size_t len = size < (off_t)sizeof(buf) ? (size_t)size : sizeof(buf);
+    if( fread( buf, 1, len, in ) != len || file_write( out, buf, len ) != len ) res = -1;
+    size -= len;
+  }
+  fclose( in );
+  return res;
+}
+
+
+// breadth first like the device export, entries sorted so the same tree
+// always gives the same image
+static int pack( const char* root, const char* image )
+{
+  dir_list_t dirs = {0};
+  FILE* out = fopen( image, "wb" );
+  if( out == NULL ) {
+    fprintf( stderr, "Can't create %s: %s\n", image, strerror(errno) );
+    return -1;
+  }
+  uint8_t header[PFS_IMAGE_HEADER_SIZE];
+  memcpy( header, PFS_IMAGE_MAGIC, 4 );
+  pfs_image_put_u16( &header[4], PFS_IMAGE_VERSION );
+  pfs_image_put_u16( &header[6], 0 );
+  int res = file_write( out, header, sizeof(header) ) == sizeof(header) ? 0 : -1;
+  if( res == 0 ) res = dir_list_add( &dirs, root );
+
+  for( size_t number=0; res == 0 && number < dirs.count; number++ ) {
+    struct dirent** entries;
+    int count = scandir( dirs.paths[number], &entries, NULL, alphasort );
+    if( count < 0 ) {
+      fprintf( stderr, "Can't read %s: %s\n", dirs.paths[number], strerror(errno) );
+      res = -1;
+      break;
+    }
+    for( int i=0; i<count; i++ ) {
+      const char* name = entries[i]->d_name;
+      char path[PATH_MAX];
+      struct stat st;
+      if( res != 0 || strcmp( name, "." ) == 0 || strcmp( name, ".." ) == 0 ) {
+        free( entries[i] );
+        continue;
+      }
+      if( snprintf( path, sizeof(path), "%s/%s", dirs.paths[number], name ) >= (int)sizeof(path) ) {
+        fprintf( stderr, "Path too long: %s/%s\n", dirs.paths[number], name );
+        res = -1;
+      } else if( stat( path, &st ) != 0 ) {
+        fprintf( stderr, "Can't stat %s: %s\n", path, strerror(errno) );
+        res = -1;
+      } else if( S_ISDIR( st.st_mode ) ) {
+        res = put_record( out, PFS_IMAGE_DIR, number, name );
+        if( res == 0 ) res = dir_list_add( &dirs, path );
+      } else if( S_ISREG( st.st_mode ) ) {
+        res = put_record( out, PFS_IMAGE_FILE, number, name );
+        if( res == 0 ) res = put_contents( out, path, st.st_size );
+      } else {
+        fprintf( stderr, "Skipping %s (not a file or directory)\n", path );
+      }
+      free( entries[i] );
+    }
+    free( entries );
+  }
+
+  if( res == 0 ) res = put_record( out, PFS_IMAGE_END, 0, NULL );
+  if( fclose( out ) != 0 ) res = -1;
+  dir_list_free( &dirs );
+  if( res != 0 ) fprintf( stderr, "Failed to pack %s\n", root );
+  return res;
+}
+
+
+// walks the image, restoring it under [root] unless [root] is NULL
+static int walk( const char* image, const char* root )
+{
+  dir_list_t dirs = {0};
+  uint8_t header[PFS_IMAGE_HEADER_SIZE];
+  char name[PFS_IMAGE_NAME_MAX + 1];
+  uint8_t buf[4096];
+  int res = -1;
+
+  FILE* in = fopen( image, "rb" );
+  if( in == NULL ) {
+    fprintf( stderr, "Can't open %s: %s\n", image, strerror(errno) );
+    return -1;
+  }
+  if( file_read( in, header, sizeof(header) ) != sizeof(header) || memcmp( header, PFS_IMAGE_MAGIC, 4 ) != 0 ) {
+    fprintf( stderr, "%s is not a pfs image\n", image );
+    goto done;
+  }
+  if( pfs_image_get_u16( &header[4] ) > PFS_IMAGE_VERSION ) {
+    fprintf( stderr, "Unsupported image version %d\n", pfs_image_get_u16( &header[4] ) );
+    goto done;
+  }
+  if( root && mkdir( root, 0755 ) != 0 && errno != EEXIST ) {
+    fprintf( stderr, "Can't create %s: %s\n", root, strerror(errno) );
+    goto done;
+  }
+  if( dir_list_add( &dirs, root ? root : "" ) != 0 ) goto done;
+
+  while( 1 ) {
+    uint8_t record[PFS_IMAGE_RECORD_SIZE];
+    char path[PATH_MAX];
+    if( file_read( in, record, sizeof(record) ) != sizeof(record) ) break;
+    if( record[0] == PFS_IMAGE_END ) {
+      res = 0;
+      break;
+    }
+    uint32_t parent = pfs_image_get_u32( &record[1] );
+    size_t len = pfs_image_get_u16( &record[5] );
+    if( parent >= dirs.count || len == 0 || file_read( in, name, len ) != len ) break;
+    name[len] = '\0';
+    if( memchr( name, '/', len ) || strcmp( name, "." ) == 0 || strcmp( name, ".." ) == 0 ) {
+      fprintf( stderr, "Invalid name in image: %s\n", name );
+      break;
+    }
+    if( snprintf( path, sizeof(path), "%s/%s", dirs.paths[parent], name ) >= (int)sizeof(path) ) {
+      fprintf( stderr, "Path too long: %s/%s\n", dirs.paths[parent], name );
+      break;
+    }
+
+    if( record[0] == PFS_IMAGE_DIR ) {
+      if( root == NULL ) printf( "%s/\n", path );
+      else if( mkdir( path, 0755 ) != 0 && errno != EEXIST ) {
+        fprintf( stderr, "Can't create %s: %s\n", path, strerror(errno) );
+        break;
+      }
+      if( dir_list_add( &dirs, path ) != 0 ) break;
+    } else if( record[0] == PFS_IMAGE_FILE ) {
+      uint8_t size_le[4];
+      if( file_read( in, size_le, sizeof(size_le) ) != sizeof(size_le) ) break;
+      uint32_t size = pfs_image_get_u32( size_le );
+      FILE* out = NULL;
+      if( root == NULL ) printf( "%s %u\n", path, size );
+      else if( ( out = fopen( path, "wb" ) ) == NULL ) {
+        fprintf( stderr, "Can't create %s: %s\n", path, strerror(errno) );
+        break;
+      }
+      while( size > 0 ) {
+        size_t chunk = size < sizeof(buf) ? size : sizeof(buf);
+        if( file_read( in, buf, chunk ) != chunk ) break;
+        if( out && fwrite( buf, 1, chunk, out ) != chunk ) break;
+        size -= chunk;
+      }
+      if( out && fclose( out ) != 0 ) break;
+      if( size > 0 ) break;
+    } else {
+      fprintf( stderr, "Unknown record type %d\n", record[0] );
+      break;
+    }
+  }
+  if( res != 0 ) fprintf( stderr, "%s is truncated or corrupted\n", image );
+
+done:
+  fclose( in );
+  dir_list_free( &dirs );
+  return res;
+}
+
+
+static int usage( const char* self )
+{
+  fprintf( stderr,
+    "Usage:\n"
+    "  %s pack <dir> <image>\n"
+    "  %s unpack <image> <dir>\n"
+    "  %s list <image>\n", self, self, self );
+  return 2;
+}
+
+
+int main( int argc, char** argv )
+{
+  if( argc == 4 && strcmp( argv[1], "pack" ) == 0 ) return pack( argv[2], argv[3] ) == 0 ? 0 : 1;
+  if( argc == 4 && strcmp( argv[1], "unpack" ) == 0 ) return walk( argv[2], argv[3] ) == 0 ? 0 : 1;
+  if( argc == 3 && strcmp( argv[1], "list" ) == 0 ) return walk( argv[2], NULL ) == 0 ? 0 : 1;
+  return usage( argv[0] );
+}
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Round-trips a sample tree through pfsimage and checks nothing changed
+set -e
+
+cd "$(dirname "$0")"
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+mkdir -p "$work/tree/logs/old" "$work/tree/empty"
+printf 'Hello, World!\n' > "$work/tree/hello.txt"
+: > "$work/tree/logs/empty.log"
+head -c 100000 /dev/urandom > "$work/tree/logs/old/random.bin"
+head -c 5000 /dev/zero > "$work/tree/zeroes.bin"
+
+./pfsimage pack "$work/tree" "$work/tree.img"
+./pfsimage list "$work/tree.img" > "$work/list.txt"
+grep -q '^/logs/old/random.bin 100000$' "$work/list.txt"
+./pfsimage unpack "$work/tree.img" "$work/copy"
+diff -r "$work/tree" "$work/copy"
+
+# same tree, same image
+./pfsimage pack "$work/copy" "$work/copy.img"
+cmp "$work/tree.img" "$work/copy.img"
+
+# truncated images are refused
+head -c 1000 "$work/tree.img" > "$work/cut.img"
+if ./pfsimage unpack "$work/cut.img" "$work/cut" 2>/dev/null; then
+  echo "truncated image accepted"
+  exit 1
+fi
+
+echo "pfsimage: all tests passed"
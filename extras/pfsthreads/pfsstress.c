@@ -0,0 +1,361 @@
+/*\
+
+  MIT License
+
+  Copyright (c) 2021-now tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+\*/
+
+// Host stress and throughput test for the locks
+//
+//   pfsstress [-t threads] [-i iterations]
+//
+// The stress part runs writers, readers and an appender at the same time:
+// each writer fills, checks, renames and unlinks files in its own folder,
+// readers stream a file the appender keeps growing, stat it and list the
+// root. Every byte read is checked. The throughput part then reads
+// different files, then all the same file, from 1 up to [threads] threads
+// and prints the MB/s, which should grow with the thread count on a
+// multi-core host. The lookup part does the same with stat() calls, alone
+// and while a writer keeps creating and unlinking files: readers don't
+// lock, so a writer shouldn't slow them much. Exits with 1 when any check
+// failed.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pfs.h"
+#include "esp_vfs.h"
+
+#define CHUNK_SIZE   256
+#define SHARED_CHUNK 100 // appender writes, readers check them as they come
+#define BENCH_SIZE   ( 1024 * 1024 ) // per file, for the throughput part
+#define BENCH_SECONDS 0.5
+
+esp_vfs_t pfs_host_vfs;
+
+static int iterations = 2000;
+static int errors = 0;
+static bool appending = false;
+
+
+static double now( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void fail( const char* what, const char* path )
+{
+  fprintf( stderr, "%s: %s\n", path, what );
+  __atomic_add_fetch( &errors, 1, __ATOMIC_RELAXED );
+}
+
+
+// fills, checks, renames and unlinks files in its own folder
+static void* writer_task( void* arg )
+{
+  int id = (int)(intptr_t)arg;
+  char path[32], moved[32];
+  uint8_t chunk[CHUNK_SIZE];
+  for( int i=0; i<iterations; i++ ) {
+    snprintf( path, sizeof(path), "/w%d/f%d", id, i % 8 );
+    int fd = pfs_host_vfs.open( path, O_RDWR | O_CREAT | O_TRUNC, 0 );
+    if( fd < 0 ) {
+      fail( "can't create", path );
+      continue;
+    }
+    for( int c=0; c<16; c++ ) {
+      memset( chunk, id * 16 + c, sizeof(chunk) );
+      if( pfs_host_vfs.write( fd, chunk, sizeof(chunk) ) != sizeof(chunk) ) fail( "short write", path );
+    }
+    pfs_host_vfs.lseek( fd, 0, SEEK_SET );
+    for( int c=0; c<16; c++ ) {
+      if( pfs_host_vfs.read( fd, chunk, sizeof(chunk) ) != sizeof(chunk) || chunk[0] != (uint8_t)( id * 16 + c ) || chunk[CHUNK_SIZE-1] != chunk[0] ) {
+        fail( "corrupted", path );
+        break;
+      }
+    }
+    pfs_host_vfs.close( fd );
+    if( i % 3 == 0 ) {
+      snprintf( moved, sizeof(moved), "/w%d/g%d", id, i );
+      if( pfs_host_vfs.rename( path, moved ) != 0 ) fail( "can't rename", path );
+      else if( pfs_host_vfs.unlink( moved ) != 0 ) fail( "can't unlink", moved );
+    }
+  }
+  return NULL;
+}
+
+
+// streams the shared file while it grows, stats it and lists the root
+static void* reader_task( void* arg )
+{
+  (void)arg;
+  uint8_t chunk[512];
+  struct stat st;
+  do {
+    int fd = pfs_host_vfs.open( "/shared.bin", O_RDONLY, 0 );
+    if( fd < 0 ) {
+      fail( "can't open", "/shared.bin" );
+      break;
+    }
+    ssize_t len;
+    while( ( len = pfs_host_vfs.read( fd, chunk, sizeof(chunk) ) ) > 0 ) {
+      if( memchr( chunk, 0, len ) != NULL ) {
+        fail( "corrupted", "/shared.bin" );
+        break;
+      }
+    }
+    pfs_host_vfs.close( fd );
+    if( pfs_host_vfs.stat( "/shared.bin", &st ) != 0 || st.st_size % SHARED_CHUNK != 0 ) fail( "bad stat", "/shared.bin" );
+    DIR* dir = pfs_host_vfs.opendir( "/" );
+    while( dir != NULL && pfs_host_vfs.readdir( dir ) != NULL );
+    if( dir != NULL ) pfs_host_vfs.closedir( dir );
+  } while( __atomic_load_n( &appending, __ATOMIC_RELAXED ) );
+  return NULL;
+}
+
+
+static void* appender_task( void* arg )
+{
+  (void)arg;
+  uint8_t chunk[SHARED_CHUNK];
+  memset( chunk, 'S', sizeof(chunk) );
+  int fd = pfs_host_vfs.open( "/shared.bin", O_WRONLY | O_APPEND, 0 );
+  for( int i=0; i<iterations * 16; i++ ) {
+    if( pfs_host_vfs.write( fd, chunk, sizeof(chunk) ) != sizeof(chunk) ) fail( "short append", "/shared.bin" );
+  }
+  pfs_host_vfs.close( fd );
+  __atomic_store_n( &appending, false, __ATOMIC_RELAXED );
+  return NULL;
+}
+
+
+static void stress( int threads )
+{
+  pthread_t tasks[2 * threads + 1];
+  int fd = pfs_host_vfs.open( "/shared.bin", O_WRONLY | O_CREAT | O_TRUNC, 0 );
+  pfs_host_vfs.close( fd );
+  __atomic_store_n( &appending, true, __ATOMIC_RELAXED );
+  double start = now();
+  pthread_create( &tasks[0], NULL, appender_task, NULL );
+  for( int i=0; i<threads; i++ ) {
+    pthread_create( &tasks[1 + i], NULL, writer_task, (void*)(intptr_t)i );
+    pthread_create( &tasks[1 + threads + i], NULL, reader_task, NULL );
+  }
+  for( int i=0; i<2 * threads + 1; i++ ) pthread_join( tasks[i], NULL );
+  printf( "stress: %d writers, %d readers, 1 appender, %d iterations: %d errors in %.2fs\n",
+    threads, threads, iterations, errors, now() - start );
+}
+
+
+typedef struct
+{
+  const char* path;
+  size_t bytes; // read, out
+} bench_arg_t;
+
+
+static bool benching = false;
+
+static void* bench_task( void* arg )
+{
+  bench_arg_t* bench = arg;
+  static __thread uint8_t chunk[4096];
+  int fd = pfs_host_vfs.open( bench->path, O_RDONLY, 0 );
+  if( fd < 0 ) {
+    fail( "can't open", bench->path );
+    return NULL;
+  }
+  while( __atomic_load_n( &benching, __ATOMIC_RELAXED ) ) {
+    ssize_t len = pfs_host_vfs.pread( fd, chunk, sizeof(chunk), bench->bytes % BENCH_SIZE );
+    if( len <= 0 ) {
+      fail( "short read", bench->path );
+      break;
+    }
+    bench->bytes += len;
+  }
+  pfs_host_vfs.close( fd );
+  return NULL;
+}
+
+
+// every thread reads its own file, or all of them the first one
+static double bench( int threads, bool same_file )
+{
+  pthread_t tasks[threads];
+  bench_arg_t args[threads];
+  static const char* paths[] = { "/b0", "/b1", "/b2", "/b3", "/b4", "/b5", "/b6", "/b7" };
+  __atomic_store_n( &benching, true, __ATOMIC_RELAXED );
+  for( int i=0; i<threads; i++ ) {
+    args[i].path = paths[same_file ? 0 : i % 8];
+    args[i].bytes = 0;
+    pthread_create( &tasks[i], NULL, bench_task, &args[i] );
+  }
+  double start = now();
+  struct timespec pause = { 0, (long)( BENCH_SECONDS * 1e9 ) };
+  nanosleep( &pause, NULL );
+  __atomic_store_n( &benching, false, __ATOMIC_RELAXED );
+  size_t bytes = 0;
+  for( int i=0; i<threads; i++ ) {
+    pthread_join( tasks[i], NULL );
+    bytes += args[i].bytes;
+  }
+  return bytes / 1e6 / ( now() - start );
+}
+
+
+static void throughput( int threads )
+{
+  static uint8_t data[BENCH_SIZE];
+  char path[8];
+  memset( data, 'B', sizeof(data) );
+  for( int i=0; i<8; i++ ) {
+    snprintf( path, sizeof(path), "/b%d", i );
+    int fd = pfs_host_vfs.open( path, O_WRONLY | O_CREAT | O_TRUNC, 0 );
+    if( pfs_host_vfs.write( fd, data, sizeof(data) ) != sizeof(data) ) fail( "short write", path );
+    pfs_host_vfs.close( fd );
+  }
+  printf( "\n%8s %16s %16s\n", "readers", "own file MB/s", "same file MB/s" );
+  for( int n=1; n<=threads; n*=2 ) {
+    double own = bench( n, false );
+    double same = bench( n, true );
+    printf( "%8d %16.0f %16.0f\n", n, own, same );
+  }
+}
+
+
+static bool churning = false;
+
+static void* lookup_task( void* arg )
+{
+  bench_arg_t* bench = arg;
+  struct stat st;
+  while( __atomic_load_n( &benching, __ATOMIC_RELAXED ) ) {
+    if( pfs_host_vfs.stat( bench->path, &st ) != 0 || st.st_size != BENCH_SIZE ) {
+      fail( "bad stat", bench->path );
+      break;
+    }
+    bench->bytes++; // lookups here
+  }
+  return NULL;
+}
+
+
+// churns the namespace while the readers look files up
+static void* churn_task( void* arg )
+{
+  (void)arg;
+  char path[16];
+  for( int i=0; __atomic_load_n( &churning, __ATOMIC_RELAXED ); i++ ) {
+    snprintf( path, sizeof(path), "/c%d", i % 64 );
+    int fd = pfs_host_vfs.open( path, O_WRONLY | O_CREAT, 0 );
+    if( fd < 0 ) fail( "can't create", path );
+    else pfs_host_vfs.close( fd );
+    if( i % 64 == 63 ) {
+      for( int c=0; c<64; c++ ) {
+        snprintf( path, sizeof(path), "/c%d", c );
+        pfs_host_vfs.unlink( path );
+      }
+    }
+  }
+  return NULL;
+}
+
+
+// every thread stats its own file, in lookups per second
+static double lookups( int threads, bool churn )
+{
+  pthread_t tasks[threads], writer;
+  bench_arg_t args[threads];
+  static const char* paths[] = { "/b0", "/b1", "/b2", "/b3", "/b4", "/b5", "/b6", "/b7" };
+  __atomic_store_n( &benching, true, __ATOMIC_RELAXED );
+  __atomic_store_n( &churning, churn, __ATOMIC_RELAXED );
+  if( churn ) pthread_create( &writer, NULL, churn_task, NULL );
+  for( int i=0; i<threads; i++ ) {
+    args[i].path = paths[i % 8];
+    args[i].bytes = 0;
+    pthread_create( &tasks[i], NULL, lookup_task, &args[i] );
+  }
+  double start = now();
+  struct timespec pause = { 0, (long)( BENCH_SECONDS * 1e9 ) };
+  nanosleep( &pause, NULL );
+  __atomic_store_n( &benching, false, __ATOMIC_RELAXED );
+  size_t count = 0;
+  for( int i=0; i<threads; i++ ) {
+    pthread_join( tasks[i], NULL );
+    count += args[i].bytes;
+  }
+  double elapsed = now() - start;
+  __atomic_store_n( &churning, false, __ATOMIC_RELAXED );
+  if( churn ) pthread_join( writer, NULL );
+  return count / elapsed;
+}
+
+
+static void lookup_throughput( int threads )
+{
+  printf( "\n%8s %16s %16s\n", "readers", "stat()/s", "with a writer" );
+  for( int n=1; n<=threads; n*=2 ) {
+    double alone = lookups( n, false );
+    double churned = lookups( n, true );
+    printf( "%8d %16.0f %16.0f\n", n, alone, churned );
+  }
+}
+
+
+int main( int argc, char** argv )
+{
+  int threads = 4;
+  for( int i=1; i<argc; i+=2 ) {
+    if( i + 1 >= argc ) goto usage;
+    if( strcmp( argv[i], "-t" ) == 0 ) threads = atoi( argv[i+1] );
+    else if( strcmp( argv[i], "-i" ) == 0 ) iterations = atoi( argv[i+1] );
+    else goto usage;
+  }
+  if( threads < 1 || threads > 64 || iterations < 1 ) goto usage;
+
+  // small tables so that they grow under the writers
+  pfs_set_max_items( 4 );
+  pfs_set_max_open_files( 4 * threads + 2 );
+  esp_vfs_pfs_conf_t conf = { .base_path = "/stress", .partition_label = "psram" };
+  if( esp_vfs_pfs_register( &conf ) != ESP_OK ) return 1;
+  for( int i=0; i<threads; i++ ) {
+    char dir[16];
+    snprintf( dir, sizeof(dir), "/w%d", i );
+    pfs_host_vfs.mkdir( dir, 0755 );
+  }
+  stress( threads );
+  throughput( threads );
+  lookup_throughput( threads );
+  esp_vfs_pfs_unregister( "/stress" );
+  return errors ? 1 : 0;
+
+usage:
+  fprintf( stderr, "Usage: %s [-t threads] [-i iterations]\n", argv[0] );
+  return 2;
+}
@@ -55,6 +55,8 @@ bool F_PSRam::begin(bool formatOnFail, const char * basePath, uint8_t maxOpenFil
     pfs_set_partition_size( partitionSize );
   }
 
+  pfs_set_max_open_files( maxOpenFiles );
+
   esp_vfs_pfs_conf_t conf = {
     .base_path = basePath,
     .partition_label = partitionLabel, // ignored ?
@@ -101,6 +103,246 @@ bool F_PSRam::setPartitionSize(size_t size_bytes)
 }
 
 
+bool F_PSRam::preallocate(const char* path, size_t size_bytes)
+{
+  if( pfs_get_files() == NULL ) return false;
+  return pfs_preallocate( path, size_bytes ) == 0;
+}
+
+
+bool F_PSRam::map(const char* path, pfs_map_t* map, size_t offset, size_t length)
+{
+  if( pfs_get_files() == NULL ) return false;
+  return pfs_map( path, offset, length, map ) == 0;
+}
+
+
+bool F_PSRam::unmap(pfs_map_t* map)
+{
+  return pfs_unmap( map ) == 0;
+}
+
+
+bool F_PSRam::adopt(const char* path, void* buf, size_t size)
+{
+  if( pfs_get_files() == NULL ) return false;
+  return pfs_adopt( path, buf, size ) == 0;
+}
+
+
+bool F_PSRam::detach(const char* path, void** buf, size_t* size)
+{
+  if( pfs_get_files() == NULL ) return false;
+  return pfs_detach( path, buf, size ) == 0;
+}
+
+
+bool F_PSRam::clone(const char* src, const char* dst)
+{
+  if( pfs_get_files() == NULL ) return false;
+  return pfs_clone( src, dst ) == 0;
+}
+
+
+size_t F_PSRam::compact(int maxFiles)
+{
+  return pfs_compact( maxFiles );
+}
+
+
+bool F_PSRam::setCompressed(const char* path, bool use)
+{
+  if( pfs_get_files() == NULL ) return false;
+  return pfs_set_compressed( path, use ) == 0;
+}
+
+
+static size_t imageStreamWrite( void* ctx, const void* data, size_t len )
+{
+  return ((Stream*)ctx)->write( (const uint8_t*)data, len );
+}
+
+
+static size_t imageStreamRead( void* ctx, void* data, size_t len )
+{
+  return ((Stream*)ctx)->readBytes( (char*)data, len );
+}
+
+
+bool F_PSRam::exportImage(Stream& out)
+{
+  if( pfs_get_files() == NULL ) return false;
+  return pfs_image_export( imageStreamWrite, &out ) == 0;
+}
+
+
+bool F_PSRam::importImage(Stream& in)
+{
+  if( pfs_get_files() == NULL ) return false;
+  return pfs_image_import( imageStreamRead, &in ) == 0;
+}
+
+
+bool F_PSRam::linkRom(const char* path, const void* data, size_t size)
+{
+  if( pfs_get_files() == NULL ) return false;
+  return pfs_link_rom( path, data, size ) == 0;
+}
+
+
+bool F_PSRam::mountImage(const void* image, size_t size)
+{
+  if( pfs_get_files() == NULL ) return false;
+  return pfs_image_mount( image, size ) == 0;
+}
+
+
+// pfs_backing_t over a fs::FS, file handles are heap allocated File objects
+static void* backingOpen( void* ctx, const char* path, bool write )
+{
+  File f = ((FS*)ctx)->open( path, write ? FILE_WRITE : FILE_READ, write );
+  if( !f ) return NULL;
+  return new File( f );
+}
+
+
+static size_t backingRead( void* handle, void* data, size_t len )
+{
+  return ((File*)handle)->read( (uint8_t*)data, len );
+}
+
+
+static size_t backingWrite( void* handle, const void* data, size_t len )
+{
+  return ((File*)handle)->write( (const uint8_t*)data, len );
+}
+
+
+static int backingClose( void* handle )
+{
+  File* f = (File*)handle;
+  f->close();
+  delete f;
+  return 0;
+}
+
+
+static int backingStat( void* ctx, const char* path, struct stat* st )
+{
+  FS* fs = (FS*)ctx;
+  if( !fs->exists( path ) ) return -1;
+  File f = fs->open( path );
+  if( !f ) return -1;
+  st->st_mode = f.isDirectory() ? S_IFDIR : S_IFREG;
+  st->st_size = f.isDirectory() ? 0 : f.size();
+  return 0;
+}
+
+
+static int backingRemove( void* ctx, const char* path )
+{
+  FS* fs = (FS*)ctx;
+  return fs->remove( path ) || fs->rmdir( path ) ? 0 : -1;
+}
+
+
+static int backingRename( void* ctx, const char* from, const char* to )
+{
+  return ((FS*)ctx)->rename( from, to ) ? 0 : -1;
+}
+
+
+bool F_PSRam::setBacking(FS& fs, uint32_t flushIntervalMs)
+{
+  if( pfs_get_files() == NULL ) return false;
+  pfs_backing_t backing = {
+    .ctx    = &fs,
+    .open   = backingOpen,
+    .read   = backingRead,
+    .write  = backingWrite,
+    .close  = backingClose,
+    .stat   = backingStat,
+    .remove = backingRemove,
+    .rename = backingRename
+  };
+  return pfs_set_backing( &backing, flushIntervalMs ) == 0;
+}
+
+
+bool F_PSRam::setBacking(const char* mountPath, uint32_t flushIntervalMs)
+{
+  if( pfs_get_files() == NULL ) return false;
+  pfs_backing_t backing;
+  pfs_backing_dir( &backing, mountPath );
+  return pfs_set_backing( &backing, flushIntervalMs ) == 0;
+}
+
+
+bool F_PSRam::removeBacking()
+{
+  return pfs_set_backing( NULL, 0 ) == 0;
+}
+
+
+bool F_PSRam::sync()
+{
+  if( pfs_get_files() == NULL ) return false;
+  return pfs_sync() == 0;
+}
+
+
+void F_PSRam::setCacheMode(bool use)
+{
+  pfs_set_cache_mode( use );
+}
+
+
+bool F_PSRam::pin(const char* path, bool pin)
+{
+  if( pfs_get_files() == NULL ) return false;
+  return pfs_pin( path, pin ) == 0;
+}
+
+
+size_t F_PSRam::evictions()
+{
+  return pfs_evictions();
+}
+
+
+void F_PSRam::setInternalThreshold(size_t size)
+{
+  pfs_set_internal_threshold( size );
+}
+
+
+bool F_PSRam::setPlacement(const char* path, pfs_placement_t placement)
+{
+  if( pfs_get_files() == NULL ) return false;
+  return pfs_set_placement( path, placement ) == 0;
+}
+
+
+void F_PSRam::setInlineSize(size_t size)
+{
+  pfs_set_inline_size( size );
+}
+
+
+size_t F_PSRam::usedBytesInternal()
+{
+  if( pfs_get_files() == NULL ) return 0;
+  return pfs_used_bytes_internal();
+}
+
+
+size_t F_PSRam::usedBytesPsram()
+{
+  if( pfs_get_files() == NULL ) return 0;
+  return pfs_used_bytes_psram();
+}
+
+
 bool F_PSRam::format(bool full_wipe, char* partitionLabel)
 {
   pfs_clean_files();
@@ -28,6 +28,7 @@
 #define _PSRAMFS_H_
 
 #include "FS.h"
+#include "pfs.h"
 
 #define FPSRAM_WIPE_FULL 1
 #define FPSRAM_PARTITION_LABEL "psram"
@@ -50,6 +51,30 @@ namespace fs
       bool exists(const char* path);
       bool exists(const String& path);
       bool setPartitionSize(size_t size_bytes);
+      bool preallocate(const char* path, size_t size_bytes); // reserve memory for a file that will grow to [size_bytes]
+      bool map(const char* path, pfs_map_t* map, size_t offset=0, size_t length=0); // read-only zero-copy view, length 0 = up to the end
+      bool unmap(pfs_map_t* map);
+      bool adopt(const char* path, void* buf, size_t size); // [buf] becomes the file contents, don't free it after success
+      bool detach(const char* path, void** buf, size_t* size); // take the file contents over, free() them when done
+      bool clone(const char* src, const char* dst); // instant copy, the data is only duplicated when either file is written
+      size_t compact(int maxFiles=0); // trim and repack idle files, returns the reclaimed bytes
+      bool setCompressed(const char* path, bool use=true); // compressed storage for a file, or for new files in a folder
+      bool exportImage(Stream& out); // whole tree as a pfs image, see extras/pfsimage
+      bool importImage(Stream& in); // restores an image over the current tree
+      bool linkRom(const char* path, const void* data, size_t size); // serves const/flash data as a file without copying it
+      bool mountImage(const void* image, size_t size); // same as importImage() from memory, files point into [image]
+      bool setBacking(FS& fs, uint32_t flushIntervalMs=1000); // cache over a persistent fs (LittleFS, SD...), dirty files are written back periodically (0 = on sync() only)
+      bool setBacking(const char* mountPath, uint32_t flushIntervalMs=1000); // same, over a vfs mount point (e.g. "/littlefs"), [mountPath] must outlive the backing
+      bool removeBacking(); // writes dirty files back and detaches the backing fs
+      bool sync(); // writes dirty files back now
+      void setCacheMode(bool use=true); // writes that don't fit evict the least recently used closed files (clean ones only with a backing fs)
+      bool pin(const char* path, bool pin=true); // pinned files are never evicted
+      size_t evictions(); // files evicted since mounting
+      void setInternalThreshold(size_t size); // files using up to [size] bytes of memory go to internal RAM instead of psram (0 = none)
+      bool setPlacement(const char* path, pfs_placement_t placement); // heap rule for a file, or for the new files of a folder
+      void setInlineSize(size_t size); // files up to [size] bytes (at most PFS_INLINE_SIZE) keep their data in their entry, no allocation (0 = none)
+      size_t usedBytesInternal(); // part of usedBytes() in internal RAM
+      size_t usedBytesPsram(); // part of usedBytes() in psram
       virtual void **getFiles();
       virtual void **getFolders();
       virtual size_t getFilesCount();
@@ -65,6 +90,7 @@ extern fs::F_PSRam PSRamFS;
 
 // this is only a named helper, see arduino-BufferStream for write support
 // https://github.com/IndustrialShields/arduino-BufferStream
+// or PSRamFS.linkRom() to serve the array as a file
 class RomDiskStream : public Stream
 {
   public:
@@ -78,7 +78,26 @@
 #endif
 
 #include "pfs.h"
+#include "pfs_lz.h"
 #include "esp_vfs.h"
+#include <sched.h>
+#include <unistd.h>
+
+#if (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0))
+#define PFS_RWLOCK_INITIALIZER PTHREAD_RWLOCK_INITIALIZER
+#define pfs_rwlock_init(l) pthread_rwlock_init(l, NULL)
+#define pfs_rwlock_destroy(l) pthread_rwlock_destroy(l)
+#define pfs_rdlock(l) pthread_rwlock_rdlock(l)
+#define pfs_wrlock(l) pthread_rwlock_wrlock(l)
+#define pfs_unlock(l) pthread_rwlock_unlock(l)
+#else
+#define PFS_RWLOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define pfs_rwlock_init(l) pthread_mutex_init(l, NULL)
+#define pfs_rwlock_destroy(l) pthread_mutex_destroy(l)
+#define pfs_rdlock(l) pthread_mutex_lock(l)
+#define pfs_wrlock(l) pthread_mutex_lock(l)
+#define pfs_unlock(l) pthread_mutex_unlock(l)
+#endif
 
 // ESP_LOG* functions always whining about signedness :(
 #pragma GCC diagnostic ignored "-Wformat"
@@ -87,19 +106,200 @@
 static const char TAG[] = "esp_psramfs";
 // this is more of a preference, lack of detection will have psram disabled
 bool pfs_psram_enabled = true;
+// store file data in a list of [pfs_alloc_block_size] chunks instead of
+// one contiguous buffer, slower random access but no copying on growth
+// and no need for a large contiguous free block
+bool pfs_chunked_enabled = false;
+// how contiguous buffers grow when a write doesn't fit
+pfs_growth_policy_t pfs_growth_policy = pfs_growth_fixed;
+size_t pfs_growth_cap = 64 * 1024; // max growth step for pfs_growth_capped
 // these are the defaults in the optimal scenario (psram detected), otherwise
 // overwritten
 size_t pfs_alloc_block_size = 4096;
-int pfs_max_items = 256;
+int pfs_max_items = 32;
+int pfs_max_open_files = 10;
+// set when the user picked max_items/block_size before mounting, so that
+// pfs_set_alloc_functions() does not overwrite them with the defaults
+bool pfs_max_items_custom = false;
+bool pfs_block_size_custom = false;
 
 size_t pfs_partition_size = 0;
 char *pfs_partition_label;
 char *pfs_base_path;
 
 // files and directories holders, an array with [pfs_max_items] items
-// initialized when vfs is registered
+// initialized when vfs is registered, both arrays grow together when
+// either is full so pfs_max_items stays valid for both
 pfs_file_t **pfs_files;
 pfs_dir_t **pfs_dirs;
+int pfs_tables_capacity = 0; // allocated pfs_files/pfs_dirs entries
+// initial tables size, they never shrink below this
+int pfs_min_items = 0;
+
+// stacks of free slots ids for O(1) slot allocation
+typedef struct {
+  int *ids;
+  int count;
+} pfs_free_slots_t;
+
+pfs_free_slots_t pfs_files_free_slots;
+pfs_free_slots_t pfs_dirs_free_slots;
+
+// sum of all files memsize, updated wherever file memory is (re)allocated
+// or freed, build with -DPFS_CHECK_USED_BYTES to cross-check with a scan
+size_t pfs_used_total = 0;
+// part of pfs_used_total held by files with PFS_F_INTERNAL, that is placed in
+// internal ram while psram is the default heap
+size_t pfs_used_internal = 0;
+// with psram, contiguous files using up to that many bytes of memory are
+// placed in internal ram (faster), 0 = none unless a placement rule says so
+size_t pfs_internal_threshold = 0;
+// new files up to that many bytes keep their data in their entry
+// (inline_data) instead of a heap buffer, at most PFS_INLINE_SIZE, 0 = none,
+// that memory is part of the entry and not counted in pfs_used_total
+size_t pfs_inline_size = 0;
+// file and directory flags holding a placement rule
+#define PFS_F_PLACEMENT (PFS_F_PLACE_INTERNAL | PFS_F_PLACE_PSRAM)
+// data shared by cloned files, the buffer (or chunks) is counted once in
+// pfs_used_total and freed by the last file letting go of it
+typedef struct _pfs_shared_t {
+  int refs;      // files sharing the data
+  uint32_t scan; // pfs_scan_used_bytes() pass that last counted it
+} pfs_shared_t;
+
+// Compressed files: the data is split in PFS_Z_BLOCK_SIZE blocks compressed
+// on their own, so reads and writes only (de)compress the blocks they touch.
+// The block being accessed is kept decompressed in a cache, writes go there
+// and it's compressed again when another block is needed or when the file
+// goes idle. memsize counts the compressed blocks and the cache.
+#define PFS_Z_BLOCK_SIZE 4096
+
+typedef struct _pfs_zblock_t {
+  char *data;   // compressed block, NULL when it only holds zeroes
+  uint16_t len; // stored length, the block is kept as is when equal to raw
+  uint16_t raw; // uncompressed length, zeroes follow up to the block size
+} pfs_zblock_t;
+
+typedef struct _pfs_zfile_t {
+  pthread_mutex_t lock; // readers only share the file lock, they take this
+  pfs_zblock_t *blocks; // index, block [i] holds the bytes at i*block size
+  uint32_t count;       // blocks in the index
+  uint32_t capacity;    // size of the index
+  char *cache;          // decompressed block
+  int32_t cached;       // block held by the cache, -1 when none
+  uint16_t cache_len;   // bytes of the cache to compress
+  bool dirty;           // the cache holds writes not compressed yet
+} pfs_zfile_t;
+
+// hash table and output buffer for the compressor, shared by all files
+uint8_t *pfs_z_scratch = NULL;
+pthread_mutex_t pfs_z_scratch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// bytes given back by shrink-on-close and pfs_compact() since mounting
+size_t pfs_reclaimed_total = 0;
+// trim files to their size when their last writer closes
+bool pfs_shrink_on_close = false;
+// where the next pfs_compact() pass resumes
+int pfs_compact_cursor = 0;
+
+// Cache mode: when a write doesn't fit in the partition, the least recently
+// used files are evicted to make room. The eviction list holds the files
+// nobody uses (no open handle nor mapping) and not pinned, most recently
+// used first. It's guarded by pfs_fds_lock, like the refcounts it follows.
+bool pfs_cache_mode = false;
+pfs_file_t *pfs_lru_newest = NULL;
+pfs_file_t *pfs_lru_oldest = NULL;
+size_t pfs_evictions_total = 0;
+
+// Write-back cache mode, see pfs_set_backing(): files missing from memory
+// are fetched from the backing store when opened, changed files are marked
+// with PFS_F_CHANGED and written back by pfs_sync(), fsync() or the flusher
+// task. pfs_backing_lock serializes store accesses, and is held while a
+// file is written back so it can't be unlinked or renamed meanwhile. It's
+// taken before pfs_ns_lock.
+#define PFS_F_CHANGED (PFS_F_DIRTY | PFS_F_WRITING)
+#define PFS_BACKING_PATH_MAX 256
+#define PFS_BACKING_BUF_SIZE 4096 // write back copy buffer
+
+pfs_backing_t pfs_backing_store;
+pfs_backing_t *pfs_backing = NULL; // &pfs_backing_store when attached
+pthread_mutex_t pfs_backing_lock = PTHREAD_MUTEX_INITIALIZER;
+// periodic pfs_sync(), only running with a flush interval
+pthread_t pfs_flusher;
+bool pfs_flusher_running = false;
+uint32_t pfs_flusher_interval = 0; // milliseconds
+pthread_mutex_t pfs_flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pfs_flusher_cond = PTHREAD_COND_INITIALIZER;
+
+// Locking model:
+// - pfs_ns_lock guards the namespace: tables, names, directory items and
+//   handle counts, index, pools and free slots. Shared for readdir and for
+//   opening or closing existing files, exclusive for anything that creates,
+//   removes or renames, and for opening or closing directories.
+// - pfs_fds_lock guards the open handles table and the files refcount.
+// - each file's lock guards its data: shared for reads, exclusive for
+//   writes, truncation and reallocation.
+// pfs_ns_lock is always taken before a file lock, never the other way around.
+// The vfs_pfs_*() entry points and the exported pfs_*() functions take the
+// locks, internal functions expect the caller to hold them.
+pfs_rwlock_t pfs_ns_lock = PFS_RWLOCK_INITIALIZER;
+pthread_mutex_t pfs_fds_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Lock-free lookups (stat): writers bump pfs_ns_seq when they take and
+// release pfs_ns_lock, so it's odd while the namespace is being modified.
+// Readers don't lock, they retry when the sequence moved under them. They
+// may still be looking at memory a writer just dropped, so names, tables,
+// index arrays and slabs are retired instead of freed, and only released
+// by a later writer that finds no lock-free reader active, writers never
+// wait for them. Tables and index arrays never shrink for the same reason,
+// only the slabs do.
+uint32_t pfs_ns_seq = 0;
+int pfs_ns_readers = 0;
+#define PFS_NS_READ_TRIES 8 // then fall back to pfs_ns_lock
+
+// pfs_stat() reads the size without the file lock
+#define pfs_set_size(file, value)                                              \
+  __atomic_store_n(&(file)->size, (value), __ATOMIC_RELAXED)
+
+typedef struct {
+  void **ptrs;
+  int count;
+  int capacity;
+} pfs_retired_t;
+
+pfs_retired_t pfs_retired;
+
+// hashed name index, one per files/directories array, keyed on the parent
+// directory and the entry name, so that resolving a path component doesn't
+// have to strcmp() every slot
+typedef struct {
+  int *buckets;      // first slot in each bucket, -1 when empty
+  int *next;         // next slot in the same bucket, -1 when last
+  uint32_t *hashes;  // cached (parent, name) hash for each slot
+  size_t bucket_mask; // buckets count - 1 (buckets count is a power of two)
+  size_t capacity;    // allocated next/hashes entries
+} pfs_index_t;
+
+pfs_index_t pfs_files_index;
+pfs_index_t pfs_dirs_index;
+
+// slab pool for fixed size metadata objects: objects are carved from large
+// contiguous slabs and recycled through a free list
+typedef struct {
+  size_t object_size;  // rounded up to pointer alignment
+  size_t slab_objects; // objects per slab
+  void *free_list;     // free objects, linked through their first word
+  void **slabs;        // allocated slabs
+  size_t slabs_count;
+} pfs_pool_t;
+
+pfs_pool_t pfs_files_pool;
+pfs_pool_t pfs_dirs_pool;
+pfs_pool_t pfs_dir_handles_pool;
+
+// open files table, an array with [pfs_max_open_files] items, the vfs file
+// descriptor is the handle index
+pfs_fd_t *pfs_fds;
 
 // choosing the alloc system (should defaut to psram but who knows)
 
@@ -123,6 +323,16 @@ void *i_realloc(void *ptr, size_t size) {
   return heap_caps_realloc(ptr, size, MALLOC_CAP_8BIT);
 }
 uint32_t i_free() { return heap_caps_get_free_size(MALLOC_CAP_8BIT); }
+// using internal sram only, the 8bit heap may include psram
+void *s_malloc(size_t size) {
+  return heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+}
+void *s_calloc(size_t n, size_t size) {
+  return heap_caps_calloc(n, size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+}
+void *s_realloc(void *ptr, size_t size) {
+  return heap_caps_realloc(ptr, size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+}
 // aliases
 void *(*pfs_malloc)(size_t size);
 void *(*pfs_calloc)(size_t n, size_t size);
@@ -134,6 +344,8 @@ pfs_dir_t **pfs_get_dirs();
 int pfs_get_max_items();
 void pfs_set_max_items(
     size_t max_items); // applies to both files and directories
+int pfs_get_max_open_files();
+void pfs_set_max_open_files(size_t max_open_files);
 size_t pfs_get_block_size();
 void pfs_set_block_size(
     size_t block_size); // smaller value = more calls to realloc()
@@ -141,18 +353,38 @@ size_t pfs_get_partition_size();
 void pfs_set_partition_size(size_t size);
 bool pfs_get_psram();
 void pfs_set_psram(bool use);
+bool pfs_get_chunked();
+void pfs_set_chunked(bool use);
+size_t pfs_get_internal_threshold();
+void pfs_set_internal_threshold(size_t size);
+size_t pfs_get_inline_size();
+void pfs_set_inline_size(size_t size);
+pfs_growth_policy_t pfs_get_growth_policy();
+void pfs_set_growth_policy(pfs_growth_policy_t policy, size_t cap);
 size_t pfs_used_bytes();
 void pfs_init(const char *partition_label);
 void pfs_deinit();
 void pfs_init_dirs();
+bool pfs_grow_tables();
+int pfs_shrink_tables();
 int pfs_next_file_avail();
 int pfs_next_dir_avail();
 int pfs_find_file(const char *path);
 int pfs_find_dir(const char *path);
+int pfs_lookup_file(int dir_id, const char *name, size_t len);
+int pfs_lookup_dir(int dir_id, const char *name, size_t len);
+int pfs_walk_path(const char *path, const char **base, size_t *baselen,
+                  bool create);
 const char *pfs_flags_conv_str(int m);
 int pfs_flags_conv(int m);
 int pfs_stat(const char *path, struct stat *stat_);
 pfs_file_t *pfs_fopen(const char *path, int flags, int mode);
+size_t pfs_pread(pfs_file_t *stream, uint8_t *buf, size_t to_read,
+                 uint32_t offset);
+size_t pfs_pwrite(pfs_file_t *stream, const uint8_t *buf, size_t to_write,
+                  uint32_t offset);
+int pfs_fallocate(pfs_file_t *stream, size_t size);
+int pfs_preallocate(const char *path, size_t size);
 size_t pfs_fread(uint8_t *buf, size_t size, size_t count, pfs_file_t *stream);
 size_t pfs_fwrite(const uint8_t *buf, size_t size, size_t count,
                   pfs_file_t *stream);
@@ -161,28 +393,55 @@ int pfs_fseek(pfs_file_t *stream, off_t offset, pfs_seek_mode mode);
 size_t pfs_ftell(pfs_file_t *stream);
 void pfs_fclose(pfs_file_t *stream);
 int pfs_unlink(const char *path);
+int pfs_unlink_file(int file_id);
 void pfs_clean_files();
 int pfs_rename(const char *from, const char *to);
 pfs_dir_t *pfs_opendir(const char *path);
 int pfs_mkdir(const char *path);
+int pfs_mkdir_at(int parent_id, const char *name, size_t len);
 int pfs_rmdir(const char *path);
-struct dirent *pfs_readdir(pfs_dir_t *dir);
-void pfs_closedir(pfs_dir_t *dir);
-void pfs_rewinddir(pfs_dir_t *dir);
-int pfs_dir_add_item(int dir_id, struct dirent *item);
-int pfs_dir_remove_item(int dir_id, int item_id);
+pfs_dir_handle_t *pfs_dir_handle_open(pfs_dir_t *dir);
+struct dirent *pfs_readdir(pfs_dir_handle_t *handle);
+void pfs_closedir(pfs_dir_handle_t *handle);
+void pfs_rewinddir(pfs_dir_handle_t *handle);
+int pfs_dir_add_item(int dir_id, int ino, uint8_t type);
+int pfs_dir_remove_item(int dir_id, int ino, uint8_t type);
 int pfs_dir_free_items(int dir_id);
 
 void pfs_free();
 
+int pfs_fd_open(pfs_file_t *file, int flags);
+pfs_fd_t *pfs_fd_get(int fd);
+int pfs_fd_close(int fd, pfs_file_t **file, int *trim);
+
+bool pfs_pool_init(pfs_pool_t *pool, size_t object_size, size_t slab_objects);
+bool pfs_pool_grow(pfs_pool_t *pool, size_t objects);
+void pfs_pool_shrink(pfs_pool_t *pool);
+void *pfs_pool_alloc(pfs_pool_t *pool);
+void pfs_pool_release(pfs_pool_t *pool, void *object);
+void pfs_pool_free(pfs_pool_t *pool);
+
+uint32_t pfs_hash(int parent_id, const char *name, size_t len);
+bool pfs_index_init(pfs_index_t *index, size_t slots);
+bool pfs_index_resize(pfs_index_t *index, size_t slots);
+void pfs_index_free(pfs_index_t *index);
+void pfs_index_add(pfs_index_t *index, int slot, int parent_id,
+                   const char *name);
+void pfs_index_remove(pfs_index_t *index, int slot);
+
 int vfs_pfs_fopen(const char *path, int flags, int mode);
 ssize_t vfs_pfs_read(int fd, void *dst, size_t size);
 ssize_t vfs_pfs_write(int fd, const void *data, size_t size);
+ssize_t vfs_pfs_pread(int fd, void *dst, size_t size, off_t offset);
+ssize_t vfs_pfs_pwrite(int fd, const void *data, size_t size, off_t offset);
+int vfs_pfs_truncate(const char *path, off_t length);
+int vfs_pfs_ftruncate(int fd, off_t length);
 int vfs_pfs_close(int fd);
 int vfs_pfs_fsync(int fd);
 int vfs_pfs_stat(const char *path, struct stat *st);
 int vfs_pfs_fstat(int fd, struct stat *st);
 off_t vfs_pfs_lseek(int fd, off_t offset, int mode);
+int vfs_pfs_fcntl(int fd, int cmd, int arg);
 int vfs_pfs_unlink(const char *path);
 int vfs_pfs_rename(const char *src, const char *dst);
 int vfs_pfs_rmdir(const char *name);
@@ -195,129 +454,437 @@ esp_err_t esp_vfs_pfs_register(const esp_vfs_pfs_conf_t *conf);
 esp_err_t esp_vfs_pfs_format(const char *partition_label);
 esp_err_t esp_vfs_pfs_unregister(const char *base_path);
 
-static char *pfs_basename(char *path) {
-  // based on gnu_basename()
-  char *base = strrchr(path, '/');
-  return base ? base + 1 : path;
-}
-
-static char *pfs_dirname(char *path) {
-  static const char dot[] = ".";
-  char *last_slash;
-  /* Find last '/'.  */
-  last_slash = path != NULL ? strrchr(path, '/') : NULL;
-  if (last_slash != NULL && last_slash != path && last_slash[1] == '\0') {
-    /* Determine whether all remaining characters are slashes.  */
-    char *runp;
-    for (runp = last_slash; runp != path; --runp)
-      if (runp[-1] != '/')
-        break;
-    /* The '/' is the last character, we have to look further.  */
-    if (runp != path)
-      last_slash = (char *)memrchr(path, '/', runp - path);
-  }
-  if (last_slash != NULL) {
-    /* Determine whether all remaining characters are slashes.  */
-    char *runp;
-    for (runp = last_slash; runp != path; --runp)
-      if (runp[-1] != '/')
-        break;
-    /* Terminate the path.  */
-    if (runp == path) {
-      /* The last slash is the first character in the string.  We have to
-          return "/".  As a special case we have to return "//" if there
-          are exactly two slashes at the beginning of the string.  See
-          XBD 4.10 Path Name Resolution for more information.  */
-      if (last_slash == path + 1)
-        ++last_slash;
-      else
-        last_slash = path + 1;
-    } else
-      last_slash = runp;
-    last_slash[0] = '\0';
-  } else
-    /* This assignment is ill-designed but the XPG specs require to
-       return a string containing "." in any case no directory part is
-       found and so a static and constant string is required.  */
-    path = (char *)dot;
-  return path;
+static char *pfs_strndup(const char *name, size_t len) {
+  char *dup = (char *)pfs_malloc(len + 1);
+  if (dup != NULL) {
+    memcpy(dup, name, len);
+    dup[len] = '\0';
+  }
+  return dup;
 }
 
-#ifndef strdupa
-#define strdupa(a) strcpy((char *)alloca(strlen(a) + 1), a)
-#endif
-// create traversing directories from a path
-static int pfs_mkpath(char *name) {
-  if (!name)
-    return -1;
-  if (strlen(name) == 1 && name[0] == '/')
-    return 0;
-  pfs_mkpath(pfs_dirname(strdupa(name)));
-  return pfs_mkdir(name);
+static void pfs_ns_write_lock() {
+  pfs_wrlock(&pfs_ns_lock);
+  __atomic_add_fetch(&pfs_ns_seq, 1, __ATOMIC_SEQ_CST);
 }
 
-// create traversing directories from a file name, return directory ID if found
-int pfs_mkdirp(const char *from_filename) {
-  assert(from_filename);
-  int pathlen = strlen(from_filename);
-  if (pathlen <= 1) {
-    ESP_LOGE(TAG, "Cowardly refusing to create root path");
-    return 0;
+static void pfs_reclaim();
+
+static void pfs_ns_write_unlock() {
+  __atomic_add_fetch(&pfs_ns_seq, 1, __ATOMIC_SEQ_CST);
+  pfs_reclaim();
+  pfs_unlock(&pfs_ns_lock);
+}
+
+// lock-free readers register themselves so that retired memory outlives them
+static void pfs_ns_read_enter() {
+  __atomic_add_fetch(&pfs_ns_readers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void pfs_ns_read_leave() {
+  __atomic_sub_fetch(&pfs_ns_readers, 1, __ATOMIC_SEQ_CST);
+}
+
+static uint32_t pfs_ns_read_begin() {
+  return __atomic_load_n(&pfs_ns_seq, __ATOMIC_ACQUIRE);
+}
+
+// true when what was read since pfs_ns_read_begin() can't be trusted
+static bool pfs_ns_read_retry(uint32_t seq) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return (seq & 1) || __atomic_load_n(&pfs_ns_seq, __ATOMIC_RELAXED) != seq;
+}
+
+// blocks until the lock-free readers are gone, only for when retired memory
+// can't be deferred: sleeping lets lower priority readers run on FreeRTOS,
+// where yielding wouldn't
+static void pfs_wait_readers() {
+  while (__atomic_load_n(&pfs_ns_readers, __ATOMIC_SEQ_CST) > 0)
+    usleep(1000);
+}
+
+// frees retired memory when no lock-free reader is active, otherwise leaves
+// it for the next writer
+static void pfs_reclaim() {
+  if (pfs_retired.count == 0 ||
+      __atomic_load_n(&pfs_ns_readers, __ATOMIC_SEQ_CST) > 0)
+    return;
+  for (int i = 0; i < pfs_retired.count; i++)
+    free(pfs_retired.ptrs[i]);
+  pfs_retired.count = 0;
+}
+
+// frees [ptr] once lock-free readers can't see it anymore, writers only
+static void pfs_retire(void *ptr) {
+  if (ptr == NULL)
+    return;
+  if (pfs_retired.count == pfs_retired.capacity) {
+    int capacity = pfs_retired.capacity > 0 ? pfs_retired.capacity * 2 : 16;
+    void **ptrs =
+        (void **)pfs_realloc(pfs_retired.ptrs, capacity * sizeof(void *));
+    if (ptrs == NULL) {
+      // no room to defer, wait for the readers instead
+      pfs_wait_readers();
+      pfs_reclaim();
+      free(ptr);
+      return;
+    }
+    pfs_retired.ptrs = ptrs;
+    pfs_retired.capacity = capacity;
   }
-  char *tmp_path = (char *)pfs_calloc(pathlen, sizeof(char));
-  if (tmp_path == NULL) {
-    ESP_LOGE(
-        TAG,
-        "[OOM?] Can't alloc %d bytes for creating recursive directories to %s",
-        pathlen, from_filename);
-    return -1;
+  pfs_retired.ptrs[pfs_retired.count++] = ptr;
+}
+
+// returns the next component of [path] and its length, skipping slashes
+static const char *pfs_next_component(const char *path, size_t *len) {
+  while (*path == '/')
+    path++;
+  *len = strcspn(path, "/");
+  return path;
+}
+
+// FNV-1a, cheap and good enough for names, seeded with the parent id so
+// that same names in different directories land in different buckets
+uint32_t pfs_hash(int parent_id, const char *name, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < sizeof(parent_id); i++) {
+    hash ^= (uint8_t)(parent_id >> (i * 8));
+    hash *= 16777619u;
+  }
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint8_t)name[i];
+    hash *= 16777619u;
   }
-  snprintf(tmp_path, pathlen, "%s", from_filename);
+  return hash;
+}
 
-  for (size_t i = 0; i < pathlen; i++) {
-    if (!isprint((int)from_filename[i]) != 0) {
-      ESP_LOGW(
-          TAG,
-          "Non printable char detected in path %s at offset %d, setting null",
-          from_filename, i);
-      // return -1;
-      tmp_path[i] = '\0';
-      break;
+bool pfs_index_init(pfs_index_t *index, size_t slots) {
+  size_t buckets_count = 1;
+  while (buckets_count < slots)
+    buckets_count <<= 1;
+  // the index is hot and small, keep it out of psram when possible
+  index->buckets = (int *)heap_caps_malloc(buckets_count * sizeof(int),
+                                           MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  index->next = (int *)heap_caps_malloc(slots * sizeof(int),
+                                        MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  index->hashes = (uint32_t *)heap_caps_malloc(
+      slots * sizeof(uint32_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  if (index->buckets == NULL || index->next == NULL || index->hashes == NULL) {
+    ESP_LOGE(TAG, "Can't alloc index for %d slots", slots);
+    pfs_index_free(index);
+    return false;
+  }
+  index->bucket_mask = buckets_count - 1;
+  index->capacity = slots;
+  for (size_t i = 0; i < buckets_count; i++)
+    index->buckets[i] = -1;
+  for (size_t i = 0; i < slots; i++)
+    index->next[i] = -1;
+  return true;
+}
+
+// follows the tables size, buckets are rehashed from the cached hashes.
+// Arrays are replaced rather than realloc'ed and never shrink, so that a
+// lock-free reader never indexes past the end of an array it loaded.
+bool pfs_index_resize(pfs_index_t *index, size_t slots) {
+  if (slots <= index->capacity)
+    return true;
+  int *next = (int *)heap_caps_malloc(slots * sizeof(int),
+                                      MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  uint32_t *hashes = (uint32_t *)heap_caps_malloc(
+      slots * sizeof(uint32_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  if (next == NULL || hashes == NULL) {
+    free(next);
+    free(hashes);
+    return false;
+  }
+  memcpy(next, index->next, index->capacity * sizeof(int));
+  memcpy(hashes, index->hashes, index->capacity * sizeof(uint32_t));
+  for (size_t i = index->capacity; i < slots; i++)
+    next[i] = -1;
+
+  size_t buckets_count = 1;
+  while (buckets_count < slots)
+    buckets_count <<= 1;
+  int *buckets = NULL;
+  if (buckets_count != index->bucket_mask + 1) {
+    buckets = (int *)heap_caps_malloc(buckets_count * sizeof(int),
+                                      MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    // still usable without, only with longer chains
+  }
+  if (buckets != NULL) {
+    for (size_t i = 0; i < buckets_count; i++)
+      buckets[i] = -1;
+    for (size_t b = 0; b <= index->bucket_mask; b++) {
+      int slot = index->buckets[b];
+      while (slot > -1) {
+        int next_slot = next[slot];
+        int *head = &buckets[hashes[slot] & (buckets_count - 1)];
+        next[slot] = *head;
+        *head = slot;
+        slot = next_slot;
+      }
     }
   }
-  if (tmp_path[1] == '\0') {
-    ESP_LOGW(TAG, "Source 'filename' is the '/' folder");
-    free(tmp_path);
-    return 0;
+
+  // publish in the reverse order of pfs_lookup()'s loads
+  pfs_retire(index->next);
+  pfs_retire(index->hashes);
+  __atomic_store_n(&index->next, next, __ATOMIC_RELEASE);
+  __atomic_store_n(&index->hashes, hashes, __ATOMIC_RELEASE);
+  __atomic_store_n(&index->capacity, slots, __ATOMIC_RELEASE);
+  if (buckets != NULL) {
+    pfs_retire(index->buckets);
+    __atomic_store_n(&index->buckets, buckets, __ATOMIC_RELEASE);
+    __atomic_store_n(&index->bucket_mask, buckets_count - 1,
+                     __ATOMIC_RELEASE);
   }
+  return true;
+}
 
-  char *dir_name = pfs_dirname(tmp_path);
+void pfs_index_free(pfs_index_t *index) {
+  free(index->buckets);
+  free(index->next);
+  free(index->hashes);
+  memset(index, 0, sizeof(pfs_index_t));
+}
 
-  if (dir_name == NULL) {
-    ESP_LOGE(TAG, "pfs_dirname returned NULL when given %s speculated from %s",
-             tmp_path, from_filename);
-    free(tmp_path);
-    return 0;
+void pfs_index_add(pfs_index_t *index, int slot, int parent_id,
+                   const char *name) {
+  if (index->buckets == NULL)
+    return;
+  uint32_t hash = pfs_hash(parent_id, name, strlen(name));
+  int *head = &index->buckets[hash & index->bucket_mask];
+  __atomic_store_n(&index->hashes[slot], hash, __ATOMIC_RELAXED);
+  __atomic_store_n(&index->next[slot], *head, __ATOMIC_RELEASE);
+  __atomic_store_n(head, slot, __ATOMIC_RELEASE);
+}
+
+void pfs_index_remove(pfs_index_t *index, int slot) {
+  if (index->buckets == NULL)
+    return;
+  int *link = &index->buckets[index->hashes[slot] & index->bucket_mask];
+  while (*link > -1) {
+    if (*link == slot) {
+      // lock-free readers may be walking the chain
+      __atomic_store_n(link, index->next[slot], __ATOMIC_RELEASE);
+      __atomic_store_n(&index->next[slot], -1, __ATOMIC_RELEASE);
+      return;
+    }
+    link = &index->next[*link];
   }
+  ESP_LOGW(TAG, "Slot #%d not found in index", slot);
+}
 
-  if (dir_name[0] == '/' && dir_name[1] == '\0') {
-    // No need to create '/' folder
-    free(tmp_path);
-    return 0;
+bool pfs_pool_init(pfs_pool_t *pool, size_t object_size, size_t slab_objects) {
+  memset(pool, 0, sizeof(pfs_pool_t));
+  pool->object_size =
+      (object_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  pool->slab_objects = slab_objects > 0 ? slab_objects : 1;
+  return pfs_pool_grow(pool, pool->slab_objects);
+}
+
+// adds a slab of [objects] and threads them into the free list
+bool pfs_pool_grow(pfs_pool_t *pool, size_t objects) {
+  void **slabs = (void **)pfs_realloc(pool->slabs,
+                                      (pool->slabs_count + 1) * sizeof(void *));
+  if (slabs == NULL) {
+    ESP_LOGE(TAG, "Can't alloc slabs list");
+    return false;
+  }
+  pool->slabs = slabs;
+  char *slab = (char *)pfs_malloc(pool->object_size * objects);
+  if (slab == NULL) {
+    ESP_LOGE(TAG, "Can't alloc %d bytes slab", pool->object_size * objects);
+    return false;
+  }
+  pool->slabs[pool->slabs_count++] = slab;
+  // last object first so that allocations follow memory order
+  for (size_t i = objects; i > 0; i--) {
+    void *object = slab + (i - 1) * pool->object_size;
+    *(void **)object = pool->free_list;
+    pool->free_list = object;
   }
+  return true;
+}
 
-  int dir_id = pfs_find_dir(dir_name);
+void *pfs_pool_alloc(pfs_pool_t *pool) {
+  if (pool->free_list == NULL && !pfs_pool_grow(pool, pool->slab_objects))
+    return NULL;
+  void *object = pool->free_list;
+  pool->free_list = *(void **)object;
+  memset(object, 0, pool->object_size);
+  return object;
+}
 
-  if (dir_id < 0) {
-    ESP_LOGD(TAG, "Recursively creating %s subfolder(s) for path %s", dir_name,
-             tmp_path);
-    dir_id = pfs_mkpath(dir_name);
-  } else {
-    ESP_LOGD(TAG, "Folder %s already exists for path %s", dir_name, tmp_path);
+void pfs_pool_release(pfs_pool_t *pool, void *object) {
+  if (object == NULL)
+    return;
+  *(void **)object = pool->free_list;
+  pool->free_list = object;
+}
+
+// frees the most recent slab, only valid when none of its objects are in
+// use or in the free list (pools handing out whole slabs)
+void pfs_pool_shrink(pfs_pool_t *pool) {
+  if (pool->slabs_count <= 1)
+    return;
+  // lock-free readers may still be looking at objects from that slab
+  pfs_retire(pool->slabs[--pool->slabs_count]);
+}
+
+void pfs_pool_free(pfs_pool_t *pool) {
+  for (size_t i = 0; i < pool->slabs_count; i++)
+    free(pool->slabs[i]);
+  free(pool->slabs);
+  memset(pool, 0, sizeof(pfs_pool_t));
+}
+
+static bool pfs_free_slots_init(pfs_free_slots_t *free_slots, int slots) {
+  free_slots->ids = (int *)pfs_malloc(slots * sizeof(int));
+  free_slots->count = 0;
+  if (free_slots->ids == NULL)
+    return false;
+  // highest id at the bottom so that the lowest ids are used first
+  for (int i = slots - 1; i > -1; i--)
+    free_slots->ids[free_slots->count++] = i;
+  return true;
+}
+
+static void pfs_free_slots_push(pfs_free_slots_t *free_slots, int id) {
+  if (free_slots->ids != NULL)
+    free_slots->ids[free_slots->count++] = id;
+}
+
+static int pfs_free_slots_pop(pfs_free_slots_t *free_slots) {
+  if (free_slots->count == 0)
+    return -1;
+  return free_slots->ids[--free_slots->count];
+}
+
+// takes back the [added] ids pfs_free_slots_grow() just pushed below the
+// others
+static void pfs_free_slots_ungrow(pfs_free_slots_t *free_slots, int added) {
+  free_slots->count -= added;
+  memmove(free_slots->ids, &free_slots->ids[added],
+          free_slots->count * sizeof(int));
+}
+
+// makes room for the slots [from, to) in a free slots stack, below the
+// current ids so that they're used last
+static bool pfs_free_slots_grow(pfs_free_slots_t *free_slots, int from,
+                                int to) {
+  int *ids = (int *)pfs_realloc(free_slots->ids, to * sizeof(int));
+  if (ids == NULL)
+    return false;
+  int added = to - from;
+  memmove(&ids[added], ids, free_slots->count * sizeof(int));
+  for (int i = 0; i < added; i++)
+    ids[i] = to - 1 - i;
+  free_slots->ids = ids;
+  free_slots->count += added;
+  return true;
+}
+
+// doubles the capacity of both files and directories tables
+bool pfs_grow_tables() {
+  int capacity = pfs_max_items * 2;
+  ESP_LOGD(TAG, "Growing tables from %d to %d items", pfs_max_items, capacity);
+
+  if (capacity > pfs_tables_capacity) {
+    // replaced rather than realloc'ed, see pfs_ns_seq
+    pfs_file_t **files =
+        (pfs_file_t **)pfs_calloc(capacity, sizeof(pfs_file_t *));
+    pfs_dir_t **dirs = (pfs_dir_t **)pfs_calloc(capacity, sizeof(pfs_dir_t *));
+    if (files == NULL || dirs == NULL) {
+      free(files);
+      free(dirs);
+      goto fail;
+    }
+    memcpy(files, pfs_files, pfs_max_items * sizeof(pfs_file_t *));
+    memcpy(dirs, pfs_dirs, pfs_max_items * sizeof(pfs_dir_t *));
+    pfs_retire(pfs_files);
+    pfs_retire(pfs_dirs);
+    __atomic_store_n(&pfs_files, files, __ATOMIC_RELEASE);
+    __atomic_store_n(&pfs_dirs, dirs, __ATOMIC_RELEASE);
+    pfs_tables_capacity = capacity;
   }
 
-  free(tmp_path);
-  return dir_id;
+  if (!pfs_index_resize(&pfs_files_index, capacity) ||
+      !pfs_index_resize(&pfs_dirs_index, capacity))
+    goto fail;
+
+  // the new entries come in one slab per table, a slab can only be given
+  // back once its objects are off the free list
+  void *files_free_list = pfs_files_pool.free_list;
+  void *dirs_free_list = pfs_dirs_pool.free_list;
+  int added = capacity - pfs_max_items;
+  if (!pfs_pool_grow(&pfs_files_pool, added))
+    goto fail;
+  if (!pfs_pool_grow(&pfs_dirs_pool, added))
+    goto fail_files_pool;
+  if (!pfs_free_slots_grow(&pfs_files_free_slots, pfs_max_items, capacity))
+    goto fail_dirs_pool;
+  if (!pfs_free_slots_grow(&pfs_dirs_free_slots, pfs_max_items, capacity)) {
+    pfs_free_slots_ungrow(&pfs_files_free_slots, added);
+    goto fail_dirs_pool;
+  }
+  for (int i = pfs_max_items; i < capacity; i++) {
+    pfs_files[i] = (pfs_file_t *)pfs_pool_alloc(&pfs_files_pool);
+    pfs_rwlock_init(&pfs_files[i]->lock);
+    pfs_dirs[i] = (pfs_dir_t *)pfs_pool_alloc(&pfs_dirs_pool);
+  }
+  pfs_max_items = capacity;
+  return true;
+
+fail_dirs_pool:
+  pfs_dirs_pool.free_list = dirs_free_list;
+  pfs_pool_shrink(&pfs_dirs_pool);
+fail_files_pool:
+  pfs_files_pool.free_list = files_free_list;
+  pfs_pool_shrink(&pfs_files_pool);
+fail:
+  ESP_LOGE(TAG, "Can't grow tables to %d items", capacity);
+  return false;
+}
+
+// halves both tables while their upper half is free, returns the new size
+int pfs_shrink_tables() {
+  int max_items;
+  if (pfs_files == NULL || pfs_dirs == NULL)
+    return 0;
+  pfs_ns_write_lock();
+  while (pfs_max_items / 2 >= pfs_min_items) {
+    int capacity = pfs_max_items / 2;
+    for (int i = capacity; i < pfs_max_items; i++) {
+      if (pfs_files[i]->name != NULL || pfs_files[i]->refcount > 0 ||
+          pfs_dirs[i]->name != NULL || pfs_dirs[i]->refcount > 0)
+        goto done;
+    }
+    ESP_LOGD(TAG, "Shrinking tables from %d to %d items", pfs_max_items,
+             capacity);
+    for (int i = capacity; i < pfs_max_items; i++)
+      pfs_rwlock_destroy(&pfs_files[i]->lock);
+    // the upper half is exactly the last slab of each pool
+    pfs_pool_shrink(&pfs_files_pool);
+    pfs_pool_shrink(&pfs_dirs_pool);
+    pfs_free_slots_t *stacks[2] = {&pfs_files_free_slots,
+                                   &pfs_dirs_free_slots};
+    for (int s = 0; s < 2; s++) {
+      int count = 0;
+      for (int i = 0; i < stacks[s]->count; i++) {
+        if (stacks[s]->ids[i] < capacity)
+          stacks[s]->ids[count++] = stacks[s]->ids[i];
+      }
+      stacks[s]->count = count;
+    }
+    // the tables and index keep their size, see pfs_ns_seq
+    pfs_max_items = capacity;
+  }
+done:
+  max_items = pfs_max_items; // not safe to read once unlocked
+  pfs_ns_write_unlock();
+  return max_items;
 }
 
 pfs_file_t **pfs_get_files() { return pfs_files; }
@@ -326,9 +893,17 @@ pfs_dir_t **pfs_get_dirs() { return pfs_dirs; }
 
 int pfs_get_max_items() { return pfs_max_items; }
 
+int pfs_get_max_open_files() { return pfs_max_open_files; }
+
+void pfs_set_max_open_files(size_t max_open_files) {
+  ESP_LOGD(TAG, "Setting max open files to %d", max_open_files);
+  pfs_max_open_files = max_open_files;
+}
+
 void pfs_set_max_items(size_t max_items) {
-  ESP_LOGD(TAG, "Setting max items to %d", pfs_max_items);
+  ESP_LOGD(TAG, "Setting max items to %d", max_items);
   pfs_max_items = max_items;
+  pfs_max_items_custom = true;
 }
 
 size_t pfs_get_block_size() { return pfs_alloc_block_size; }
@@ -336,6 +911,17 @@ size_t pfs_get_block_size() { return pfs_alloc_block_size; }
 void pfs_set_block_size(size_t block_size) {
   ESP_LOGD(TAG, "Setting alloc block size to %d", block_size);
   pfs_alloc_block_size = block_size;
+  pfs_block_size_custom = true;
+}
+
+// only applies to values the user did not set before mounting
+static void pfs_set_alloc_defaults(size_t max_items, size_t block_size) {
+  if (!pfs_max_items_custom)
+    pfs_max_items = max_items;
+  if (!pfs_block_size_custom)
+    pfs_alloc_block_size = block_size;
+  ESP_LOGD(TAG, "Using max items=%d, alloc block size=%d", pfs_max_items,
+           pfs_alloc_block_size);
 }
 
 void pfs_set_alloc_functions() {
@@ -350,16 +936,14 @@ void pfs_set_alloc_functions() {
     pfs_realloc = p_realloc;
     pfs_calloc = p_calloc;
     pfs_free_mem = p_free;
-    pfs_set_max_items(256);
-    pfs_set_block_size(4096);
+    pfs_set_alloc_defaults(32, 4096);
   } else {
     ESP_LOGD(TAG, "pfs will use heap by config");
     pfs_malloc = i_malloc;
     pfs_realloc = i_realloc;
     pfs_calloc = i_calloc;
     pfs_free_mem = i_free;
-    pfs_set_max_items(16);
-    pfs_set_block_size(512);
+    pfs_set_alloc_defaults(16, 512);
   }
 #else // ! BOARD_HAS_PSRAM
   ESP_LOGD(TAG, "pfs will use malloc");
@@ -369,11 +953,9 @@ void pfs_set_alloc_functions() {
   pfs_calloc = i_calloc;
   pfs_free_mem = i_free;
 #if defined CONFIG_SPIRAM_SUPPORT
-  pfs_set_max_items(256);
-  pfs_set_block_size(4096);
+  pfs_set_alloc_defaults(32, 4096);
 #else
-  pfs_set_max_items(16);
-  pfs_set_block_size(512);
+  pfs_set_alloc_defaults(16, 512);
 #endif
 #endif
 }
@@ -385,6 +967,48 @@ void pfs_set_psram(bool use) {
 
 bool pfs_get_psram() { return pfs_psram_enabled; }
 
+void pfs_set_chunked(bool use) {
+  ESP_LOGD(TAG, "%s chunked storage...", use ? "Enabling" : "Disabling");
+  pfs_chunked_enabled = use;
+}
+
+bool pfs_get_chunked() { return pfs_chunked_enabled; }
+
+void pfs_set_internal_threshold(size_t size) {
+  ESP_LOGD(TAG, "Setting internal ram threshold to %d bytes", size);
+  pfs_internal_threshold = size;
+}
+
+size_t pfs_get_internal_threshold() { return pfs_internal_threshold; }
+
+void pfs_set_inline_size(size_t size) {
+  if (size > PFS_INLINE_SIZE) {
+    ESP_LOGW(TAG, "Inline size capped to %d bytes (PFS_INLINE_SIZE)",
+             PFS_INLINE_SIZE);
+    size = PFS_INLINE_SIZE;
+  }
+  ESP_LOGD(TAG, "Setting inline size to %d bytes", size);
+  pfs_inline_size = size;
+}
+
+size_t pfs_get_inline_size() { return pfs_inline_size; }
+
+void pfs_set_shrink_on_close(bool use) {
+  ESP_LOGD(TAG, "%s shrink on close...", use ? "Enabling" : "Disabling");
+  pfs_shrink_on_close = use;
+}
+
+bool pfs_get_shrink_on_close() { return pfs_shrink_on_close; }
+
+void pfs_set_growth_policy(pfs_growth_policy_t policy, size_t cap) {
+  ESP_LOGD(TAG, "Setting growth policy to %d (cap=%d)", policy, cap);
+  pfs_growth_policy = policy;
+  if (cap > 0)
+    pfs_growth_cap = cap;
+}
+
+pfs_growth_policy_t pfs_get_growth_policy() { return pfs_growth_policy; }
+
 void pfs_set_partition_size(size_t size) { pfs_partition_size = size; }
 
 size_t pfs_get_partition_size() { return pfs_partition_size; }
@@ -401,19 +1025,45 @@ void pfs_init(const char *partition_label) {
 
   ESP_LOGD(TAG, "[%d] bytes free before running init", pfs_free_mem());
 
+  if (pfs_max_items < 1)
+    pfs_max_items = 1;
+  pfs_min_items = pfs_max_items;
+
   pfs_files = (pfs_file_t **)pfs_calloc(pfs_max_items, sizeof(pfs_file_t *));
+  pfs_tables_capacity = pfs_max_items;
   if (pfs_files == NULL) {
     ESP_LOGE(TAG, "Unable to init pfs, halting");
     while (1)
       ;
   }
+  // all file entries live in a single slab
+  if (!pfs_pool_init(&pfs_files_pool, sizeof(pfs_file_t), pfs_max_items)) {
+    ESP_LOGE(TAG, "Unable to init pfs, halting");
+    while (1)
+      ;
+  }
   for (int i = 0; i < pfs_max_items; i++) {
-    pfs_files[i] = (pfs_file_t *)pfs_calloc(1, sizeof(pfs_file_t));
+    pfs_files[i] = (pfs_file_t *)pfs_pool_alloc(&pfs_files_pool);
     if (pfs_files[i] == NULL) {
       ESP_LOGE(TAG, "Unable to init pfs, halting");
       while (1)
         ;
     }
+    pfs_rwlock_init(&pfs_files[i]->lock);
+  }
+
+  if (!pfs_index_init(&pfs_files_index, pfs_max_items) ||
+      !pfs_free_slots_init(&pfs_files_free_slots, pfs_max_items)) {
+    ESP_LOGE(TAG, "Unable to init pfs, halting");
+    while (1)
+      ;
+  }
+
+  pfs_fds = (pfs_fd_t *)pfs_calloc(pfs_max_open_files, sizeof(pfs_fd_t));
+  if (pfs_fds == NULL) {
+    ESP_LOGE(TAG, "Unable to init pfs, halting");
+    while (1)
+      ;
   }
 
   ESP_LOGD(TAG, "Init files OK");
@@ -443,97 +1093,236 @@ void pfs_init_dirs() {
     while (1)
       ;
   }
+  if (!pfs_pool_init(&pfs_dirs_pool, sizeof(pfs_dir_t), pfs_max_items) ||
+      !pfs_pool_init(&pfs_dir_handles_pool, sizeof(pfs_dir_handle_t), 4)) {
+    ESP_LOGE(TAG, "Unable to init pfs, halting");
+    while (1)
+      ;
+  }
   for (int i = 0; i < pfs_max_items; i++) {
-    pfs_dirs[i] = (pfs_dir_t *)pfs_calloc(1, sizeof(pfs_dir_t));
+    pfs_dirs[i] = (pfs_dir_t *)pfs_pool_alloc(&pfs_dirs_pool);
     if (pfs_dirs[i] == NULL) {
       ESP_LOGE(TAG, "Unable to init pfs, halting");
       while (1)
         ;
     }
   }
+  if (!pfs_index_init(&pfs_dirs_index, pfs_max_items) ||
+      !pfs_free_slots_init(&pfs_dirs_free_slots, pfs_max_items)) {
+    ESP_LOGE(TAG, "Unable to init pfs, halting");
+    while (1)
+      ;
+  }
   pfs_mkdir("/");
   ESP_LOGD(TAG, "Init dirs OK");
 }
 
 int pfs_next_file_avail() {
-  int res = 0;
-  if (pfs_files != NULL) {
-    for (int i = 0; i < pfs_max_items; i++) {
-      if (pfs_files[i]->name == NULL) {
-        ESP_LOGV(TAG, "File Slot %d out of %d is free [r]", i, pfs_max_items);
-        return i;
-      }
-    }
-    ESP_LOGE(TAG, "Too many files created.");
-  } else {
+  if (pfs_files == NULL) {
     ESP_LOGE(TAG, "No allocated space for files");
+    return -1;
   }
-  return res;
+  if (pfs_files_free_slots.count == 0 && !pfs_grow_tables()) {
+    ESP_LOGE(TAG, "Too many files created.");
+    return -1;
+  }
+  int slot = pfs_free_slots_pop(&pfs_files_free_slots);
+  ESP_LOGV(TAG, "File Slot %d out of %d is free [r]", slot, pfs_max_items);
+  return slot;
 }
 
 int pfs_next_dir_avail() {
-  int res = 0;
-  if (pfs_dirs != NULL) {
-    for (int i = 0; i < pfs_max_items; i++) {
-      if (pfs_dirs[i]->name == NULL) {
-        ESP_LOGV(TAG, "Dir Slot %d out of %d is free [r]", i, pfs_max_items);
-        return i;
-      }
-    }
-    ESP_LOGE(TAG, "Too many dirs created, halting");
-    while (1)
-      ;
-  } else {
+  if (pfs_dirs == NULL) {
     ESP_LOGE(TAG, "No allocated space for dirs");
+    return -1;
   }
-  return res;
+  if (pfs_dirs_free_slots.count == 0 && !pfs_grow_tables()) {
+    ESP_LOGE(TAG, "Too many dirs created.");
+    return -1;
+  }
+  int slot = pfs_free_slots_pop(&pfs_dirs_free_slots);
+  ESP_LOGV(TAG, "Dir Slot %d out of %d is free [r]", slot, pfs_max_items);
+  return slot;
 }
 
-int pfs_find_file(const char *path) {
-  if (pfs_files != NULL) {
-    for (int i = 0; i < pfs_max_items; i++) {
-      if (pfs_files[i]->name == NULL)
-        continue;
-      if (strcmp(path, pfs_files[i]->name) == 0) {
-        return i;
-      }
+// looks [name] up in [dir_id], safe to call without pfs_ns_lock as long as
+// the result is validated with pfs_ns_read_retry(): every shared pointer is
+// loaded once, and in the reverse order pfs_index_resize() publishes them
+static int pfs_lookup(pfs_index_t *index, void ***table, bool dirs, int dir_id,
+                      const char *name, size_t len) {
+  size_t mask = __atomic_load_n(&index->bucket_mask, __ATOMIC_ACQUIRE);
+  int *buckets = __atomic_load_n(&index->buckets, __ATOMIC_ACQUIRE);
+  if (buckets == NULL)
+    return -1;
+  size_t capacity = __atomic_load_n(&index->capacity, __ATOMIC_ACQUIRE);
+  int *next = __atomic_load_n(&index->next, __ATOMIC_ACQUIRE);
+  uint32_t *hashes = __atomic_load_n(&index->hashes, __ATOMIC_ACQUIRE);
+  void **entries = __atomic_load_n(table, __ATOMIC_ACQUIRE);
+  uint32_t hash = pfs_hash(dir_id, name, len);
+  int i = __atomic_load_n(&buckets[hash & mask], __ATOMIC_ACQUIRE);
+  // bounded, a concurrent writer may briefly link chains oddly
+  for (size_t steps = 0; i > -1 && (size_t)i < capacity && steps < capacity;
+       steps++, i = __atomic_load_n(&next[i], __ATOMIC_ACQUIRE)) {
+    if (__atomic_load_n(&hashes[i], __ATOMIC_RELAXED) != hash)
+      continue;
+    char *entry_name;
+    int parent_id;
+    if (dirs) {
+      pfs_dir_t *dir = (pfs_dir_t *)entries[i];
+      pfs_dir_t *parent = dir->parent_dir;
+      entry_name = dir->name;
+      parent_id = parent != NULL ? parent->dir_id : -1;
+    } else {
+      pfs_file_t *file = (pfs_file_t *)entries[i];
+      entry_name = file->name;
+      parent_id = file->dir_id;
     }
+    if (entry_name == NULL || parent_id != dir_id)
+      continue;
+    if (strncmp(name, entry_name, len) == 0 && entry_name[len] == '\0')
+      return i;
   }
   return -1;
 }
 
+int pfs_lookup_file(int dir_id, const char *name, size_t len) {
+  if (__atomic_load_n(&pfs_files, __ATOMIC_ACQUIRE) == NULL)
+    return -1;
+  return pfs_lookup(&pfs_files_index, (void ***)&pfs_files, false, dir_id,
+                    name, len);
+}
+
+int pfs_lookup_dir(int dir_id, const char *name, size_t len) {
+  if (__atomic_load_n(&pfs_dirs, __ATOMIC_ACQUIRE) == NULL)
+    return -1;
+  return pfs_lookup(&pfs_dirs_index, (void ***)&pfs_dirs, true, dir_id, name,
+                    len);
+}
+
+// walks [path] one component at a time down to the directory holding its
+// last component, which is returned in [base] / [baselen] (empty for the
+// root dir), missing directories are created on the way when [create] is
+// set (mkdir -p), returns the directory id or -1
+int pfs_walk_path(const char *path, const char **base, size_t *baselen,
+                  bool create) {
+  int dir_id = 0;
+  size_t len;
+  const char *name = pfs_next_component(path, &len);
+  while (len > 0) {
+    size_t next_len;
+    const char *next = pfs_next_component(name + len, &next_len);
+    if (next_len == 0)
+      break; // last component
+    int child_id = pfs_lookup_dir(dir_id, name, len);
+    if (child_id < 0 && create)
+      child_id = pfs_mkdir_at(dir_id, name, len);
+    if (child_id < 0)
+      return -1;
+    dir_id = child_id;
+    name = next;
+    len = next_len;
+  }
+  *base = name;
+  *baselen = len;
+  return dir_id;
+}
+
+int pfs_find_file(const char *path) {
+  const char *base;
+  size_t baselen;
+  if (__atomic_load_n(&pfs_files, __ATOMIC_ACQUIRE) == NULL ||
+      __atomic_load_n(&pfs_dirs, __ATOMIC_ACQUIRE) == NULL)
+    return -1;
+  int dir_id = pfs_walk_path(path, &base, &baselen, false);
+  if (dir_id < 0 || baselen == 0)
+    return -1;
+  return pfs_lookup_file(dir_id, base, baselen);
+}
+
 int pfs_find_dir(const char *path) {
-  if (pfs_dirs != NULL) {
-    for (int i = 0; i < pfs_max_items; i++) {
-      if (pfs_dirs[i]->name == NULL)
-        continue;
-      if (strcmp(path, pfs_dirs[i]->name) == 0) {
-        return i;
-      }
-    }
-    // ESP_LOGD(TAG, "Dir %s not found", path);
-  } else {
+  const char *base;
+  size_t baselen;
+  pfs_dir_t **dirs = __atomic_load_n(&pfs_dirs, __ATOMIC_ACQUIRE);
+  if (dirs == NULL) {
     ESP_LOGW(TAG, "Call on pfs_find_dir() before pfs_dirs are allocated");
+    return -1;
   }
-  return -1;
+  int dir_id = pfs_walk_path(path, &base, &baselen, false);
+  if (dir_id < 0)
+    return -1;
+  if (baselen == 0) // root dir
+    return dirs[0]->name != NULL ? 0 : -1;
+  return pfs_lookup_dir(dir_id, base, baselen);
 }
 
-size_t pfs_used_bytes() {
+#if defined PFS_CHECK_USED_BYTES
+// full scan of the files memory, only used to cross-check pfs_used_total
+// and pfs_used_internal
+static size_t pfs_scan_used_bytes(size_t *internal) {
+  static uint32_t scan = 0;
   size_t totalsize = 0;
+  *internal = 0;
+  scan++;
   if (pfs_files != NULL) {
     for (int i = 0; i < pfs_max_items; i++) {
-      if (pfs_files[i]->name != NULL) {
+      if (pfs_files[i]->flags & (PFS_F_ROM | PFS_F_INLINE))
+        continue; // not ours, or part of the entry
+      pfs_shared_t *shared = pfs_files[i]->shared;
+      if (shared != NULL) { // count clones once
+        if (shared->scan == scan)
+          continue;
+        shared->scan = scan;
+      }
+      // unlinked files still hold memory until their last handle is closed
+      if (pfs_files[i]->name != NULL || pfs_files[i]->refcount > 0) {
         // totalsize += pfs_files[i]->size;
         totalsize += pfs_files[i]->memsize;
+        if (pfs_files[i]->flags & PFS_F_INTERNAL)
+          *internal += pfs_files[i]->memsize;
         // ESP_LOGV(TAG, "Adding %d bytes from %s (total=%d)",
         // pfs_files[i]->size, pfs_files[i]->name, totalsize );
       }
     }
-  } else {
-    ESP_LOGW(TAG, "Call on used_bytes() before pfs_files are allocated");
   }
   return totalsize;
 }
+#endif
+
+size_t pfs_used_bytes() {
+  if (pfs_files == NULL) {
+    ESP_LOGW(TAG, "Call on used_bytes() before pfs_files are allocated");
+    return 0;
+  }
+  size_t used = __atomic_load_n(&pfs_used_total, __ATOMIC_RELAXED);
+#if defined PFS_CHECK_USED_BYTES
+  // the scan takes no lock, only meaningful with a single task
+  size_t internal;
+  size_t scanned = pfs_scan_used_bytes(&internal);
+  if (scanned != used) {
+    ESP_LOGE(TAG, "Used bytes mismatch: counted %d, scanned %d", used,
+             scanned);
+  }
+  if (internal != __atomic_load_n(&pfs_used_internal, __ATOMIC_RELAXED)) {
+    ESP_LOGE(TAG, "Internal bytes mismatch: counted %d, scanned %d",
+             pfs_used_internal, internal);
+  }
+#endif
+  return used;
+}
+
+// without psram everything is in internal ram
+size_t pfs_used_bytes_internal() {
+  if (!pfs_psram_enabled)
+    return pfs_used_bytes();
+  return __atomic_load_n(&pfs_used_internal, __ATOMIC_RELAXED);
+}
+
+size_t pfs_used_bytes_psram() {
+  if (!pfs_psram_enabled)
+    return 0;
+  return pfs_used_bytes() -
+         __atomic_load_n(&pfs_used_internal, __ATOMIC_RELAXED);
+}
 
 int pfs_stat(const char *path, struct stat *stat_) {
   assert(path);
@@ -547,11 +1336,13 @@ int pfs_stat(const char *path, struct stat *stat_) {
 
   int file_id = pfs_find_file(path);
   if (file_id > -1) {
-    stat_->st_size = pfs_files[file_id]->size;
+    // may run lock-free, and is only a snapshot anyway
+    pfs_file_t *file = __atomic_load_n(&pfs_files, __ATOMIC_ACQUIRE)[file_id];
+    stat_->st_size = __atomic_load_n(&file->size, __ATOMIC_RELAXED);
     stat_->st_mode = S_IRWXU | S_IRWXG | S_IRWXO | S_IFREG;
     stat_->st_mode = S_IFREG;
     ESP_LOGV(TAG, "stating for DT_REG(%s) success (size=%d)", path,
-             pfs_files[file_id]->size);
+             (int)stat_->st_size);
     return 0;
   } else {
     ESP_LOGV(TAG, "stating for DT_REG(%s) no pass", path);
@@ -603,7 +1394,7 @@ const char *pfs_flags_conv_str(int m) {
 
 int pfs_flags_conv(int m) {
   int pfs_flags = 0;
-  if (m == O_APPEND) {
+  if (m & O_APPEND) {
     ESP_LOGV(TAG, "O_APPEND");
     pfs_flags |= PFS_O_APPEND;
   }
@@ -634,29 +1425,572 @@ int pfs_flags_conv(int m) {
   return pfs_flags;
 }
 
-pfs_file_t *pfs_fopen(const char *path, int flags, int fmode) {
-  if (path == NULL) {
-    ESP_LOGE(TAG, "Invalid path");
-    return NULL;
-  } else {
-    ESP_LOGV(TAG, "Valid path :%s, flags = 0x%04x, mode = 0x%04x", path, flags,
-             fmode);
+static void pfs_free_bytes(pfs_file_t *file);
+
+// other files may grow at the same time, the limit is best effort
+static bool pfs_z_fits(size_t bytes) {
+  return pfs_partition_size == 0 ||
+         __atomic_load_n(&pfs_used_total, __ATOMIC_RELAXED) + bytes <=
+             pfs_partition_size;
+}
+
+static void pfs_z_account(pfs_file_t *file, size_t added, size_t removed) {
+  file->memsize = file->memsize + added - removed;
+  __atomic_add_fetch(&pfs_used_total, added, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&pfs_used_total, removed, __ATOMIC_RELAXED);
+}
+
+// gives the file an empty compressed storage
+static bool pfs_z_start(pfs_file_t *file) {
+  pfs_zfile_t *z = (pfs_zfile_t *)pfs_calloc(1, sizeof(pfs_zfile_t));
+  if (z == NULL) {
+    ESP_LOGE(TAG, "Can't alloc compressed storage for %s", file->name);
+    return false;
   }
+  pthread_mutex_init(&z->lock, NULL);
+  z->cached = -1;
+  file->z = z;
+  return true;
+}
 
-  const char *mode = pfs_flags_conv_str(flags);
-  int newflags = pfs_flags_conv(flags);
+// frees the compressed storage, memsize is left to the caller
+static void pfs_z_free(pfs_file_t *file) {
+  pfs_zfile_t *z = file->z;
+  for (uint32_t i = 0; i < z->count; i++)
+    free(z->blocks[i].data);
+  free(z->blocks);
+  free(z->cache);
+  pthread_mutex_destroy(&z->lock);
+  free(z);
+  file->z = NULL;
+}
 
-  int file_id = pfs_find_file(path);
+// decompresses block [b] into [dst], zeroes past its stored bytes
+static bool pfs_z_get_block(pfs_file_t *file, uint32_t b, uint8_t *dst) {
+  pfs_zfile_t *z = file->z;
+  size_t len = 0;
+  if (b < z->count && z->blocks[b].data != NULL) {
+    pfs_zblock_t *block = &z->blocks[b];
+    if (block->len == block->raw) {
+      memcpy(dst, block->data, block->raw);
+      len = block->raw;
+    } else {
+      len = pfs_lz_decompress((const uint8_t *)block->data, block->len, dst,
+                              PFS_Z_BLOCK_SIZE);
+    }
+    if (len != block->raw) {
+      ESP_LOGE(TAG, "Block %d of %s is corrupted", b, file->name);
+      return false;
+    }
+  }
+  memset(&dst[len], 0, PFS_Z_BLOCK_SIZE - len);
+  return true;
+}
 
-  if (file_id > -1) {
+// compresses the cached block back into the index
+static bool pfs_z_store(pfs_file_t *file) {
+  pfs_zfile_t *z = file->z;
+  if (!z->dirty)
+    return true;
+  uint32_t b = z->cached;
+  if (b >= z->capacity) {
+    uint32_t capacity = z->capacity > 0 ? z->capacity * 2 : 4;
+    if (capacity <= b)
+      capacity = b + 1;
+    pfs_zblock_t *blocks = (pfs_zblock_t *)pfs_realloc(
+        z->blocks, capacity * sizeof(pfs_zblock_t));
+    if (blocks == NULL) {
+      ESP_LOGE(TAG, "Can't grow the blocks index of %s", file->name);
+      return false;
+    }
+    memset(&blocks[z->capacity], 0,
+           (capacity - z->capacity) * sizeof(pfs_zblock_t));
+    z->blocks = blocks;
+    z->capacity = capacity;
+  }
+  pfs_zblock_t *block = &z->blocks[b];
+  size_t raw = z->cache_len;
+  size_t len = raw;
+  char *data = NULL;
+  if (raw > 0) {
+    pthread_mutex_lock(&pfs_z_scratch_lock);
+    if (pfs_z_scratch == NULL)
+      pfs_z_scratch = (uint8_t *)pfs_malloc(
+          PFS_LZ_HASH_SIZE * sizeof(uint16_t) + PFS_Z_BLOCK_SIZE);
+    const uint8_t *src = (const uint8_t *)z->cache;
+    if (pfs_z_scratch != NULL) {
+      uint8_t *out = &pfs_z_scratch[PFS_LZ_HASH_SIZE * sizeof(uint16_t)];
+      // only worth it when smaller, else the block is kept as is
+      size_t compressed = pfs_lz_compress(src, raw, out, raw - 1,
+                                          (uint16_t *)pfs_z_scratch);
+      if (compressed > 0) {
+        src = out;
+        len = compressed;
+      }
+    }
+    if (len <= block->len || pfs_z_fits(len - block->len))
+      data = (char *)pfs_malloc(len);
+    if (data != NULL)
+      memcpy(data, src, len);
+    pthread_mutex_unlock(&pfs_z_scratch_lock);
+    if (data == NULL) {
+      ESP_LOGE(TAG, "Can't alloc %d bytes for block %d of %s", len, b,
+               file->name);
+      return false;
+    }
+  }
+  free(block->data);
+  pfs_z_account(file, len, block->len);
+  block->data = data;
+  block->len = len;
+  block->raw = raw;
+  if (b >= z->count)
+    z->count = b + 1;
+  z->dirty = false;
+  return true;
+}
 
-    // ESP_LOGV(TAG, "Old flags: 0x%08x, New flags: 0x%08x",
-    // pfs_files[file_id]->flags, newflags ); pfs_files[file_id]->flags =
-    // newflags;
+// brings block [b] in the cache, [fill] when the caller overwrites it whole
+static bool pfs_z_load(pfs_file_t *file, uint32_t b, bool fill) {
+  pfs_zfile_t *z = file->z;
+  if (z->cached == (int32_t)b)
+    return true;
+  if (!pfs_z_store(file))
+    return false;
+  if (z->cache == NULL) {
+    if (pfs_z_fits(PFS_Z_BLOCK_SIZE))
+      z->cache = (char *)pfs_malloc(PFS_Z_BLOCK_SIZE);
+    if (z->cache == NULL) {
+      ESP_LOGE(TAG, "Can't alloc a block cache for %s", file->name);
+      return false;
+    }
+    pfs_z_account(file, PFS_Z_BLOCK_SIZE, 0);
+  }
+  z->cached = -1;
+  if (!fill && !pfs_z_get_block(file, b, (uint8_t *)z->cache))
+    return false;
+  z->cached = b;
+  z->cache_len = b < z->count ? z->blocks[b].raw : 0;
+  return true;
+}
 
-    // existing file
-    if (mode) {
-      switch (mode[0]) {
+// returns the bytes read, short when a block can't be loaded
+static size_t pfs_z_read(pfs_file_t *file, uint8_t *buf, size_t len,
+                         uint32_t offset) {
+  pfs_zfile_t *z = file->z;
+  size_t done = 0;
+  pthread_mutex_lock(&z->lock);
+  while (done < len) {
+    uint32_t b = (offset + done) / PFS_Z_BLOCK_SIZE;
+    uint32_t pos = (offset + done) % PFS_Z_BLOCK_SIZE;
+    size_t n = len - done < PFS_Z_BLOCK_SIZE - pos ? len - done
+                                                   : PFS_Z_BLOCK_SIZE - pos;
+    if (n == PFS_Z_BLOCK_SIZE && z->cached != (int32_t)b) {
+      // whole block, straight to the caller
+      if (!pfs_z_get_block(file, b, &buf[done]))
+        break;
+    } else {
+      if (!pfs_z_load(file, b, false))
+        break;
+      memcpy(&buf[done], &z->cache[pos], n);
+    }
+    done += n;
+  }
+  pthread_mutex_unlock(&z->lock);
+  return done;
+}
+
+// returns the bytes written, the file size is left to the caller
+static size_t pfs_z_write(pfs_file_t *file, const uint8_t *buf, size_t len,
+                          uint32_t offset) {
+  pfs_zfile_t *z = file->z;
+  size_t done = 0;
+  pthread_mutex_lock(&z->lock);
+  while (done < len) {
+    uint32_t b = (offset + done) / PFS_Z_BLOCK_SIZE;
+    uint32_t pos = (offset + done) % PFS_Z_BLOCK_SIZE;
+    size_t n = len - done < PFS_Z_BLOCK_SIZE - pos ? len - done
+                                                   : PFS_Z_BLOCK_SIZE - pos;
+    if (!pfs_z_load(file, b, n == PFS_Z_BLOCK_SIZE))
+      break;
+    memcpy(&z->cache[pos], &buf[done], n);
+    if (pos + n > z->cache_len)
+      z->cache_len = pos + n;
+    z->dirty = true;
+    done += n;
+  }
+  pthread_mutex_unlock(&z->lock);
+  return done;
+}
+
+// growing costs nothing, bytes past the stored ones read as zeroes
+static bool pfs_z_resize(pfs_file_t *file, uint32_t size) {
+  pfs_zfile_t *z = file->z;
+  bool res = true;
+  pthread_mutex_lock(&z->lock);
+  if (size < file->size) {
+    uint32_t keep = (size + PFS_Z_BLOCK_SIZE - 1) / PFS_Z_BLOCK_SIZE;
+    if (z->cached >= (int32_t)keep) {
+      z->cached = -1;
+      z->dirty = false;
+    }
+    for (uint32_t b = keep; b < z->count; b++) {
+      free(z->blocks[b].data);
+      pfs_z_account(file, 0, z->blocks[b].len);
+      memset(&z->blocks[b], 0, sizeof(pfs_zblock_t));
+    }
+    if (z->count > keep)
+      z->count = keep;
+    // the last block must not keep bytes past the new end
+    uint32_t tail = size % PFS_Z_BLOCK_SIZE;
+    if (tail > 0) {
+      res = pfs_z_load(file, keep - 1, false);
+      if (res && z->cache_len > tail) {
+        memset(&z->cache[tail], 0, z->cache_len - tail);
+        z->cache_len = tail;
+        z->dirty = true;
+      }
+    }
+  }
+  if (res)
+    pfs_set_size(file, size);
+  pthread_mutex_unlock(&z->lock);
+  return res;
+}
+
+// compresses the cached block and frees the cache, for idle files
+static size_t pfs_z_release_cache(pfs_file_t *file) {
+  pfs_zfile_t *z = file->z;
+  size_t before = file->memsize;
+  pthread_mutex_lock(&z->lock);
+  if (z->cache != NULL && pfs_z_store(file)) {
+    free(z->cache);
+    z->cache = NULL;
+    z->cached = -1;
+    pfs_z_account(file, 0, PFS_Z_BLOCK_SIZE);
+  }
+  pthread_mutex_unlock(&z->lock);
+  return before > file->memsize ? before - file->memsize : 0;
+}
+
+// moves the file data to compressed storage
+static bool pfs_z_compress_file(pfs_file_t *file) {
+  // built aside so the file is untouched on failure
+  pfs_file_t shadow;
+  memset(&shadow, 0, sizeof(pfs_file_t));
+  shadow.name = file->name;
+  if (!pfs_z_start(&shadow))
+    return false;
+  bool ok = true;
+  for (uint32_t pos = 0; ok && pos < file->size; pos += PFS_Z_BLOCK_SIZE) {
+    size_t n = file->size - pos < PFS_Z_BLOCK_SIZE ? file->size - pos
+                                                   : PFS_Z_BLOCK_SIZE;
+    ok = pfs_z_load(&shadow, pos / PFS_Z_BLOCK_SIZE, true) &&
+         pfs_pread(file, (uint8_t *)shadow.z->cache, n, pos) == n;
+    shadow.z->cache_len = n;
+    shadow.z->dirty = ok;
+  }
+  if (ok && shadow.z->cache != NULL) {
+    pfs_z_release_cache(&shadow);
+    ok = shadow.z->cache == NULL;
+  }
+  if (!ok) {
+    pfs_z_free(&shadow);
+    __atomic_sub_fetch(&pfs_used_total, shadow.memsize, __ATOMIC_RELAXED);
+    return false;
+  }
+  uint32_t size = file->size;
+  pfs_free_bytes(file);
+  file->z = shadow.z;
+  file->memsize = shadow.memsize;
+  pfs_set_size(file, size);
+  ESP_LOGD(TAG, "Compressed %s from %d to %d bytes", file->name, size,
+           file->memsize);
+  return true;
+}
+
+// moves the file data back to a contiguous buffer
+static bool pfs_z_decompress_file(pfs_file_t *file) {
+  uint32_t size = file->size;
+  char *bytes = NULL;
+  if (size > 0) {
+    if (pfs_z_fits(size))
+      bytes = (char *)pfs_malloc(size);
+    if (bytes == NULL) {
+      ESP_LOGE(TAG, "Can't alloc %d bytes to decompress %s", size,
+               file->name);
+      return false;
+    }
+    if (pfs_z_read(file, (uint8_t *)bytes, size, 0) != size) {
+      free(bytes);
+      return false;
+    }
+  }
+  pfs_free_bytes(file);
+  file->bytes = bytes;
+  file->memsize = size;
+  __atomic_add_fetch(&pfs_used_total, size, __ATOMIC_RELAXED);
+  return true;
+}
+
+// frees the file data whatever the storage mode, keeps the file entry,
+// data still used by clones or linked from read-only memory is only let go of
+static void pfs_free_bytes(pfs_file_t *file) {
+  if (file->flags & (PFS_F_ROM | PFS_F_INLINE)) {
+    file->flags &= ~(PFS_F_ROM | PFS_F_INLINE);
+    file->bytes = NULL;
+    file->memsize = 0;
+    return;
+  }
+  if (file->shared != NULL) {
+    pfs_shared_t *shared = file->shared;
+    file->shared = NULL;
+    if (__atomic_sub_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+      file->bytes = NULL;
+      file->chunks = NULL;
+      file->chunks_count = 0;
+      file->chunks_capacity = 0;
+      file->chunk_size = 0;
+      file->memsize = 0;
+      file->flags &= ~PFS_F_INTERNAL; // still counted for the clones
+      return;
+    }
+    free(shared);
+  }
+  if (file->z != NULL)
+    pfs_z_free(file);
+  if (file->bytes != NULL) {
+    free(file->bytes);
+    file->bytes = NULL;
+  }
+  if (file->chunks != NULL) {
+    for (uint32_t i = 0; i < file->chunks_count; i++)
+      free(file->chunks[i]);
+    free(file->chunks);
+    file->chunks = NULL;
+  }
+  file->chunks_count = 0;
+  file->chunks_capacity = 0;
+  file->chunk_size = 0;
+  __atomic_sub_fetch(&pfs_used_total, file->memsize, __ATOMIC_RELAXED);
+  if (file->flags & PFS_F_INTERNAL)
+    __atomic_sub_fetch(&pfs_used_internal, file->memsize, __ATOMIC_RELAXED);
+  file->flags &= ~PFS_F_INTERNAL;
+  file->memsize = 0;
+}
+
+// copies read-only data to a buffer of our own, before writing
+static bool pfs_unrom(pfs_file_t *file) {
+  if (file->maps > 0) {
+    ESP_LOGE(TAG, "Can't copy %s while it's mapped", file->name);
+    return false;
+  }
+  size_t used_bytes = __atomic_load_n(&pfs_used_total, __ATOMIC_RELAXED);
+  if (pfs_partition_size > 0 &&
+      used_bytes + file->memsize > pfs_partition_size) {
+    ESP_LOGE(TAG, "Not enough memory left to copy %s (%d bytes)", file->name,
+             file->memsize);
+    return false;
+  }
+  char *bytes = (char *)pfs_malloc(file->memsize);
+  if (bytes == NULL) {
+    ESP_LOGE(TAG, "Can't alloc %d bytes to copy %s", file->memsize,
+             file->name);
+    return false;
+  }
+  memcpy(bytes, file->bytes, file->memsize);
+  file->bytes = bytes;
+  file->flags &= ~PFS_F_ROM;
+  __atomic_add_fetch(&pfs_used_total, file->memsize, __ATOMIC_RELAXED);
+  ESP_LOGD(TAG, "Copied %d read-only bytes of %s", file->memsize, file->name);
+  return true;
+}
+
+static bool pfs_lru_listed(pfs_file_t *file) {
+  return file->lru_newer != NULL || file->lru_older != NULL ||
+         pfs_lru_newest == file;
+}
+
+static void pfs_lru_remove(pfs_file_t *file) {
+  if (!pfs_lru_listed(file))
+    return;
+  if (file->lru_newer != NULL)
+    file->lru_newer->lru_older = file->lru_older;
+  else
+    pfs_lru_newest = file->lru_older;
+  if (file->lru_older != NULL)
+    file->lru_older->lru_newer = file->lru_newer;
+  else
+    pfs_lru_oldest = file->lru_newer;
+  file->lru_newer = NULL;
+  file->lru_older = NULL;
+}
+
+// lists [file] if nobody uses it, as the most [recent] or the oldest one
+static void pfs_lru_add(pfs_file_t *file, bool recent) {
+  if (pfs_lru_listed(file) || file->refcount > 0 || file->pinned ||
+      file->name == NULL)
+    return;
+  if (recent) {
+    file->lru_older = pfs_lru_newest;
+    if (pfs_lru_newest != NULL)
+      pfs_lru_newest->lru_newer = file;
+    else
+      pfs_lru_oldest = file;
+    pfs_lru_newest = file;
+  } else {
+    file->lru_newer = pfs_lru_oldest;
+    if (pfs_lru_oldest != NULL)
+      pfs_lru_oldest->lru_older = file;
+    else
+      pfs_lru_newest = file;
+    pfs_lru_oldest = file;
+  }
+}
+
+// gives the file its own copy of data shared with clones or linked from
+// read-only memory, before writing
+static bool pfs_unshare(pfs_file_t *file) {
+  if (file->flags & PFS_F_ROM)
+    return pfs_unrom(file);
+  pfs_shared_t *shared = file->shared;
+  if (shared == NULL)
+    return true;
+  if (__atomic_load_n(&shared->refs, __ATOMIC_ACQUIRE) == 1) {
+    // the clones are gone, the data is private already
+    free(shared);
+    file->shared = NULL;
+    return true;
+  }
+  if (file->maps > 0) {
+    ESP_LOGE(TAG, "Can't copy %s while it's mapped", file->name);
+    return false;
+  }
+  size_t used_bytes = __atomic_load_n(&pfs_used_total, __ATOMIC_RELAXED);
+  if (pfs_partition_size > 0 &&
+      used_bytes + file->memsize > pfs_partition_size) {
+    ESP_LOGE(TAG, "Not enough memory left to copy %s (%d bytes)", file->name,
+             file->memsize);
+    return false;
+  }
+  // what the clones keep pointing at
+  pfs_file_t original;
+  memset(&original, 0, sizeof(pfs_file_t));
+  original.bytes = file->bytes;
+  original.chunks = file->chunks;
+  original.chunks_count = file->chunks_count;
+  original.memsize = file->memsize;
+  original.flags = file->flags & PFS_F_INTERNAL;
+  if (file->chunks != NULL) {
+    char **chunks = (char **)pfs_calloc(file->chunks_capacity, sizeof(char *));
+    if (chunks == NULL)
+      goto fail;
+    for (uint32_t i = 0; i < file->chunks_count; i++) {
+      chunks[i] = (char *)pfs_malloc(file->chunk_size);
+      if (chunks[i] == NULL) {
+        while (i-- > 0)
+          free(chunks[i]);
+        free(chunks);
+        goto fail;
+      }
+      memcpy(chunks[i], file->chunks[i], file->chunk_size);
+    }
+    file->chunks = chunks;
+  } else if (file->bytes != NULL) {
+    char *bytes = (char *)pfs_malloc(file->memsize);
+    if (bytes == NULL)
+      goto fail;
+    memcpy(bytes, file->bytes, file->memsize);
+    file->bytes = bytes;
+  }
+  __atomic_add_fetch(&pfs_used_total, file->memsize, __ATOMIC_RELAXED);
+  file->shared = NULL;
+  // the copy is in the default heap, the clones still count the original
+  file->flags &= ~PFS_F_INTERNAL;
+  if (__atomic_sub_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    // the clones let go of it while copying, it's up to us to free it
+    free(shared);
+    pfs_free_bytes(&original);
+  }
+  ESP_LOGD(TAG, "Copied %d bytes from a clone of %s", file->memsize,
+           file->name);
+  return true;
+
+fail:
+  ESP_LOGE(TAG, "Can't alloc %d bytes to copy %s", file->memsize, file->name);
+  return false;
+}
+
+// creates an empty file [name] in [dir_id], which must not hold it already
+static pfs_file_t *pfs_create_file_at(int dir_id, const char *name,
+                                      size_t len) {
+  int fileslot = pfs_next_file_avail();
+
+  if (fileslot < 0 || pfs_files[fileslot] == NULL) {
+    ESP_LOGE(TAG, "alloc fail!");
+    return NULL;
+  }
+
+  if (pfs_files[fileslot]->name != NULL) { // uh-oh this should not happen
+    ESP_LOGE(TAG, "Name from file slot #%d is now null, freeing", fileslot);
+    pfs_index_remove(&pfs_files_index, fileslot);
+    free(pfs_files[fileslot]->name);
+  }
+  pfs_files[fileslot]->name = pfs_strndup(name, len);
+  if (pfs_files[fileslot]->name == NULL) {
+    ESP_LOGE(TAG, "alloc fail!");
+    pfs_free_slots_push(&pfs_files_free_slots, fileslot);
+    return NULL;
+  }
+  pfs_files[fileslot]->index = 0; // default truncate
+  pfs_set_size(pfs_files[fileslot], 0);
+  pfs_files[fileslot]->file_id = fileslot;
+  pfs_files[fileslot]->flags =
+      (pfs_dirs[dir_id]->flags & (PFS_F_COMPRESSED | PFS_F_PLACEMENT)) |
+      PFS_F_CHANGED;
+
+  // add this file to its directory's items list
+  if (pfs_dir_add_item(dir_id, fileslot, DT_REG) < 0) {
+    ESP_LOGE(TAG, "Can't assign %.*s to dir #%d", len, name, dir_id);
+    free(pfs_files[fileslot]->name);
+    pfs_files[fileslot]->name = NULL;
+    pfs_free_slots_push(&pfs_files_free_slots, fileslot);
+    return NULL;
+  }
+  pfs_files[fileslot]->dir_id = dir_id;
+  pfs_files[fileslot]->pinned = false;
+  pfs_index_add(&pfs_files_index, fileslot, dir_id, pfs_files[fileslot]->name);
+  pthread_mutex_lock(&pfs_fds_lock);
+  pfs_lru_add(pfs_files[fileslot], true);
+  pthread_mutex_unlock(&pfs_fds_lock);
+
+  return pfs_files[fileslot];
+}
+
+pfs_file_t *pfs_fopen(const char *path, int flags, int fmode) {
+  if (path == NULL) {
+    ESP_LOGE(TAG, "Invalid path");
+    return NULL;
+  } else {
+    ESP_LOGV(TAG, "Valid path :%s, flags = 0x%04x, mode = 0x%04x", path, flags,
+             fmode);
+  }
+
+  const char *mode = pfs_flags_conv_str(flags);
+  int newflags = pfs_flags_conv(flags);
+
+  int file_id = pfs_find_file(path);
+
+  if (file_id > -1) {
+
+    // ESP_LOGV(TAG, "Old flags: 0x%08x, New flags: 0x%08x",
+    // pfs_files[file_id]->flags, newflags ); pfs_files[file_id]->flags =
+    // newflags;
+
+    // existing file
+    if (mode) {
+      pfs_wrlock(&pfs_files[file_id]->lock);
+      switch (mode[0]) {
       case 'a': // seek end
         ESP_LOGV(TAG, "Append to index :%d (mode=%s)", pfs_files[file_id]->size,
                  mode);
@@ -665,13 +1999,12 @@ pfs_file_t *pfs_fopen(const char *path, int flags, int fmode) {
         break;
       case 'w': // truncate
         ESP_LOGV(TAG, "Truncate (mode=%s)", mode);
-        if (pfs_files[file_id]->bytes != NULL) {
-          free(pfs_files[file_id]->bytes);
-          pfs_files[file_id]->bytes = NULL;
-        }
+        // mapped data stays in place until pfs_unmap()
+        if (pfs_files[file_id]->maps == 0)
+          pfs_free_bytes(pfs_files[file_id]);
         pfs_files[file_id]->index = 0;
-        pfs_files[file_id]->size = 0;
-        pfs_files[file_id]->memsize = 0;
+        pfs_set_size(pfs_files[file_id], 0);
+        pfs_files[file_id]->flags |= PFS_F_CHANGED;
         break;
       case 'r':
         ESP_LOGV(TAG, "Read (mode=%s)", mode);
@@ -681,6 +2014,7 @@ pfs_file_t *pfs_fopen(const char *path, int flags, int fmode) {
         ESP_LOGV(TAG, "Unchanged index (mode=%s)", mode);
         break;
       }
+      pfs_unlock(&pfs_files[file_id]->lock);
     }
     ESP_LOGV(TAG, "file exists: %s (mode %s, dir #%d)", path, mode,
              pfs_files[file_id]->dir_id);
@@ -689,214 +2023,1270 @@ pfs_file_t *pfs_fopen(const char *path, int flags, int fmode) {
 
   if (mode && (mode[0] != 'r' || mode[1] == '+')) {
     // new file, write mode
-    int fileslot = pfs_next_file_avail();
-
-    if (fileslot < 0 || pfs_files[fileslot] == NULL) {
-      ESP_LOGE(TAG, "alloc fail!");
+    const char *base;
+    size_t baselen;
+    // create recurs dir if needed, return parent dir
+    int dir_id = pfs_walk_path(path, &base, &baselen, true);
+    if (dir_id < 0 || baselen == 0) {
+      ESP_LOGE(TAG, "Can't assign %s to a dir", path);
       return NULL;
     }
+    pfs_file_t *file = pfs_create_file_at(dir_id, base, baselen);
+    if (file != NULL) {
+      ESP_LOGD(TAG, "file created: %s (mode: %s, flags: 0x%08x)", path, mode,
+               newflags);
+    }
+    return file;
+  }
+  ESP_LOGE(TAG, "can't open: %s (mode %s)", path, mode);
+  return NULL;
+}
 
-    if (pfs_files[fileslot]->name != NULL) { // uh-oh this should not happen
-      ESP_LOGE(TAG, "Name from file slot #%d is now null, freeing", fileslot);
-      free(pfs_files[fileslot]->name);
-    }
-    int pathlen = strlen(path);
-    pfs_files[fileslot]->name = (char *)pfs_malloc(pathlen + 1);
-    memcpy(pfs_files[fileslot]->name, path, pathlen + 1);
-    pfs_files[fileslot]->index = 0; // default truncate
-    pfs_files[fileslot]->size = 0;
-    pfs_files[fileslot]->file_id = fileslot;
-    // pfs_files[fileslot]->flags = newflags;
-    ESP_LOGD(TAG, "file created: %s (mode: %s, flags: 0x%08x)", path, mode,
-             newflags);
-
-    int dir_id =
-        pfs_mkdirp(path); // create recurs dir if needed, return parent dir
-
-    if (dir_id > -1) {
-      // add this file to its directory's items list
-      struct dirent *item =
-          (struct dirent *)pfs_calloc(1, sizeof(struct dirent));
-      item->d_ino = fileslot;
-      snprintf(item->d_name, 256, "%s", pfs_basename((char *)path));
-      item->d_type = DT_REG;
-
-      if (pfs_dir_add_item(dir_id, item) < 0) {
-        ESP_LOGE(TAG, "Can't assign %s to a dir", path);
-      } else {
-        pfs_files[fileslot]->dir_id = dir_id;
-      }
+// copies [len] bytes from a chunked file at [offset]
+static void pfs_chunks_read(pfs_file_t *stream, uint8_t *buf, size_t len,
+                            uint32_t offset) {
+  while (len > 0) {
+    uint32_t chunk_id = offset / stream->chunk_size;
+    uint32_t chunk_pos = offset % stream->chunk_size;
+    size_t span = stream->chunk_size - chunk_pos;
+    if (span > len)
+      span = len;
+    memcpy(buf, &stream->chunks[chunk_id][chunk_pos], span);
+    buf += span;
+    offset += span;
+    len -= span;
+  }
+}
 
+// copies [len] bytes to a chunked file at [offset], or zeroes them when
+// [buf] is NULL, chunks must be allocated
+static void pfs_chunks_write(pfs_file_t *stream, const uint8_t *buf,
+                             size_t len, uint32_t offset) {
+  while (len > 0) {
+    uint32_t chunk_id = offset / stream->chunk_size;
+    uint32_t chunk_pos = offset % stream->chunk_size;
+    size_t span = stream->chunk_size - chunk_pos;
+    if (span > len)
+      span = len;
+    if (buf != NULL) {
+      memcpy(&stream->chunks[chunk_id][chunk_pos], buf, span);
+      buf += span;
     } else {
-      ESP_LOGE(TAG, "Can't assign %s to a dir", path);
+      memset(&stream->chunks[chunk_id][chunk_pos], 0, span);
     }
+    offset += span;
+    len -= span;
+  }
+}
+
+// appends chunks until [memsize] covers [required] bytes
+static bool pfs_chunks_reserve(pfs_file_t *stream, size_t required) {
+  if (stream->chunk_size == 0)
+    stream->chunk_size = pfs_alloc_block_size;
 
-    return pfs_files[fileslot];
+  size_t used_bytes = __atomic_load_n(&pfs_used_total, __ATOMIC_RELAXED);
+
+  while (stream->memsize < required) {
+    if (pfs_partition_size > 0 &&
+        used_bytes + stream->chunk_size > pfs_partition_size) {
+      ESP_LOGE(TAG,
+               "Not enough memory left, cowardly aborting (partition "
+               "size=%d, used_bytes=%d wants %d bytes)",
+               pfs_partition_size, used_bytes, used_bytes + stream->chunk_size);
+      return false;
+    }
+    if (stream->chunks_count == stream->chunks_capacity) {
+      // only the pointers list is copied when growing
+      uint32_t capacity =
+          stream->chunks_capacity ? stream->chunks_capacity * 2 : 4;
+      char **chunks =
+          (char **)pfs_realloc(stream->chunks, capacity * sizeof(char *));
+      if (chunks == NULL) {
+        ESP_LOGE(TAG, "Can't alloc chunks list for %d chunks", capacity);
+        return false;
+      }
+      stream->chunks = chunks;
+      stream->chunks_capacity = capacity;
+    }
+    char *chunk = (char *)pfs_malloc(stream->chunk_size);
+    if (chunk == NULL) {
+      ESP_LOGE(TAG, "Can't alloc %d bytes chunk", stream->chunk_size);
+      return false;
+    }
+    stream->chunks[stream->chunks_count++] = chunk;
+    stream->memsize += stream->chunk_size;
+    __atomic_add_fetch(&pfs_used_total, stream->chunk_size, __ATOMIC_RELAXED);
+    used_bytes += stream->chunk_size;
   }
-  ESP_LOGE(TAG, "can't open: %s (mode %s)", path, mode);
-  return NULL;
+  return true;
 }
 
-size_t pfs_fread(uint8_t *buf, size_t size, size_t count, pfs_file_t *stream) {
-  size_t to_read = size * count;
+// bytes actually stored, a file extended by truncation can be larger than
+// its memory, the missing tail reads as zeroes
+static uint32_t pfs_stored_size(pfs_file_t *stream) {
+  return stream->size < stream->memsize ? stream->size : stream->memsize;
+}
 
-  if ((stream->index + to_read) >= stream->size) {
-    if (stream->index <= stream->size) {
-      to_read = stream->size - stream->index;
+// moves a chunked file to a single contiguous buffer
+static bool pfs_chunks_flatten(pfs_file_t *stream) {
+  uint32_t memsize = stream->memsize;
+  char *bytes = (char *)pfs_calloc(1, memsize);
+  if (bytes == NULL) {
+    ESP_LOGE(TAG, "Can't alloc %d bytes to flatten %s", memsize,
+             stream->name);
+    return false;
+  }
+  pfs_chunks_read(stream, (uint8_t *)bytes, pfs_stored_size(stream), 0);
+  pfs_free_bytes(stream); // or let go of the chunks shared with clones
+  stream->bytes = bytes;
+  stream->memsize = memsize;
+  __atomic_add_fetch(&pfs_used_total, memsize, __ATOMIC_RELAXED);
+  return true;
+}
+
+size_t pfs_pread(pfs_file_t *stream, uint8_t *buf, size_t to_read,
+                 uint32_t offset) {
+  if (offset + to_read >= stream->size) {
+    if (offset <= stream->size) {
+      to_read = stream->size - offset;
       if (to_read == 0)
         return 0;
     } else {
       ESP_LOGE(TAG,
                "Attempted to read %d out of bounds bytes at index %d of %d",
-               to_read, stream->index, stream->size);
+               to_read, offset, stream->size);
       return -1;
     }
   }
-  memcpy(buf, &stream->bytes[stream->index], to_read);
+  if (stream->z != NULL) {
+    // a block that doesn't decompress fails the whole read
+    if (pfs_z_read(stream, buf, to_read, offset) != to_read)
+      return -1;
+    return to_read;
+  }
+  size_t stored = to_read;
+  if (offset + stored > stream->memsize)
+    stored = offset < stream->memsize ? stream->memsize - offset : 0;
+  if (stream->chunks != NULL)
+    pfs_chunks_read(stream, buf, stored, offset);
+  else if (stored > 0)
+    memcpy(buf, &stream->bytes[offset], stored);
+  memset(&buf[stored], 0, to_read - stored); // not allocated yet
   if (to_read > 1) {
-    ESP_LOGV(TAG, "(%d, %d) Reading %d byte(s) at index %d of %d", size, count,
-             to_read, stream->index, stream->size);
+    ESP_LOGV(TAG, "Reading %d byte(s) at index %d of %d", to_read, offset,
+             stream->size);
   } else {
     char out[2] = {0, 0};
     out[0] = buf[0];
-    ESP_LOGV(TAG, "(%d, %d) Reading %d byte(s) at index %d of %d (%s)", size,
-             count, to_read, stream->index, stream->size, out);
+    ESP_LOGV(TAG, "Reading %d byte(s) at index %d of %d (%s)", to_read,
+             offset, stream->size, out);
   }
-  stream->index += to_read;
   return to_read;
 }
 
-size_t pfs_fwrite(const uint8_t *buf, size_t size, size_t count,
-                  pfs_file_t *stream) {
-  size_t to_write = size * count;
+size_t pfs_fread(uint8_t *buf, size_t size, size_t count, pfs_file_t *stream) {
+  size_t res = pfs_pread(stream, buf, size * count, stream->index);
+  if (res != (size_t)-1)
+    stream->index += res;
+  return res;
+}
 
-  if (stream->index + to_write >= stream->memsize) {
+// rounds [size] up to a multiple of pfs_alloc_block_size
+static size_t pfs_block_align(size_t size) {
+  return ((size + pfs_alloc_block_size - 1) / pfs_alloc_block_size) *
+         pfs_alloc_block_size;
+}
 
-    size_t used_bytes = pfs_used_bytes();
+// how much memory a contiguous buffer of [memsize] bytes grows to when it
+// must hold at least [required] bytes, according to the growth policy
+static size_t pfs_growth_size(size_t memsize, size_t required) {
+  size_t grow = pfs_alloc_block_size;
+  switch (pfs_growth_policy) {
+  case pfs_growth_geometric:
+    grow = memsize;
+    break;
+  case pfs_growth_capped:
+    grow = memsize < pfs_growth_cap ? memsize : pfs_growth_cap;
+    break;
+  case pfs_growth_fixed:
+  default:
+    break;
+  }
+  size_t target = memsize + grow;
+  if (target < required)
+    target = required;
+  return pfs_block_align(target);
+}
 
-    if (stream->bytes == NULL) {
-      if (pfs_partition_size > 0 &&
-          used_bytes + pfs_alloc_block_size > pfs_partition_size) {
-        ESP_LOGE(TAG,
-                 "Not enough memory left, cowardly aborting (partition "
-                 "size=%d, used_bytes=%d, needs %d bytes)",
-                 pfs_partition_size, used_bytes,
-                 used_bytes + pfs_alloc_block_size);
-        return -1;
+// whether [memsize] bytes of contiguous data of [stream] belong in internal
+// ram, only meaningful when psram is the default heap
+static bool pfs_wants_internal(pfs_file_t *stream, size_t memsize) {
+  if (!pfs_psram_enabled || (stream->flags & PFS_F_PLACE_PSRAM))
+    return false;
+  if (stream->flags & PFS_F_PLACE_INTERNAL)
+    return true;
+  return memsize <= pfs_internal_threshold;
+}
+
+// whether the data of [stream] is in the heap its placement asks for, only
+// private contiguous buffers move
+static bool pfs_placed(pfs_file_t *stream) {
+  if (stream->bytes == NULL || stream->chunks != NULL || stream->z != NULL ||
+      stream->shared != NULL || (stream->flags & (PFS_F_ROM | PFS_F_INLINE)))
+    return true;
+  return !(stream->flags & PFS_F_INTERNAL) ==
+         !pfs_wants_internal(stream, stream->memsize);
+}
+
+// (re)allocates [memsize] bytes in internal ram or in the default heap,
+// realloc() moves the data when it's in the other heap
+static char *pfs_place_realloc(char *bytes, size_t memsize, bool internal) {
+  if (bytes == NULL)
+    return (char *)(internal ? s_calloc : pfs_calloc)(1, memsize);
+  return (char *)(internal ? s_realloc : pfs_realloc)(bytes, memsize);
+}
+
+// the contiguous buffer of [stream] now holds [memsize] bytes in internal
+// ram or not, updates the totals of both heaps
+static void pfs_bytes_account(pfs_file_t *stream, size_t memsize,
+                              bool internal) {
+  if (stream->flags & PFS_F_INTERNAL)
+    __atomic_sub_fetch(&pfs_used_internal, stream->memsize, __ATOMIC_RELAXED);
+  if (internal) {
+    __atomic_add_fetch(&pfs_used_internal, memsize, __ATOMIC_RELAXED);
+    stream->flags |= PFS_F_INTERNAL;
+  } else {
+    stream->flags &= ~PFS_F_INTERNAL;
+  }
+  __atomic_add_fetch(&pfs_used_total, memsize - stream->memsize,
+                     __ATOMIC_RELAXED);
+  stream->memsize = memsize;
+}
+
+// (re)allocates the contiguous buffer to exactly [memsize] bytes, in the
+// heap the placement policy picks for that size
+static bool pfs_bytes_resize(pfs_file_t *stream, size_t memsize) {
+  if (stream->maps > 0 && stream->bytes != NULL) {
+    ESP_LOGE(TAG, "Can't move %s while it's mapped", stream->name);
+    return false;
+  }
+  ESP_LOGV(TAG,
+           "stream->bytes = (char*)realloc( %d, %d ); (when %d/%d bytes free)",
+           stream->memsize, memsize, pfs_free_mem(), pfs_partition_size);
+  // inline data moves to a new buffer, it isn't counted yet
+  bool inlined = stream->flags & PFS_F_INLINE;
+  char *old = inlined ? NULL : stream->bytes;
+  bool internal = pfs_wants_internal(stream, memsize);
+  char *bytes = pfs_place_realloc(old, memsize, internal);
+  if (bytes == NULL && internal) {
+    // internal ram is scarce, psram will do
+    internal = false;
+    bytes = pfs_place_realloc(old, memsize, false);
+  }
+  if (bytes == NULL) {
+    ESP_LOGE(TAG, "Can't alloc %d bytes (fragmented heap?)", memsize);
+    return false;
+  }
+  if (inlined) {
+    memcpy(bytes, stream->inline_data,
+           memsize < stream->memsize ? memsize : stream->memsize);
+    stream->flags &= ~PFS_F_INLINE;
+    stream->memsize = 0;
+  }
+  stream->bytes = bytes;
+  pfs_bytes_account(stream, memsize, internal);
+  return true;
+}
+
+// moves the data of [stream] to the heap its placement asks for, it's left
+// where it is on failure
+static void pfs_place_file(pfs_file_t *stream) {
+  if (!pfs_placed(stream) && stream->maps == 0)
+    pfs_bytes_resize(stream, stream->memsize);
+}
+
+// moves the data of an inlined file to chunks covering [required] bytes,
+// the entry keeps it until they are allocated
+static bool pfs_inline_chunks_reserve(pfs_file_t *stream, size_t required) {
+  uint32_t stored = pfs_stored_size(stream);
+  stream->flags &= ~PFS_F_INLINE;
+  stream->bytes = NULL;
+  stream->memsize = 0;
+  if (!pfs_chunks_reserve(stream, required)) {
+    pfs_free_bytes(stream);
+    stream->bytes = stream->inline_data;
+    stream->memsize = PFS_INLINE_SIZE;
+    stream->flags |= PFS_F_INLINE;
+    return false;
+  }
+  pfs_chunks_write(stream, (const uint8_t *)stream->inline_data, stored, 0);
+  return true;
+}
+
+// moves the data of a small enough file back into its entry, its buffer or
+// chunks are freed
+static void pfs_inline_file(pfs_file_t *stream) {
+  uint32_t stored = pfs_stored_size(stream);
+  memset(stream->inline_data, 0, PFS_INLINE_SIZE);
+  if (stream->chunks != NULL)
+    pfs_chunks_read(stream, (uint8_t *)stream->inline_data, stored, 0);
+  else if (stored > 0)
+    memcpy(stream->inline_data, stream->bytes, stored);
+  pfs_free_bytes(stream);
+  stream->bytes = stream->inline_data;
+  stream->memsize = PFS_INLINE_SIZE;
+  stream->flags |= PFS_F_INLINE;
+}
+
+// makes sure the file can hold [required] bytes, growing the storage in
+// one go (or one chunk at a time in chunked mode)
+static bool pfs_reserve(pfs_file_t *stream, size_t required, bool exact) {
+  if (required <= stream->memsize)
+    return true;
+
+  bool inlined = stream->flags & PFS_F_INLINE;
+  if (stream->bytes == NULL && stream->chunks == NULL &&
+      required <= pfs_inline_size) {
+    // tiny files start in their entry, nothing to allocate
+    stream->bytes = stream->inline_data;
+    stream->memsize = PFS_INLINE_SIZE;
+    stream->flags |= PFS_F_INLINE;
+    return true;
+  }
+
+  if (stream->chunks != NULL ||
+      ((stream->bytes == NULL || inlined) && pfs_chunked_enabled)) {
+    return inlined ? pfs_inline_chunks_reserve(stream, required)
+                   : pfs_chunks_reserve(stream, required);
+  }
+
+  // other files may grow at the same time, the limit is best effort
+  size_t used_bytes = __atomic_load_n(&pfs_used_total, __ATOMIC_RELAXED) -
+                      (inlined ? 0 : stream->memsize);
+  size_t target = exact ? required : pfs_growth_size(stream->memsize, required);
+
+  if (pfs_partition_size > 0 && used_bytes + target > pfs_partition_size) {
+    // growth policy is too greedy, try with just what's needed
+    target = exact ? required : pfs_block_align(required);
+    if (used_bytes + target > pfs_partition_size) {
+      ESP_LOGE(TAG,
+               "Not enough memory left, cowardly aborting (partition "
+               "size=%d, used_bytes=%d wants %d bytes)",
+               pfs_partition_size, used_bytes + stream->memsize,
+               used_bytes + target);
+      return false;
+    }
+  }
+
+  ESP_LOGV(TAG, "[bytes free:%d] Growing from %d to %d bytes to hold %d bytes",
+           pfs_free_mem(), stream->memsize, target, required);
+  return pfs_bytes_resize(stream, target);
+}
+
+// zeroes the stored bytes from [from] up to [to] (capped to memsize)
+static void pfs_zero_range(pfs_file_t *stream, uint32_t from, uint32_t to) {
+  if (to > stream->memsize)
+    to = stream->memsize;
+  if (from >= to)
+    return;
+  if (stream->chunks != NULL)
+    pfs_chunks_write(stream, NULL, to - from, from);
+  else
+    memset(&stream->bytes[from], 0, to - from);
+}
+
+// allocates the part of the file that was only extended by truncation
+static bool pfs_fill_hole(pfs_file_t *stream) {
+  uint32_t stored = pfs_stored_size(stream);
+  if (stored == stream->size || stream->z != NULL)
+    return true;
+  if (!pfs_unshare(stream) || !pfs_reserve(stream, stream->size, true))
+    return false;
+  pfs_zero_range(stream, stored, stream->size);
+  return true;
+}
+
+size_t pfs_pwrite(pfs_file_t *stream, const uint8_t *buf, size_t to_write,
+                  uint32_t offset) {
+  stream->flags |= PFS_F_CHANGED;
+  // compression starts with the first write, existing data is left as is
+  if ((stream->flags & PFS_F_COMPRESSED) && stream->z == NULL &&
+      stream->memsize == 0 && !pfs_z_start(stream))
+    return -1;
+  if (stream->z != NULL) {
+    size_t res = pfs_z_write(stream, buf, to_write, offset);
+    if (res == 0 && to_write > 0)
+      return -1;
+    if (offset + res > stream->size)
+      pfs_set_size(stream, offset + res);
+    return res;
+  }
+  uint32_t stored = pfs_stored_size(stream);
+  if (!pfs_unshare(stream) || !pfs_reserve(stream, offset + to_write, false))
+    return -1;
+
+  ESP_LOGV(TAG, "Writing %d bytes at index %d of %d (memsize = %d)", to_write,
+           offset, stream->size, stream->memsize);
+
+  // writing past the stored bytes, don't leave garbage in the gap
+  uint32_t end = offset > stream->size ? offset : stream->size;
+  pfs_zero_range(stream, stored, end);
+
+  if (stream->chunks != NULL)
+    pfs_chunks_write(stream, buf, to_write, offset);
+  else if (to_write > 0)
+    memcpy(&stream->bytes[offset], buf, to_write);
+
+  if (offset + to_write > stream->size) {
+    pfs_set_size(stream, offset + to_write);
+  }
+
+  return to_write;
+}
+
+int pfs_fallocate(pfs_file_t *stream, size_t size) {
+  if (stream == NULL) {
+    ESP_LOGE(TAG, "Invalid stream");
+    return -1;
+  }
+  pfs_wrlock(&stream->lock);
+  // compressed sizes can't be known in advance
+  bool reserved = (stream->flags & PFS_F_COMPRESSED) ||
+                  (pfs_unshare(stream) && pfs_reserve(stream, size, true));
+  pfs_unlock(&stream->lock);
+  if (!reserved)
+    return -1;
+  ESP_LOGD(TAG, "Preallocated %d bytes for %s (memsize=%d)", size,
+           stream->name, stream->memsize);
+  return 0;
+}
+
+int pfs_preallocate(const char *path, size_t size) {
+  pfs_ns_write_lock();
+  pfs_file_t *stream = pfs_fopen(path, O_RDWR | O_CREAT, 0);
+  int res = stream != NULL ? pfs_fallocate(stream, size) : -1;
+  pfs_ns_write_unlock();
+  return res;
+}
+
+// gives back the memory past [memsize] (contiguous buffers) or past the
+// last used chunk, mapped files keep their memory, returns the bytes freed
+static size_t pfs_release_slack(pfs_file_t *stream, size_t memsize) {
+  size_t before = stream->memsize;
+  if (stream->maps > 0 || stream->shared != NULL ||
+      (stream->flags & (PFS_F_ROM | PFS_F_INLINE)))
+    return 0;
+  if (stream->z != NULL)
+    return pfs_z_release_cache(stream);
+  if (stream->size == 0) {
+    pfs_free_bytes(stream);
+  } else if (stream->size <= pfs_inline_size) {
+    pfs_inline_file(stream);
+    return before;
+  } else if (stream->chunks != NULL) {
+    uint32_t keep =
+        (stream->size + stream->chunk_size - 1) / stream->chunk_size;
+    while (stream->chunks_count > keep) {
+      free(stream->chunks[--stream->chunks_count]);
+      stream->memsize -= stream->chunk_size;
+      __atomic_sub_fetch(&pfs_used_total, stream->chunk_size,
+                         __ATOMIC_RELAXED);
+    }
+  } else if (stream->bytes != NULL && memsize >= stream->size &&
+             memsize < stream->memsize) {
+    pfs_bytes_resize(stream, memsize); // keeps it on failure
+  }
+  return before - stream->memsize;
+}
+
+// shrinking (or keeping the size) gives the memory past [size] back,
+// growing allocates nothing until the new bytes are written
+static bool pfs_resize(pfs_file_t *stream, uint32_t size) {
+  stream->flags |= PFS_F_CHANGED;
+  if (size == 0 && stream->maps == 0) {
+    pfs_free_bytes(stream); // no need to copy clones data first
+    pfs_set_size(stream, 0);
+    return true;
+  }
+  if (stream->z != NULL)
+    return pfs_z_resize(stream, size);
+  if (!pfs_unshare(stream))
+    return false;
+  if (size > stream->size) {
+    // stale bytes may lay between the old size and memsize
+    pfs_zero_range(stream, stream->size, size);
+    pfs_set_size(stream, size);
+    return true;
+  }
+  pfs_set_size(stream, size);
+  pfs_release_slack(stream, pfs_block_align(size));
+  return true;
+}
+
+// moves idle files to new buffers of their exact size: the slack goes
+// away and the allocator gets a chance to pack them at the bottom of the
+// heap, chunked files become contiguous, files meant to be compressed but
+// holding data as is (adopted, cloned...) get compressed
+static size_t pfs_compact_file(pfs_file_t *stream) {
+  if (stream->shared != NULL || (stream->flags & (PFS_F_ROM | PFS_F_INLINE)))
+    return 0; // clones keep pointing at the same data, rom costs nothing
+  if (stream->z != NULL)
+    return pfs_z_release_cache(stream);
+  if (stream->flags & PFS_F_COMPRESSED) {
+    size_t before = stream->memsize;
+    if (pfs_z_compress_file(stream))
+      return before > stream->memsize ? before - stream->memsize : 0;
+  }
+  if (stream->size == stream->memsize && stream->chunks == NULL &&
+      pfs_placed(stream))
+    return 0; // already packed
+  if (stream->size > stream->memsize || stream->size <= pfs_inline_size)
+    return pfs_release_slack(stream, stream->size);
+  size_t before = stream->memsize;
+  // the new buffer also goes where the placement wants it now
+  bool internal = pfs_wants_internal(stream, stream->size);
+  char *bytes = internal ? (char *)s_malloc(stream->size) : NULL;
+  if (bytes == NULL) {
+    internal = false;
+    bytes = (char *)pfs_malloc(stream->size);
+  }
+  if (bytes == NULL)
+    return pfs_release_slack(stream, stream->size);
+  if (stream->chunks != NULL)
+    pfs_chunks_read(stream, (uint8_t *)bytes, stream->size, 0);
+  else
+    memcpy(bytes, stream->bytes, stream->size);
+  pfs_free_bytes(stream);
+  stream->bytes = bytes;
+  pfs_bytes_account(stream, stream->size, internal);
+  return before - stream->memsize;
+}
+
+size_t pfs_compact(int max_files) {
+  size_t reclaimed = 0;
+  if (pfs_files == NULL)
+    return 0;
+  // open or mapped files can't move, nothing can open them meanwhile
+  pfs_ns_write_lock();
+  int count = max_files > 0 && max_files < pfs_max_items ? max_files
+                                                          : pfs_max_items;
+  for (int i = 0; i < count; i++) {
+    if (pfs_compact_cursor >= pfs_max_items)
+      pfs_compact_cursor = 0;
+    pfs_file_t *file = pfs_files[pfs_compact_cursor++];
+    if (file->name == NULL || file->refcount > 0 || file->memsize == 0)
+      continue;
+    pfs_wrlock(&file->lock);
+    reclaimed += pfs_compact_file(file);
+    pfs_unlock(&file->lock);
+  }
+  pfs_ns_write_unlock();
+  __atomic_add_fetch(&pfs_reclaimed_total, reclaimed, __ATOMIC_RELAXED);
+  ESP_LOGD(TAG, "Compaction reclaimed %d bytes", reclaimed);
+  return reclaimed;
+}
+
+size_t pfs_reclaimed_bytes() {
+  return __atomic_load_n(&pfs_reclaimed_total, __ATOMIC_RELAXED);
+}
+
+int pfs_set_compressed(const char *path, bool use) {
+  int res = -1;
+  pfs_ns_write_lock();
+  int file_id = pfs_find_file(path);
+  int dir_id = file_id < 0 ? pfs_find_dir(path) : -1;
+  if (file_id > -1) {
+    pfs_file_t *stream = pfs_files[file_id];
+    pfs_wrlock(&stream->lock);
+    if (stream->maps > 0) {
+      ESP_LOGE(TAG, "Can't convert %s while it's mapped", path);
+    } else if (use ? (stream->z != NULL || stream->memsize == 0 ||
+                      pfs_z_compress_file(stream))
+                   : (stream->z == NULL || pfs_z_decompress_file(stream))) {
+      if (use)
+        stream->flags |= PFS_F_COMPRESSED;
+      else
+        stream->flags &= ~PFS_F_COMPRESSED;
+      res = 0;
+    }
+    pfs_unlock(&stream->lock);
+  } else if (dir_id > -1) {
+    // only for the items created from now on
+    if (use)
+      pfs_dirs[dir_id]->flags |= PFS_F_COMPRESSED;
+    else
+      pfs_dirs[dir_id]->flags &= ~PFS_F_COMPRESSED;
+    res = 0;
+  } else {
+    ESP_LOGE(TAG, "Can't set compression on %s: not found", path);
+  }
+  pfs_ns_write_unlock();
+  return res;
+}
+
+int pfs_set_placement(const char *path, pfs_placement_t placement) {
+  uint32_t flags = placement == pfs_place_internal ? PFS_F_PLACE_INTERNAL
+                   : placement == pfs_place_psram  ? PFS_F_PLACE_PSRAM
+                                                   : 0;
+  int res = -1;
+  pfs_ns_write_lock();
+  int file_id = pfs_find_file(path);
+  int dir_id = file_id < 0 ? pfs_find_dir(path) : -1;
+  if (file_id > -1) {
+    pfs_file_t *stream = pfs_files[file_id];
+    pfs_wrlock(&stream->lock);
+    stream->flags = (stream->flags & ~PFS_F_PLACEMENT) | flags;
+    pfs_place_file(stream); // or on the next resize/compaction
+    pfs_unlock(&stream->lock);
+    res = 0;
+  } else if (dir_id > -1) {
+    // only for the items created from now on
+    pfs_dirs[dir_id]->flags =
+        (pfs_dirs[dir_id]->flags & ~PFS_F_PLACEMENT) | flags;
+    res = 0;
+  } else {
+    ESP_LOGE(TAG, "Can't set placement on %s: not found", path);
+  }
+  pfs_ns_write_unlock();
+  return res;
+}
+
+int pfs_compression_stats(size_t *raw_bytes, size_t *stored_bytes) {
+  int files = 0;
+  size_t raw = 0, stored = 0;
+  if (pfs_files != NULL) {
+    pfs_rdlock(&pfs_ns_lock);
+    for (int i = 0; i < pfs_max_items; i++) {
+      pfs_file_t *file = pfs_files[i];
+      if (file->name == NULL)
+        continue;
+      pfs_rdlock(&file->lock);
+      if (file->flags & PFS_F_COMPRESSED) {
+        if (file->z != NULL)
+          pthread_mutex_lock(&file->z->lock);
+        raw += file->size;
+        stored += file->memsize;
+        if (file->z != NULL)
+          pthread_mutex_unlock(&file->z->lock);
+        files++;
       }
-      ESP_LOGV(TAG, "Allocating %d bytes to write %d bytes",
-               pfs_alloc_block_size, to_write);
-      stream->bytes =
-          (char *)pfs_calloc(1, pfs_alloc_block_size /*, sizeof(char) */);
-      stream->memsize = pfs_alloc_block_size;
-      used_bytes += pfs_alloc_block_size;
-    }
-    while (stream->index + to_write >= stream->memsize) {
-      if (pfs_partition_size > 0 &&
-          used_bytes + pfs_alloc_block_size > pfs_partition_size) {
-        ESP_LOGE(TAG,
-                 "Not enough memory left, cowardly aborting (partition "
-                 "size=%d, used_bytes=%d wants %d bytes)",
-                 pfs_partition_size, used_bytes,
-                 used_bytes + pfs_alloc_block_size);
-        return -1;
+      pfs_unlock(&file->lock);
+    }
+    pfs_unlock(&pfs_ns_lock);
+  }
+  if (raw_bytes != NULL)
+    *raw_bytes = raw;
+  if (stored_bytes != NULL)
+    *stored_bytes = stored;
+  return files;
+}
+
+int pfs_ftruncate(pfs_file_t *stream, size_t size) {
+  if (stream == NULL) {
+    ESP_LOGE(TAG, "Invalid stream");
+    return -1;
+  }
+  if (size > UINT32_MAX) {
+    ESP_LOGE(TAG, "Invalid size (%d)", size);
+    return -1;
+  }
+  pfs_wrlock(&stream->lock);
+  bool resized = pfs_resize(stream, size);
+  pfs_unlock(&stream->lock);
+  if (!resized)
+    return -1;
+  ESP_LOGD(TAG, "Truncated %s to %d bytes (memsize=%d)", stream->name, size,
+           stream->memsize);
+  return 0;
+}
+
+int pfs_truncate(const char *path, size_t size) {
+  int res = -1;
+  pfs_rdlock(&pfs_ns_lock);
+  int file_id = pfs_find_file(path);
+  if (file_id > -1)
+    res = pfs_ftruncate(pfs_files[file_id], size);
+  else
+    ESP_LOGE(TAG, "Can't truncate %s: file not found", path);
+  pfs_unlock(&pfs_ns_lock);
+  return res;
+}
+
+// swaps the file contents with a caller allocation, no copy involved
+int pfs_adopt(const char *path, void *buf, size_t size) {
+  if (buf == NULL || size > UINT32_MAX) {
+    ESP_LOGE(TAG, "Invalid buffer");
+    return -1;
+  }
+  int res = -1;
+  pfs_ns_write_lock();
+  pfs_file_t *stream = pfs_fopen(path, O_RDWR | O_CREAT, 0);
+  if (stream != NULL) {
+    pfs_wrlock(&stream->lock);
+    // other files may grow at the same time, the limit is best effort.
+    // Read-only and inline data isn't counted, and shared data stays
+    // counted for the clones, like in pfs_free_bytes()
+    size_t used_bytes = __atomic_load_n(&pfs_used_total, __ATOMIC_RELAXED);
+    if (!(stream->flags & (PFS_F_ROM | PFS_F_INLINE)) && stream->shared == NULL)
+      used_bytes -= stream->memsize;
+    if (stream->maps > 0) {
+      ESP_LOGE(TAG, "Can't replace %s while it's mapped", path);
+    } else if (pfs_partition_size > 0 &&
+               used_bytes + size > pfs_partition_size) {
+      ESP_LOGE(TAG, "Not enough memory left to adopt %d bytes as %s", size,
+               path);
+    } else {
+      pfs_free_bytes(stream);
+      stream->bytes = (char *)buf;
+      stream->memsize = size;
+      pfs_set_size(stream, size);
+      stream->flags |= PFS_F_CHANGED;
+      __atomic_add_fetch(&pfs_used_total, size, __ATOMIC_RELAXED);
+      res = 0;
+    }
+    pfs_unlock(&stream->lock);
+  }
+  pfs_ns_write_unlock();
+  if (res == 0) {
+    ESP_LOGD(TAG, "Adopted %d bytes as %s", size, path);
+  }
+  return res;
+}
+
+int pfs_detach(const char *path, void **buf, size_t *size) {
+  assert(buf);
+  assert(size);
+  int res = -1;
+  pfs_rdlock(&pfs_ns_lock);
+  int file_id = pfs_find_file(path);
+  if (file_id < 0) {
+    ESP_LOGE(TAG, "Can't detach %s: file not found", path);
+  } else {
+    pfs_file_t *stream = pfs_files[file_id];
+    pfs_wrlock(&stream->lock);
+    if (stream->maps > 0) {
+      ESP_LOGE(TAG, "Can't detach %s while it's mapped", path);
+    } else if ((stream->z == NULL || pfs_z_decompress_file(stream)) &&
+               pfs_fill_hole(stream) && pfs_unshare(stream) &&
+               (stream->chunks == NULL || pfs_chunks_flatten(stream)) &&
+               (!(stream->flags & PFS_F_INLINE) ||
+                pfs_bytes_resize(stream, stream->memsize))) {
+      *buf = stream->bytes;
+      *size = stream->size;
+      __atomic_sub_fetch(&pfs_used_total, stream->memsize, __ATOMIC_RELAXED);
+      if (stream->flags & PFS_F_INTERNAL)
+        __atomic_sub_fetch(&pfs_used_internal, stream->memsize,
+                           __ATOMIC_RELAXED);
+      stream->flags &= ~PFS_F_INTERNAL;
+      stream->bytes = NULL;
+      stream->memsize = 0;
+      pfs_set_size(stream, 0);
+      stream->flags |= PFS_F_CHANGED;
+      res = 0;
+    }
+    pfs_unlock(&stream->lock);
+  }
+  pfs_unlock(&pfs_ns_lock);
+  return res;
+}
+
+// points the file at [size] bytes of read-only memory, nothing is
+// allocated nor counted in the used bytes
+static void pfs_link_rom_bytes(pfs_file_t *stream, const void *data,
+                               uint32_t size) {
+  pfs_free_bytes(stream);
+  pfs_set_size(stream, size);
+  stream->flags |= PFS_F_CHANGED;
+  if (size > 0) {
+    stream->bytes = (char *)data;
+    stream->memsize = size;
+    stream->flags |= PFS_F_ROM;
+  }
+}
+
+int pfs_link_rom(const char *path, const void *data, size_t size) {
+  if (data == NULL || size > UINT32_MAX) {
+    ESP_LOGE(TAG, "Invalid buffer");
+    return -1;
+  }
+  int res = -1;
+  pfs_ns_write_lock();
+  pfs_file_t *stream = pfs_fopen(path, O_RDWR | O_CREAT, 0);
+  if (stream != NULL) {
+    pfs_wrlock(&stream->lock);
+    if (stream->maps > 0) {
+      ESP_LOGE(TAG, "Can't replace %s while it's mapped", path);
+    } else {
+      pfs_link_rom_bytes(stream, data, size);
+      res = 0;
+    }
+    pfs_unlock(&stream->lock);
+  }
+  pfs_ns_write_unlock();
+  if (res == 0) {
+    ESP_LOGD(TAG, "Linked %d read-only bytes as %s", size, path);
+  }
+  return res;
+}
+
+// lets the data of [file] be referenced by its clones
+static bool pfs_share_bytes(pfs_file_t *file) {
+  file->shared = (pfs_shared_t *)pfs_calloc(1, sizeof(pfs_shared_t));
+  if (file->shared == NULL)
+    return false;
+  file->shared->refs = 1;
+  return true;
+}
+
+// [dst] gets the same data as [src] without copying anything, the first
+// of them to be written then gets its own copy
+int pfs_clone(const char *src, const char *dst) {
+  int res = -1;
+  pfs_ns_write_lock();
+  int src_id = pfs_find_file(src);
+  pfs_file_t *from = src_id > -1 ? pfs_files[src_id] : NULL;
+  pfs_file_t *to = NULL;
+  bool compressed = false;
+  if (from != NULL) {
+    pfs_rdlock(&from->lock);
+    compressed = from->z != NULL;
+    pfs_unlock(&from->lock);
+  }
+  // checked before creating dst, not to leave an empty file behind
+  if (from == NULL)
+    ESP_LOGE(TAG, "Can't clone %s: file not found", src);
+  else if (compressed)
+    ESP_LOGE(TAG, "Can't clone %s, it's compressed", src);
+  else
+    to = pfs_fopen(dst, O_RDWR | O_CREAT, 0);
+  if (to == from) {
+    res = to != NULL ? 0 : -1;
+  } else if (to != NULL) {
+    // only namespace writers lock two files, with pfs_ns_lock held
+    pfs_wrlock(&from->lock);
+    pfs_wrlock(&to->lock);
+    bool rom = from->flags & PFS_F_ROM;
+    bool inlined = from->flags & PFS_F_INLINE; // copied, it's tiny
+    bool shares = !rom && !inlined && from->memsize > 0;
+    if (to->maps > 0) {
+      ESP_LOGE(TAG, "Can't replace %s while it's mapped", dst);
+    } else if (from->z != NULL) { // compressed since the check
+      ESP_LOGE(TAG, "Can't clone %s, it's compressed", src);
+    } else if (shares && from->shared == NULL && !pfs_share_bytes(from)) {
+      ESP_LOGE(TAG, "Can't alloc clone of %s", src);
+    } else {
+      pfs_shared_t *shared = from->shared;
+      pfs_free_bytes(to);
+      if (rom) {
+        pfs_link_rom_bytes(to, from->bytes, from->memsize);
+      } else if (inlined) {
+        memcpy(to->inline_data, from->inline_data, PFS_INLINE_SIZE);
+        to->bytes = to->inline_data;
+        to->memsize = PFS_INLINE_SIZE;
+        to->flags |= PFS_F_INLINE;
+      } else if (shared != NULL) {
+        __atomic_add_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL);
+        to->shared = shared;
+        to->bytes = from->bytes;
+        to->chunks = from->chunks;
+        to->chunk_size = from->chunk_size;
+        to->chunks_count = from->chunks_count;
+        to->chunks_capacity = from->chunks_capacity;
+        to->memsize = from->memsize;
+        to->flags |= from->flags & PFS_F_INTERNAL;
       }
-      ESP_LOGV(TAG,
-               "[bytes free:%d] Reallocating %d bytes to write %d bytes at "
-               "index %d/%d => %d",
-               pfs_free_mem(), pfs_alloc_block_size, to_write, stream->index,
-               stream->size, stream->index + pfs_alloc_block_size);
-      ESP_LOGV(
-          TAG,
-          "stream->bytes = (char*)realloc( %d, %d ); (when %d/%d bytes free)",
-          stream->memsize, stream->memsize + pfs_alloc_block_size,
-          pfs_free_mem(), pfs_partition_size);
-      stream->bytes = (char *)pfs_realloc(
-          stream->bytes, stream->memsize + pfs_alloc_block_size);
-      stream->memsize += pfs_alloc_block_size;
-      used_bytes += pfs_alloc_block_size;
+      pfs_set_size(to, from->size);
+      to->flags |= PFS_F_CHANGED;
+      res = 0;
     }
+    pfs_unlock(&to->lock);
+    pfs_unlock(&from->lock);
+  }
+  pfs_ns_write_unlock();
+  if (res == 0) {
+    ESP_LOGD(TAG, "Cloned %s to %s", src, dst);
+  }
+  return res;
+}
+
+size_t pfs_fwrite(const uint8_t *buf, size_t size, size_t count,
+                  pfs_file_t *stream) {
+  size_t res = pfs_pwrite(stream, buf, size * count, stream->index);
+  if (res != (size_t)-1)
+    stream->index += res;
+  return res;
+}
+
+void pfs_set_cache_mode(bool use) {
+  ESP_LOGD(TAG, "%s cache mode...", use ? "Enabling" : "Disabling");
+  pfs_cache_mode = use;
+}
+
+bool pfs_get_cache_mode() { return pfs_cache_mode; }
+
+size_t pfs_evictions() {
+  return __atomic_load_n(&pfs_evictions_total, __ATOMIC_RELAXED);
+}
+
+int pfs_pin(const char *path, bool pin) {
+  pfs_ns_write_lock();
+  int file_id = pfs_find_file(path);
+  if (file_id > -1) {
+    pfs_file_t *file = pfs_files[file_id];
+    pthread_mutex_lock(&pfs_fds_lock);
+    file->pinned = pin;
+    if (pin)
+      pfs_lru_remove(file);
+    else
+      pfs_lru_add(file, true);
+    pthread_mutex_unlock(&pfs_fds_lock);
   } else {
-    ESP_LOGV(TAG,
-             "Writing %d bytes at index %d of %d (no realloc, memsize = %d)",
-             to_write, stream->index, stream->size, stream->memsize);
+    ESP_LOGE(TAG, "Can't pin %s: file not found", path);
   }
+  pfs_ns_write_unlock();
+  return file_id > -1 ? 0 : -1;
+}
 
-  // There should be a check here to make sure this write does not exceed the
-  // file maximum size
-  memcpy(&stream->bytes[stream->index], buf, to_write);
-  stream->index += to_write;
+// evicts the least recently used files until [needed] more bytes fit in the
+// partition, in cache mode. The caller holds pfs_backing_lock (evicted files
+// can't be in the middle of a write back) but not pfs_ns_lock. Returns how
+// many files were evicted.
+static int pfs_make_room(size_t needed) {
+  int evicted = 0;
+  // no use emptying the cache for something that can't fit anyway
+  if (!pfs_cache_mode || pfs_partition_size == 0 ||
+      needed > pfs_partition_size)
+    return 0;
+  pfs_ns_write_lock();
+  while (__atomic_load_n(&pfs_used_total, __ATOMIC_RELAXED) + needed >
+         pfs_partition_size) {
+    pthread_mutex_lock(&pfs_fds_lock);
+    pfs_file_t *victim = pfs_lru_oldest;
+    if (victim != NULL)
+      pfs_lru_remove(victim);
+    pthread_mutex_unlock(&pfs_fds_lock);
+    if (victim == NULL)
+      break;
+    // dirty files would lose data, they're listed again once written back,
+    // read-only and inlined files don't use the partition
+    pfs_rdlock(&victim->lock);
+    bool keep = (victim->flags & (PFS_F_ROM | PFS_F_INLINE)) ||
+                (pfs_backing != NULL && (victim->flags & PFS_F_DIRTY));
+    pfs_unlock(&victim->lock);
+    if (keep)
+      continue;
+    ESP_LOGD(TAG, "Evicting %s (%d bytes)", victim->name, victim->memsize);
+    pfs_unlink_file(victim->file_id);
+    evicted++;
+  }
+  pfs_ns_write_unlock();
+  __atomic_add_fetch(&pfs_evictions_total, evicted, __ATOMIC_RELAXED);
+  return evicted;
+}
 
-  if (stream->index > stream->size) {
-    stream->size = stream->index;
+// writes the mount-relative path of [file] ("/dir/name") into [buf], the
+// caller holds pfs_ns_lock, returns false when it doesn't fit
+static bool pfs_file_path(pfs_file_t *file, char *buf, size_t size) {
+  size_t pos = size - 1;
+  buf[pos] = '\0';
+  const char *name = file->name;
+  for (pfs_dir_t *dir = pfs_dirs[file->dir_id];; dir = dir->parent_dir) {
+    size_t len = strlen(name);
+    if (len + 1 > pos)
+      return false;
+    pos -= len;
+    memcpy(&buf[pos], name, len);
+    buf[--pos] = '/';
+    if (dir == NULL || dir->parent_dir == NULL)
+      break;
+    name = dir->name;
   }
+  memmove(buf, &buf[pos], size - pos);
+  return true;
+}
 
-  return to_write;
+// the path of [file] if it needs to be written back, the caller holds
+// pfs_backing_lock
+static bool pfs_backing_dirty_path(pfs_file_t *file, char *path) {
+  bool dirty = false;
+  pfs_rdlock(&pfs_ns_lock);
+  if (file->name != NULL) { // unlinked files are gone from the store too
+    pfs_rdlock(&file->lock);
+    dirty = file->flags & PFS_F_DIRTY;
+    pfs_unlock(&file->lock);
+    if (dirty && !pfs_file_path(file, path, PFS_BACKING_PATH_MAX)) {
+      ESP_LOGE(TAG, "Path of %s is too long for the backing store",
+               file->name);
+      dirty = false;
+    }
+  }
+  pfs_unlock(&pfs_ns_lock);
+  return dirty;
 }
 
-int pfs_fflush(pfs_file_t *stream) {
-  ESP_LOGW(TAG, "[FIXME] Flushing (actually does nothing)");
+// writes [file] to [path] in the backing store, the caller holds
+// pfs_backing_lock. The data is copied in small pieces so writers are only
+// held back by memcpy() and not by the store, if they write meanwhile
+// PFS_F_WRITING is set again and the file stays dirty.
+static int pfs_backing_write(pfs_file_t *file, const char *path) {
+  pfs_wrlock(&file->lock);
+  file->flags &= ~PFS_F_WRITING;
+  pfs_unlock(&file->lock);
+
+  uint8_t *buf = (uint8_t *)malloc(PFS_BACKING_BUF_SIZE);
+  void *handle =
+      buf != NULL ? pfs_backing->open(pfs_backing->ctx, path, true) : NULL;
+  bool written = handle != NULL;
+  for (uint32_t offset = 0; written;) {
+    pfs_rdlock(&file->lock);
+    size_t len = offset < file->size ? file->size - offset : 0;
+    if (len > PFS_BACKING_BUF_SIZE)
+      len = PFS_BACKING_BUF_SIZE;
+    if (len > 0 && pfs_pread(file, buf, len, offset) != len)
+      len = 0;
+    pfs_unlock(&file->lock);
+    if (len == 0)
+      break;
+    written = pfs_backing->write(handle, buf, len) == len;
+    offset += len;
+  }
+  if (handle != NULL && pfs_backing->close(handle) != 0)
+    written = false;
+  free(buf);
+
+  pfs_wrlock(&file->lock);
+  bool clean = false;
+  if (!written) {
+    file->flags |= PFS_F_ERRED;
+  } else {
+    file->flags &= ~PFS_F_ERRED;
+    clean = !(file->flags & PFS_F_WRITING);
+    if (clean)
+      file->flags &= ~PFS_F_DIRTY;
+  }
+  pfs_unlock(&file->lock);
+  if (clean) {
+    // eviction may have skipped it while it was dirty
+    pthread_mutex_lock(&pfs_fds_lock);
+    pfs_lru_add(file, false);
+    pthread_mutex_unlock(&pfs_fds_lock);
+  }
+  if (!written) {
+    ESP_LOGE(TAG, "Can't write %s back to the backing store", path);
+    return -1;
+  }
+  ESP_LOGV(TAG, "Wrote %s back to the backing store", path);
   return 0;
 }
 
-int pfs_fseek(pfs_file_t *stream, off_t offset, pfs_seek_mode mode) {
+// loads [path] from the backing store as a clean file, the caller holds
+// pfs_backing_lock but not pfs_ns_lock, returns 1 when the file is in
+// memory now, 0 when the store doesn't have it and -1 on error
+static int pfs_backing_fetch(const char *path) {
+  struct stat st;
+  if (pfs_backing->stat(pfs_backing->ctx, path, &st) != 0 ||
+      !S_ISREG(st.st_mode))
+    return 0;
+  size_t size = st.st_size;
+  pfs_make_room(size);
+  size_t used_bytes = __atomic_load_n(&pfs_used_total, __ATOMIC_RELAXED);
+  if (size > UINT32_MAX ||
+      (pfs_partition_size > 0 && used_bytes + size > pfs_partition_size)) {
+    ESP_LOGE(TAG, "Not enough memory left to fetch %s (%d bytes)", path,
+             size);
+    return -1;
+  }
+  // read before taking pfs_ns_lock, the store may be slow
+  char *bytes = size > 0 ? (char *)pfs_malloc(size) : NULL;
+  void *handle = size == 0 || bytes != NULL
+                     ? pfs_backing->open(pfs_backing->ctx, path, false)
+                     : NULL;
+  bool loaded = handle != NULL && pfs_backing->read(handle, bytes, size) == size;
+  if (handle != NULL)
+    pfs_backing->close(handle);
+  if (!loaded) {
+    ESP_LOGE(TAG, "Can't fetch %s from the backing store", path);
+    free(bytes);
+    return -1;
+  }
+
+  int res = 1;
+  pfs_ns_write_lock();
+  if (pfs_find_file(path) < 0) { // or it was created meanwhile
+    pfs_file_t *file = pfs_fopen(path, O_RDWR | O_CREAT, 0);
+    if (file == NULL) {
+      res = -1;
+    } else {
+      pfs_wrlock(&file->lock);
+      file->bytes = bytes;
+      file->memsize = size;
+      pfs_set_size(file, size);
+      file->flags &= ~PFS_F_CHANGED;
+      __atomic_add_fetch(&pfs_used_total, size, __ATOMIC_RELAXED);
+      if (size > 0 && size <= pfs_inline_size)
+        pfs_inline_file(file);
+      else
+        pfs_place_file(file); // read before knowing the placement
+      pfs_unlock(&file->lock);
+      bytes = NULL;
+    }
+  }
+  pfs_ns_write_unlock();
+  free(bytes);
+  ESP_LOGD(TAG, "Fetched %s from the backing store (%d bytes)", path, size);
+  return res;
+}
+
+int pfs_fflush(pfs_file_t *stream) {
+  char path[PFS_BACKING_PATH_MAX];
+  int res = 0;
+  pthread_mutex_lock(&pfs_backing_lock);
+  if (pfs_backing != NULL && pfs_backing_dirty_path(stream, path))
+    res = pfs_backing_write(stream, path);
+  pthread_mutex_unlock(&pfs_backing_lock);
+  return res;
+}
+
+int pfs_sync() {
+  char path[PFS_BACKING_PATH_MAX];
+  int res = 0;
+  for (int i = 0;; i++) {
+    // one file at a time, unlinks and renames may go in between
+    pthread_mutex_lock(&pfs_backing_lock);
+    pfs_rdlock(&pfs_ns_lock);
+    pfs_file_t *file = pfs_files != NULL && i < pfs_max_items ? pfs_files[i]
+                                                              : NULL;
+    pfs_unlock(&pfs_ns_lock);
+    if (file == NULL || pfs_backing == NULL) {
+      pthread_mutex_unlock(&pfs_backing_lock);
+      break;
+    }
+    if (pfs_backing_dirty_path(file, path) &&
+        pfs_backing_write(file, path) != 0)
+      res = -1;
+    pthread_mutex_unlock(&pfs_backing_lock);
+  }
+  return res;
+}
+
+static void *pfs_flusher_task(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&pfs_flusher_lock);
+  while (pfs_flusher_running) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += pfs_flusher_interval / 1000;
+    deadline.tv_nsec += (pfs_flusher_interval % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&pfs_flusher_cond, &pfs_flusher_lock, &deadline);
+    if (!pfs_flusher_running)
+      break;
+    pthread_mutex_unlock(&pfs_flusher_lock);
+    pfs_sync();
+    pthread_mutex_lock(&pfs_flusher_lock);
+  }
+  pthread_mutex_unlock(&pfs_flusher_lock);
+  return NULL;
+}
+
+// not meant to run while files are being accessed, like the other setters
+int pfs_set_backing(const pfs_backing_t *backing, uint32_t flush_interval_ms) {
+  if (pfs_flusher_running) {
+    pthread_mutex_lock(&pfs_flusher_lock);
+    pfs_flusher_running = false;
+    pthread_cond_signal(&pfs_flusher_cond);
+    pthread_mutex_unlock(&pfs_flusher_lock);
+    pthread_join(pfs_flusher, NULL);
+  }
+  // what's dirty belongs to the previous store
+  int res = pfs_sync();
+  if (backing == NULL) {
+    pfs_backing = NULL;
+    return res;
+  }
+  pfs_backing_store = *backing;
+  pfs_backing = &pfs_backing_store;
+  pfs_flusher_interval = flush_interval_ms;
+  if (flush_interval_ms > 0) {
+    pfs_flusher_running = true;
+    if (pthread_create(&pfs_flusher, NULL, pfs_flusher_task, NULL) != 0) {
+      ESP_LOGE(TAG, "Can't start the flusher task");
+      pfs_flusher_running = false;
+      return -1;
+    }
+  }
+  ESP_LOGD(TAG, "Backing store attached (flush every %d ms)",
+           flush_interval_ms);
+  return res;
+}
+
+// moves the given cursor, shared by pfs_fseek() and the vfs file handles
+static int pfs_seek(pfs_file_t *stream, uint32_t *index, off_t offset,
+                    pfs_seek_mode mode) {
   if (offset < 0)
     offset = 0; // dafuq ?
 
   switch (mode) {
   case pfs_seek_set: // 0
-    if (offset < stream->size) {
-      stream->index = offset;
+    if (offset <= stream->size) {
+      *index = offset;
       ESP_LOGV(TAG,
                "Seeking mode #%d (seekset) with offset(%d)/size(%d)/index(%d)",
-               mode, (int)offset, stream->size, stream->index);
+               mode, (int)offset, stream->size, *index);
     } else {
-      stream->index = stream->size;
+      *index = stream->size;
       ESP_LOGE(TAG,
                "Seeking mode #%d (seekset) with capped "
                "offset(%d)/size(%d)/index(%d)",
-               mode, (int)offset, stream->size, stream->index);
+               mode, (int)offset, stream->size, *index);
       return -1;
     }
     break;
   case pfs_seek_cur: // 1
-    if (stream->index + offset <= stream->size) {
-      stream->index += offset;
+    if (*index + offset <= stream->size) {
+      *index += offset;
       ESP_LOGV(TAG,
                "Seeking mode #%d (seekcur) with offset(%d)/size(%d)/index(%d)",
-               mode, (int)offset, stream->size, stream->index);
+               mode, (int)offset, stream->size, *index);
     } else {
-      stream->index = stream->size;
+      *index = stream->size;
       ESP_LOGE(TAG,
                "Seeking mode #%d (seekcur) with truncated "
                "offset(%d)/size(%d)/index(%d)",
-               mode, (int)offset, stream->size, stream->index);
+               mode, (int)offset, stream->size, *index);
       return -1;
     }
     break;
   case pfs_seek_end: // 2
     if (offset == 0) {
-      stream->index = stream->size;
+      *index = stream->size;
     } else {
       if (offset <= stream->size) {
-        stream->index = stream->size - offset;
+        *index = stream->size - offset;
       } else {
-        stream->index = 0;
+        *index = 0;
         ESP_LOGE(TAG,
                  "Seeking mode #%d (seekend) with truncated "
                  "offset(%d)/size(%d)/index(%d)",
-                 mode, (int)offset, stream->size, stream->index);
+                 mode, (int)offset, stream->size, *index);
         return -1;
       }
     }
     ESP_LOGV(TAG,
              "Seeking mode #%d (seekend) with offset(%d)/size(%d)/index(%d)",
-             mode, (int)offset, stream->size, stream->index);
+             mode, (int)offset, stream->size, *index);
     break;
   }
   return 0;
 }
 
+int pfs_fseek(pfs_file_t *stream, off_t offset, pfs_seek_mode mode) {
+  return pfs_seek(stream, &stream->index, offset, mode);
+}
+
 size_t pfs_ftell(pfs_file_t *stream) {
   if (stream == NULL) {
     ESP_LOGE(TAG, "Invalid stream");
@@ -917,35 +3307,23 @@ void pfs_fclose(pfs_file_t *stream) {
   return;
 }
 
+// releases the file data, called on unlink or when the last handle to an
+// unlinked file is closed
+static void pfs_release_file(pfs_file_t *file) {
+  ESP_LOGV(TAG, "Freeing bytes for file #%d", file->file_id);
+  pfs_free_bytes(file);
+  if (file->file_id > -1)
+    pfs_free_slots_push(&pfs_files_free_slots, file->file_id);
+  pfs_set_size(file, 0);
+  file->index = 0;
+  file->writers = 0;
+  file->file_id = -1;
+}
+
 int pfs_unlink(const char *path) {
   int file_id = pfs_find_file(path);
   if (file_id > -1) {
-    if (pfs_files[file_id]->name != NULL &&
-        pfs_files[file_id]->name[0] != '\0') {
-      ESP_LOGV(TAG, "Freeing name for path %s", path);
-      free(pfs_files[file_id]->name);
-    }
-    pfs_files[file_id]->name = NULL;
-
-    if (pfs_files[file_id]->size > 0 && pfs_files[file_id]->bytes != NULL) {
-      ESP_LOGV(TAG, "Freeing bytes for path %s", path);
-      free(pfs_files[file_id]->bytes);
-    }
-    pfs_files[file_id]->bytes = NULL;
-    pfs_files[file_id]->size = 0;
-    pfs_files[file_id]->memsize = 0;
-    pfs_files[file_id]->index = 0;
-    pfs_files[file_id]->file_id = -1;
-
-    int dir_id = pfs_files[file_id]->dir_id;
-    if (dir_id > -1) {
-      ESP_LOGD(TAG, "Removing item from folder #%d", dir_id);
-      int new_items_count = pfs_dir_remove_item(dir_id, file_id);
-      ESP_LOGD(TAG, "New folder items count: %d", new_items_count);
-    } else {
-      ESP_LOGE(TAG, "File %s isn't linked to a directory :-(", path);
-    }
-
+    pfs_unlink_file(file_id);
     ESP_LOGD(TAG, "Path %s unlinked successfully", path);
     return 0;
   }
@@ -953,6 +3331,34 @@ int pfs_unlink(const char *path) {
   return 1;
 }
 
+int pfs_unlink_file(int file_id) {
+  pfs_file_t *file = pfs_files[file_id];
+  pfs_index_remove(&pfs_files_index, file_id);
+
+  int dir_id = file->dir_id;
+  if (dir_id > -1) {
+    ESP_LOGD(TAG, "Removing item from folder #%d", dir_id);
+    int new_items_count = pfs_dir_remove_item(dir_id, file_id, DT_REG);
+    ESP_LOGD(TAG, "New folder items count: %d", new_items_count);
+  } else {
+    ESP_LOGE(TAG, "File %s isn't linked to a directory :-(", file->name);
+  }
+
+  pfs_retire(file->name);
+  pthread_mutex_lock(&pfs_fds_lock);
+  pfs_lru_remove(file);
+  file->name = NULL;
+  pthread_mutex_unlock(&pfs_fds_lock);
+
+  if (file->refcount > 0) {
+    ESP_LOGD(TAG, "File #%d still has %d open handle(s), deferring release",
+             file_id, file->refcount);
+  } else {
+    pfs_release_file(file);
+  }
+  return 0;
+}
+
 void pfs_free() {
   ESP_LOGD(TAG, "[%d] bytes available before free()", pfs_free_mem());
 
@@ -961,36 +3367,53 @@ void pfs_free() {
       if (pfs_files[i]->name != NULL) {
         free(pfs_files[i]->name);
       }
-      if (pfs_files[i]->bytes != NULL) {
-        free(pfs_files[i]->bytes);
-      }
-      free(pfs_files[i]);
+      pfs_free_bytes(pfs_files[i]);
+      pfs_rwlock_destroy(&pfs_files[i]->lock);
     }
     free(pfs_files);
     pfs_files = NULL;
   }
+  pfs_pool_free(&pfs_files_pool);
+  if (pfs_fds != NULL) {
+    free(pfs_fds);
+    pfs_fds = NULL;
+  }
+  pfs_index_free(&pfs_files_index);
+  free(pfs_files_free_slots.ids);
+  memset(&pfs_files_free_slots, 0, sizeof(pfs_free_slots_t));
+  pfs_used_total = 0;
+  pfs_used_internal = 0;
+  pfs_reclaimed_total = 0;
+  free(pfs_z_scratch);
+  pfs_z_scratch = NULL;
+  pfs_compact_cursor = 0;
+  pfs_lru_newest = NULL;
+  pfs_lru_oldest = NULL;
+  pfs_evictions_total = 0;
   ESP_LOGD(TAG, "[%d] bytes free after cleaning files", pfs_free_mem());
 
   if (pfs_dirs != NULL) {
     for (int i = 0; i < pfs_max_items; i++) {
-
-      for (int j = 0; j < pfs_dirs[i]->itemscount; j++) {
-        if (pfs_dirs[i]->items[j] != NULL) {
-          free(pfs_dirs[i]->items[j]);
-        }
-      }
-      // pfs_dir_free_items( i );
+      free(pfs_dirs[i]->items);
       if (pfs_dirs[i]->name != NULL) {
         free(pfs_dirs[i]->name);
         pfs_dirs[i]->name = NULL;
       }
-      if (pfs_dirs[i] != NULL) {
-        free(pfs_dirs[i]);
-      }
     }
     free(pfs_dirs);
     pfs_dirs = NULL;
   }
+  pfs_pool_free(&pfs_dirs_pool);
+  pfs_pool_free(&pfs_dir_handles_pool);
+  pfs_index_free(&pfs_dirs_index);
+  free(pfs_dirs_free_slots.ids);
+  memset(&pfs_dirs_free_slots, 0, sizeof(pfs_free_slots_t));
+  pfs_tables_capacity = 0;
+
+  pfs_wait_readers();
+  pfs_reclaim();
+  free(pfs_retired.ptrs);
+  memset(&pfs_retired, 0, sizeof(pfs_retired_t));
 
   if (pfs_partition_label != NULL) {
     free(pfs_partition_label);
@@ -1004,53 +3427,88 @@ void pfs_free() {
   ESP_LOGD(TAG, "[%d] bytes free after full cleanup", pfs_free_mem());
 }
 
+// only drops the files from memory, the backing store is left as is
 void pfs_clean_files() {
   if (pfs_files != NULL) {
+    pthread_mutex_lock(&pfs_backing_lock); // no write back in progress
+    pfs_ns_write_lock();
     for (int i = 0; i < pfs_max_items; i++) {
       if (pfs_files[i]->name != NULL) {
-        pfs_unlink(pfs_files[i]->name);
+        pfs_unlink_file(i);
       }
     }
+    pfs_ns_write_unlock();
+    pthread_mutex_unlock(&pfs_backing_lock);
   }
 }
 
+// moves directory entries around without touching their contents, so
+// renaming a directory costs the same regardless of its subtree size
 int pfs_rename(const char *from, const char *to) {
-  int file_id = pfs_find_file(to);
-  if (file_id > -1) {
-    // destination file already exists, unlink first ?
+  if (pfs_find_file(to) > -1 || pfs_find_dir(to) > -1) {
+    // destination already exists, unlink first ?
     return -1;
   }
-  file_id = pfs_find_file(from);
-  if (file_id > -1) {
-    ESP_LOGD(TAG, "Renaming file #%d from '%s' to '%s'", file_id, from, to);
-    free(pfs_files[file_id]->name);
-    pfs_files[file_id]->name = (char *)pfs_malloc(strlen(to) + 1);
-    memcpy(pfs_files[file_id]->name, to, strlen(to) + 1);
-    return 0;
-  }
 
-  int dir_id = pfs_find_dir(to);
-  if (dir_id > -1) {
-    // destination dir already exists, unlink first ?
+  const char *base;
+  size_t baselen;
+  int to_dir_id = pfs_walk_path(to, &base, &baselen, false);
+  if (to_dir_id < 0 || baselen == 0) {
+    ESP_LOGE(TAG, "Can't rename to %s, parent dir not found", to);
     return -1;
   }
 
-  dir_id = pfs_find_dir(from);
-  if (dir_id > -1) {
+  int file_id = pfs_find_file(from);
+  if (file_id > -1) {
+    pfs_file_t *file = pfs_files[file_id];
+    ESP_LOGD(TAG, "Renaming file #%d from '%s' to '%s'", file_id, from, to);
+    char *name = pfs_strndup(base, baselen);
+    if (name == NULL)
+      return -1;
+    if (to_dir_id != file->dir_id) {
+      pfs_dir_remove_item(file->dir_id, file_id, DT_REG);
+      if (pfs_dir_add_item(to_dir_id, file_id, DT_REG) < 0) {
+        // the old dir has room left since the item was just removed
+        pfs_dir_add_item(file->dir_id, file_id, DT_REG);
+        free(name);
+        return -1;
+      }
+    }
+    pfs_index_remove(&pfs_files_index, file_id);
+    pfs_retire(file->name);
+    file->name = name;
+    file->dir_id = to_dir_id;
+    pfs_index_add(&pfs_files_index, file_id, to_dir_id, name);
+    return 0;
+  }
+
+  int dir_id = pfs_find_dir(from);
+  if (dir_id > 0) {
     pfs_dir_t *dir = pfs_dirs[dir_id];
-    free(dir->name);
-    dir->name = (char *)pfs_malloc(strlen(to) + 1);
-    memcpy(dir->name, to, strlen(to) + 1);
-
-    for (int i = 0; i < dir->parent_dir->itemscount; i++) {
-      if (dir->parent_dir->items[i]->d_ino == dir_id) {
-        // ESP_LOGD(TAG, "Renaming dir #%d / from '%s' to '%s'", dir_id,
-        // dir->parent_dir->items[i]->d_name, pfs_basename((char*)to );
-        snprintf(dir->parent_dir->items[i]->d_name, 256, "%s",
-                 pfs_basename((char *)to));
+    // a directory can't be moved inside itself
+    for (pfs_dir_t *d = pfs_dirs[to_dir_id]; d != NULL; d = d->parent_dir) {
+      if (d == dir) {
+        ESP_LOGE(TAG, "Can't move %s inside itself", from);
+        return -1;
       }
     }
-
+    ESP_LOGD(TAG, "Renaming dir #%d from '%s' to '%s'", dir_id, from, to);
+    char *name = pfs_strndup(base, baselen);
+    if (name == NULL)
+      return -1;
+    if (to_dir_id != dir->parent_dir->dir_id) {
+      pfs_dir_remove_item(dir->parent_dir->dir_id, dir_id, DT_DIR);
+      if (pfs_dir_add_item(to_dir_id, dir_id, DT_DIR) < 0) {
+        pfs_dir_add_item(dir->parent_dir->dir_id, dir_id, DT_DIR);
+        free(name);
+        return -1;
+      }
+      dir->parent_dir = pfs_dirs[to_dir_id];
+    }
+    pfs_index_remove(&pfs_dirs_index, dir_id);
+    pfs_retire(dir->name);
+    dir->name = name;
+    pfs_index_add(&pfs_dirs_index, dir_id, to_dir_id, name);
     return 0;
   }
 
@@ -1070,91 +3528,92 @@ pfs_dir_t *pfs_opendir(const char *path) {
   int dir_id = pfs_find_dir(path);
   if (dir_id > -1) {
     // directory exists
-    pfs_dirs[dir_id]->pos = 0;
     return pfs_dirs[dir_id];
   }
 
   return NULL;
 }
 
-int pfs_dir_add_item(int dir_id, struct dirent *item) {
+// each file/dir remembers where it sits in its parent's items, so removal
+// doesn't have to scan
+static int *pfs_dir_item_pos(int ino, uint8_t type) {
+  return type == DT_DIR ? &pfs_dirs[ino]->parent_pos
+                        : &pfs_files[ino]->dir_pos;
+}
+
+static bool pfs_dir_resize_items(pfs_dir_t *dir, int capacity) {
+  pfs_dir_item_t *items = (pfs_dir_item_t *)pfs_realloc(
+      dir->items, sizeof(pfs_dir_item_t) * capacity);
+  if (items == NULL) {
+    ESP_LOGE(TAG, "Can't alloc %d bytes for folderitems #%d",
+             sizeof(pfs_dir_item_t) * capacity, dir->dir_id);
+    return false;
+  }
+  dir->items = items;
+  dir->itemscapacity = capacity;
+  return true;
+}
+
+int pfs_dir_add_item(int dir_id, int ino, uint8_t type) {
   if (pfs_dirs[dir_id] == NULL)
     return -1;
-  int itemscount = pfs_dirs[dir_id]->itemscount;
-  if (itemscount == 0) {
-    pfs_dirs[dir_id]->items =
-        (struct dirent **)pfs_malloc(sizeof(struct dirent *));
-    if (pfs_dirs[dir_id]->items == NULL) {
-      ESP_LOGE(TAG, "Can't alloc %d bytes for folderitem #%d",
-               sizeof(struct dirent *), dir_id);
+  pfs_dir_t *dir = pfs_dirs[dir_id];
+  int itemscount = dir->itemscount;
+  if (itemscount == dir->itemscapacity) {
+    int capacity = dir->itemscapacity > 0 ? dir->itemscapacity * 2 : 4;
+    if (!pfs_dir_resize_items(dir, capacity))
       return -1;
-    }
-  } else {
-    pfs_dirs[dir_id]->items = (struct dirent **)pfs_realloc(
-        pfs_dirs[dir_id]->items, sizeof(struct dirent *) * (itemscount + 1));
   }
-  pfs_dirs[dir_id]->items[itemscount] = item;
-  pfs_dirs[dir_id]->itemscount++;
+  dir->items[itemscount].ino = ino;
+  dir->items[itemscount].type = type;
+  *pfs_dir_item_pos(ino, type) = itemscount;
+  dir->itemscount++;
   return itemscount;
 }
 
-int pfs_dir_remove_item(int dir_id, int item_id) {
+// the last item takes the place of the removed one, so an opened dir
+// handle may miss that item if it had already been read past
+int pfs_dir_remove_item(int dir_id, int ino, uint8_t type) {
   if (pfs_dirs[dir_id] == NULL)
     return -1;
   pfs_dir_t *dir = pfs_dirs[dir_id];
-  ESP_LOGD(TAG, "Folder '%s' (#%d) claims %d items (looking for #%d)",
-           dir->name, dir_id, dir->itemscount, item_id);
-  for (int i = 0; i < dir->itemscount; i++) {
-    if (dir->items[i] != NULL) {
-      if (dir->items[i]->d_ino == item_id) {
-        ESP_LOGD(TAG, "Removing item '%s' (#%d)", dir->items[i]->d_name,
-                 item_id);
-        free(dir->items[i]);
-        dir->items[i] = NULL;
-        while (i < dir->itemscount) {
-          // ESP_LOGD(TAG, "Shifting %d to %d", i, i+1 );
-          dir->items[i] = dir->items[i + 1];
-          i++;
-        }
-        dir->itemscount--;
-        if (dir->pos > 0) {
-          dir->pos--;
-        }
-        if (dir->itemscount == 0) {
-          free(dir->items);
-        }
-        break;
-      } else {
-        ESP_LOGD(TAG, "Keeping item %s (#%d)", dir->items[i]->d_name, i);
-      }
-    } else {
-      ESP_LOGW(TAG, "Skipping NULL dir item at index #%d (looking for #%d)", i,
-               item_id);
-    }
+  int i = *pfs_dir_item_pos(ino, type);
+  if (i < 0 || i >= dir->itemscount || dir->items[i].ino != ino ||
+      dir->items[i].type != type) {
+    ESP_LOGE(TAG, "Item #%d isn't in folder '%s' (#%d)", ino, dir->name,
+             dir_id);
+    return -1;
+  }
+  ESP_LOGD(TAG, "Removing item #%d from folder '%s' (#%d)", ino, dir->name,
+           dir_id);
+  int last = dir->itemscount - 1;
+  if (i != last) {
+    dir->items[i] = dir->items[last];
+    *pfs_dir_item_pos(dir->items[i].ino, dir->items[i].type) = i;
+  }
+  dir->itemscount--;
+  if (dir->itemscount == 0) {
+    free(dir->items);
+    dir->items = NULL;
+    dir->itemscapacity = 0;
+  } else if (dir->itemscapacity > 4 &&
+             dir->itemscount <= dir->itemscapacity / 4) {
+    // failing to shrink is harmless
+    pfs_dir_resize_items(dir, dir->itemscapacity / 2);
   }
   return dir->itemscount;
 }
 
 int pfs_dir_free_items(int dir_id) {
-  int res = 0;
   if (pfs_dirs == NULL)
     return 0; // obviously already free
   if (pfs_dirs[dir_id] == NULL)
     return -1;
-  if (pfs_dirs[dir_id]->items == NULL)
-    return res; // unpopulated
-  if (pfs_dirs[dir_id]->itemscount == 0)
-    return res; // nothing to free
-  for (int i = 0; i < pfs_dirs[dir_id]->itemscount; i++) {
-    if (pfs_dirs[dir_id]->items[i] != NULL) {
-      free(pfs_dirs[dir_id]->items[i]);
-      pfs_dirs[dir_id]->items[i] = NULL;
-      res++;
-    }
-  }
-
+  int res = pfs_dirs[dir_id]->itemscount;
   free(pfs_dirs[dir_id]->items);
   pfs_dirs[dir_id]->items = NULL;
+  pfs_dirs[dir_id]->itemscount = 0;
+  pfs_dirs[dir_id]->itemscapacity = 0;
   return res;
 }
 
@@ -1165,62 +3624,55 @@ int pfs_mkdir(const char *path) {
     return dir_id;
   }
 
-  int dirslot = pfs_next_dir_avail();
-  size_t pathlen = strlen(path);
-  pfs_dirs[dirslot]->name = (char *)pfs_calloc(1, pathlen + 1);
-
-  if (pfs_dirs[dirslot] == NULL || pfs_dirs[dirslot]->name == NULL) {
-    ESP_LOGE(TAG, "Failed to create dir %s", path);
+  const char *base;
+  size_t baselen;
+  int parent_id = pfs_walk_path(path, &base, &baselen, false);
+  if (parent_id < 0) {
+    ESP_LOGE(TAG, "Unreachable parent_dir for %s, directory creation cancelled",
+             path);
     return -1;
   }
+  if (baselen == 0) // root dir
+    return pfs_mkdir_at(-1, "/", 1);
+  return pfs_mkdir_at(parent_id, base, baselen);
+}
 
-  pfs_dirs[dirslot]->dir_id = dirslot;
-  memcpy(pfs_dirs[dirslot]->name, path, pathlen + 1);
-  pfs_dirs[dirslot]->name[pathlen] = '\0';
-  pfs_dirs[dirslot]->itemscount = 0;
-  if (dirslot == 0) { // root dir
-    pfs_dirs[dirslot]->parent_dir = NULL;
-    ESP_LOGD(TAG, "Created ROOTDir %s (len=%d, slot=%d)", path, strlen(path),
-             dirslot);
-    return 0;
+// creates directory [name] in [parent_id], or the root dir when [parent_id]
+// is negative
+int pfs_mkdir_at(int parent_id, const char *name, size_t len) {
+  int dirslot = pfs_next_dir_avail();
+  if (dirslot < 0) {
+    ESP_LOGE(TAG, "Failed to create dir %.*s", len, name);
+    return -1;
+  }
+  pfs_dir_t *dir = pfs_dirs[dirslot];
+  dir->name = pfs_strndup(name, len);
+  if (dir->name == NULL) {
+    ESP_LOGE(TAG, "Failed to create dir %.*s", len, name);
+    pfs_free_slots_push(&pfs_dirs_free_slots, dirslot);
+    return -1;
   }
 
-  char *parent_dir_name = pfs_dirname(strdupa(path));
-  dir_id = 0;
-
-  if (strlen(parent_dir_name) == 1 && parent_dir_name[0] == '/') {
-    ESP_LOGD(TAG, "Assigning %s to root dir", path);
-    pfs_dirs[dirslot]->parent_dir = pfs_dirs[0]; // attached to root dir
-  } else {
-    dir_id = pfs_find_dir(parent_dir_name);
-    if (dir_id > -1) {
-      ESP_LOGD(TAG, "Assigning %s to %s dir (#%d)", path, parent_dir_name,
-               dir_id);
-      pfs_dirs[dirslot]->parent_dir = pfs_dirs[dir_id];
-    } else {
-      ESP_LOGE(TAG,
-               "Unreachable parent_dir for %s, directory creation cancelled",
-               parent_dir_name);
-      free(pfs_dirs[dirslot]->name);
-      pfs_dirs[dirslot]->name = NULL;
-      return -1;
-    }
+  dir->dir_id = dirslot;
+  dir->itemscount = 0;
+  dir->flags = parent_id < 0 ? 0 : pfs_dirs[parent_id]->flags;
+  if (parent_id < 0) { // root dir
+    dir->parent_dir = NULL;
+    ESP_LOGD(TAG, "Created ROOTDir (slot=%d)", dirslot);
+    return dirslot;
   }
 
-  struct dirent *item = pfs_calloc(1, sizeof(struct dirent));
-  if (item == NULL) {
-    ESP_LOGE(TAG, "Can't alloc %d byte for directory entity",
-             sizeof(struct dirent));
+  dir->parent_dir = pfs_dirs[parent_id];
+  if (pfs_dir_add_item(parent_id, dirslot, DT_DIR) < 0) {
+    ESP_LOGE(TAG, "Can't add %s to its parent directory", dir->name);
+    free(dir->name);
+    dir->name = NULL;
+    pfs_free_slots_push(&pfs_dirs_free_slots, dirslot);
     return -1;
   }
-  item->d_ino = dirslot;
-
-  snprintf(item->d_name, 256, "%s", pfs_basename((char *)path));
+  pfs_index_add(&pfs_dirs_index, dirslot, parent_id, dir->name);
 
-  item->d_type = DT_DIR;
-  pfs_dir_add_item(dir_id, item);
-
-  ESP_LOGD(TAG, "Created dir %s (len=%d, slot=%d)", path, strlen(path),
+  ESP_LOGD(TAG, "Created dir %s in #%d (slot=%d)", dir->name, parent_id,
            dirslot);
   return dirslot;
 }
@@ -1236,178 +3688,942 @@ int pfs_rmdir(const char *path) {
     ESP_LOGE(TAG, "Directory %s is not empty", path);
     return -1;
   }
-  if (path[0] == '/' && path[1] == '\0') {
+  if (dir_id == 0) {
     ESP_LOGE(TAG, "Cowardly refusing to delete root dir");
     return -1;
   }
 
-  pfs_dir_remove_item(pfs_dirs[dir_id]->parent_dir->dir_id, dir_id);
+  pfs_dir_remove_item(pfs_dirs[dir_id]->parent_dir->dir_id, dir_id, DT_DIR);
   pfs_dir_free_items(dir_id);
 
-  free(pfs_dirs[dir_id]->name);
+  pfs_index_remove(&pfs_dirs_index, dir_id);
+  pfs_retire(pfs_dirs[dir_id]->name);
   pfs_dirs[dir_id]->name = NULL;
+  // opened handles still point to the slot, it's freed by the last one
+  if (pfs_dirs[dir_id]->refcount == 0)
+    pfs_free_slots_push(&pfs_dirs_free_slots, dir_id);
   ESP_LOGD(TAG, "Deleted dir %s", path);
   return 0;
 }
 
-struct dirent *pfs_readdir(pfs_dir_t *dir) {
+pfs_dir_handle_t *pfs_dir_handle_open(pfs_dir_t *dir) {
+  pfs_dir_handle_t *handle =
+      (pfs_dir_handle_t *)pfs_pool_alloc(&pfs_dir_handles_pool);
+  if (handle == NULL) {
+    ESP_LOGE(TAG, "Can't alloc dir handle");
+    return NULL;
+  }
+  handle->dir = dir;
+  handle->pos = 0;
+  dir->refcount++;
+  return handle;
+}
+
+// the returned dirent is built in the handle, and is only valid until the
+// next call
+struct dirent *pfs_readdir(pfs_dir_handle_t *handle) {
+  pfs_dir_t *dir = handle->dir;
+  if (dir->name == NULL) {
+    ESP_LOGV(TAG, "Directory was deleted");
+    return NULL;
+  }
   if (dir->itemscount == 0) {
     ESP_LOGV(TAG, "Directory is empty");
     return NULL;
   }
-  if (dir->pos < dir->itemscount) {
-    int dir_pos = dir->pos;
-    dir->pos++;
-    if (dir->items[dir_pos] == NULL)
+  if (handle->pos < dir->itemscount) {
+    pfs_dir_item_t *item = &dir->items[handle->pos];
+    handle->pos++;
+    const char *name = item->type == DT_DIR ? pfs_dirs[item->ino]->name
+                                            : pfs_files[item->ino]->name;
+    if (name == NULL)
       return NULL;
-    ESP_LOGV(TAG, "Next dir item in '%s' (#%d / %d)", dir->name, dir->pos,
+    handle->entry.d_ino = item->ino;
+    handle->entry.d_type = item->type;
+    snprintf(handle->entry.d_name, sizeof(handle->entry.d_name), "%s", name);
+    ESP_LOGV(TAG, "Next dir item in '%s' (#%d / %d)", dir->name, handle->pos,
              dir->itemscount);
-    return dir->items[dir_pos];
+    return &handle->entry;
   }
   ESP_LOGV(TAG, "End of dir");
   return NULL;
 }
 
-void pfs_closedir(pfs_dir_t *dir) {
-  dir->pos = 0;
+void pfs_closedir(pfs_dir_handle_t *handle) {
   // ESP_LOGD(TAG, "Closed dir #%d %s", dir->dir_id );
-  return;
+  pfs_dir_t *dir = handle->dir;
+  if (--dir->refcount == 0 && dir->name == NULL) // removed while opened
+    pfs_free_slots_push(&pfs_dirs_free_slots, dir->dir_id);
+  pfs_pool_release(&pfs_dir_handles_pool, handle);
 }
 
-void pfs_rewinddir(pfs_dir_t *dir) {
-  // makes no sense (yet?) to support that
-  dir->pos = 0;
+void pfs_rewinddir(pfs_dir_handle_t *handle) {
+  handle->pos = 0;
   // ESP_LOGD(TAG, "Rewinded %s dir", dir->name);
   return;
 }
 
+int pfs_fd_open(pfs_file_t *file, int flags) {
+  if (pfs_fds == NULL)
+    return -1;
+  for (int fd = 0; fd < pfs_max_open_files; fd++) {
+    if (pfs_fds[fd].file != NULL)
+      continue;
+    pfs_fds[fd].file = file;
+    pfs_fds[fd].flags = pfs_flags_conv(flags);
+    // append modes start at the end of the file, anything else at 0
+    pfs_fds[fd].index = 0;
+    if (pfs_fds[fd].flags & PFS_O_APPEND) {
+      pfs_rdlock(&file->lock);
+      pfs_fds[fd].index = file->size;
+      pfs_unlock(&file->lock);
+    }
+    file->refcount++;
+    pfs_lru_remove(file);
+    if (pfs_fds[fd].flags & PFS_O_WRONLY)
+      file->writers++;
+    ESP_LOGV(TAG, "Opened handle #%d on file #%d (%d handles)", fd,
+             file->file_id, file->refcount);
+    return fd;
+  }
+  ESP_LOGE(TAG, "Too many open files (max=%d)", pfs_max_open_files);
+  return -1;
+}
+
+pfs_fd_t *pfs_fd_get(int fd) {
+  if (pfs_fds == NULL || fd < 0 || fd >= pfs_max_open_files ||
+      pfs_fds[fd].file == NULL) {
+    ESP_LOGE(TAG, "Invalid file descriptor (%d)", fd);
+    return NULL;
+  }
+  return &pfs_fds[fd];
+}
+
+#define PFS_TRIM_SLACK 1 // the last writer is gone, shrink on close
+#define PFS_TRIM_CACHE 2 // the last handle is gone, drop the decompressed block
+
+// closes handle [fd], the caller holds pfs_fds_lock. What can be trimmed
+// off the [file] is left in [trim] for pfs_fd_trim(), so that it doesn't
+// run under pfs_fds_lock
+int pfs_fd_close(int fd, pfs_file_t **file, int *trim) {
+  pfs_fd_t *handle = pfs_fd_get(fd);
+  *file = NULL;
+  *trim = 0;
+  if (handle == NULL)
+    return -1;
+  pfs_file_t *closed = handle->file;
+  ESP_LOGV(TAG, "Closing handle #%d on file #%d", fd, closed->file_id);
+  bool writer = handle->flags & PFS_O_WRONLY;
+  memset(handle, 0, sizeof(pfs_fd_t));
+  if (closed->refcount > 0)
+    closed->refcount--;
+  if (closed->refcount == 0 && closed->name == NULL) {
+    // unlinked while opened, release now
+    pfs_release_file(closed);
+    return 0;
+  }
+  pfs_lru_add(closed, true);
+  if (writer && closed->writers > 0 && --closed->writers == 0 &&
+      pfs_shrink_on_close)
+    *trim |= PFS_TRIM_SLACK;
+  if (closed->refcount == 0)
+    *trim |= PFS_TRIM_CACHE;
+  *file = closed;
+  return 0;
+}
+
+// trims what pfs_fd_close() left, the caller holds pfs_ns_lock so that the
+// file can't be released meanwhile. It may have been opened again since,
+// trimming is only wasted then
+static void pfs_fd_trim(pfs_file_t *file, int trim) {
+  if (trim == 0)
+    return;
+  size_t reclaimed = 0;
+  // flags may be changing under the file lock (write back)
+  pfs_wrlock(&file->lock);
+  if (trim & PFS_TRIM_SLACK)
+    reclaimed = pfs_release_slack(file, file->size);
+  // no need to keep a decompressed block around
+  if ((trim & PFS_TRIM_CACHE) && file->z != NULL)
+    pfs_z_release_cache(file);
+  pfs_unlock(&file->lock);
+  __atomic_add_fetch(&pfs_reclaimed_total, reclaimed, __ATOMIC_RELAXED);
+}
+
+// Mappings hold a reference like open handles so an unlinked file outlives
+// them, and pin the data: contiguous buffers are not reallocated and chunks
+// are never moved while a mapping exists, writes in place are still visible.
+int pfs_map(const char *path, size_t offset, size_t length, pfs_map_t *map) {
+  assert(map);
+  memset(map, 0, sizeof(pfs_map_t));
+  pfs_rdlock(&pfs_ns_lock);
+  int file_id = pfs_find_file(path);
+  if (file_id < 0) {
+    pfs_unlock(&pfs_ns_lock);
+    ESP_LOGE(TAG, "Can't map %s: file not found", path);
+    return -1;
+  }
+  pfs_file_t *file = pfs_files[file_id];
+  int res = 0;
+  pfs_wrlock(&file->lock);
+  if (file->z != NULL) {
+    ESP_LOGE(TAG, "Can't map %s, it's compressed", path);
+    res = -1;
+  } else if (offset > file->size) {
+    ESP_LOGE(TAG, "Can't map %s at %d, past the end (%d)", path, offset,
+             file->size);
+    res = -1;
+  } else {
+    if (length == 0 || length > file->size - offset)
+      length = file->size - offset;
+    if (offset + length > file->memsize && !pfs_fill_hole(file))
+      res = -1;
+    // a range spanning several chunks has to be made contiguous first
+    if (res == 0 && file->chunks != NULL && length > 0 &&
+        offset / file->chunk_size != (offset + length - 1) / file->chunk_size) {
+      if (file->maps > 0 || !pfs_chunks_flatten(file))
+        res = -1;
+    }
+  }
+  if (res == 0) {
+    if (length == 0)
+      map->data = NULL;
+    else if (file->chunks != NULL)
+      map->data = (const uint8_t *)&file->chunks[offset / file->chunk_size]
+                                               [offset % file->chunk_size];
+    else
+      map->data = (const uint8_t *)&file->bytes[offset];
+    map->size = length;
+    map->file = file;
+    file->maps++;
+  }
+  pfs_unlock(&file->lock);
+  if (res == 0) {
+    pthread_mutex_lock(&pfs_fds_lock);
+    file->refcount++;
+    pfs_lru_remove(file);
+    pthread_mutex_unlock(&pfs_fds_lock);
+  }
+  pfs_unlock(&pfs_ns_lock);
+  if (res == 0) {
+    ESP_LOGV(TAG, "Mapped %d bytes at %d from %s", length, offset, path);
+  }
+  return res;
+}
+
+int pfs_unmap(pfs_map_t *map) {
+  assert(map);
+  pfs_file_t *file = map->file;
+  if (file == NULL) {
+    ESP_LOGE(TAG, "Invalid mapping");
+    return -1;
+  }
+  pfs_wrlock(&file->lock);
+  file->maps--;
+  pfs_unlock(&file->lock);
+  memset(map, 0, sizeof(pfs_map_t));
+
+  bool releases = false;
+  pfs_rdlock(&pfs_ns_lock);
+  pthread_mutex_lock(&pfs_fds_lock);
+  // the last reference on an unlinked file releases it, which changes the
+  // namespace
+  releases = file->name == NULL && file->refcount == 1;
+  if (!releases && --file->refcount == 0)
+    pfs_lru_add(file, true);
+  pthread_mutex_unlock(&pfs_fds_lock);
+  pfs_unlock(&pfs_ns_lock);
+
+  if (releases) {
+    pfs_ns_write_lock();
+    file->refcount = 0;
+    pfs_release_file(file);
+    pfs_ns_write_unlock();
+  }
+  return 0;
+}
+
+// writes a record header, [number] is the parent directory number
+static bool pfs_image_put_record(pfs_image_write_cb write, void *ctx,
+                                 uint8_t type, uint32_t number,
+                                 const char *name) {
+  uint8_t record[PFS_IMAGE_RECORD_SIZE];
+  size_t len = name != NULL ? strlen(name) : 0;
+  if (len > PFS_IMAGE_NAME_MAX) {
+    ESP_LOGE(TAG, "Name too long for an image: %s", name);
+    return false;
+  }
+  record[0] = type;
+  pfs_image_put_u32(&record[1], number);
+  pfs_image_put_u16(&record[5], len);
+  return write(ctx, record, sizeof(record)) == sizeof(record) &&
+         (len == 0 || write(ctx, name, len) == len);
+}
+
+// compressed files are written one decompressed block at a time
+static bool pfs_image_put_zfile(pfs_image_write_cb write, void *ctx,
+                                pfs_file_t *file) {
+  pfs_zfile_t *z = file->z;
+  bool ok = true;
+  pthread_mutex_lock(&z->lock);
+  for (uint32_t pos = 0; ok && pos < file->size; pos += PFS_Z_BLOCK_SIZE) {
+    size_t len = file->size - pos < PFS_Z_BLOCK_SIZE ? file->size - pos
+                                                     : PFS_Z_BLOCK_SIZE;
+    ok = pfs_z_load(file, pos / PFS_Z_BLOCK_SIZE, false) &&
+         write(ctx, z->cache, len) == len;
+  }
+  pthread_mutex_unlock(&z->lock);
+  return ok;
+}
+
+static bool pfs_image_put_file(pfs_image_write_cb write, void *ctx,
+                               pfs_file_t *file) {
+  static const uint8_t zeroes[256] = {0};
+  uint8_t size[4];
+  pfs_image_put_u32(size, file->size);
+  if (write(ctx, size, sizeof(size)) != sizeof(size))
+    return false;
+  if (file->z != NULL)
+    return pfs_image_put_zfile(write, ctx, file);
+  uint32_t stored = pfs_stored_size(file);
+  if (file->chunks != NULL) {
+    for (uint32_t pos = 0; pos < stored; pos += file->chunk_size) {
+      size_t len = stored - pos < file->chunk_size ? stored - pos
+                                                   : file->chunk_size;
+      if (write(ctx, file->chunks[pos / file->chunk_size], len) != len)
+        return false;
+    }
+  } else if (stored > 0 && write(ctx, file->bytes, stored) != stored) {
+    return false;
+  }
+  // not allocated yet, reads as zeroes
+  for (uint32_t pos = stored; pos < file->size; pos += sizeof(zeroes)) {
+    size_t len = file->size - pos < sizeof(zeroes) ? file->size - pos
+                                                   : sizeof(zeroes);
+    if (write(ctx, zeroes, len) != len)
+      return false;
+  }
+  return true;
+}
+
+// Directories are written breadth first: the position of a directory in
+// [queue] is its number in the image.
+int pfs_image_export(pfs_image_write_cb write, void *ctx) {
+  if (pfs_files == NULL || pfs_dirs == NULL) {
+    ESP_LOGE(TAG, "Can't export an image before pfs is mounted");
+    return -1;
+  }
+  uint8_t header[PFS_IMAGE_HEADER_SIZE];
+  memcpy(header, PFS_IMAGE_MAGIC, 4);
+  pfs_image_put_u16(&header[4], PFS_IMAGE_VERSION);
+  pfs_image_put_u16(&header[6], 0);
+  if (write(ctx, header, sizeof(header)) != sizeof(header))
+    return -1;
+
+  pfs_rdlock(&pfs_ns_lock);
+  int *queue = (int *)pfs_malloc(pfs_max_items * sizeof(int));
+  bool ok = queue != NULL;
+  int head = 0, tail = 0;
+  if (ok)
+    queue[tail++] = 0; // root
+  while (ok && head < tail) {
+    uint32_t number = head;
+    pfs_dir_t *dir = pfs_dirs[queue[head++]];
+    for (int i = 0; ok && i < dir->itemscount; i++) {
+      pfs_dir_item_t *item = &dir->items[i];
+      if (item->type == DT_DIR) {
+        ok = pfs_image_put_record(write, ctx, PFS_IMAGE_DIR, number,
+                                  pfs_dirs[item->ino]->name);
+        queue[tail++] = item->ino;
+      } else {
+        pfs_file_t *file = pfs_files[item->ino];
+        pfs_rdlock(&file->lock);
+        ok = pfs_image_put_record(write, ctx, PFS_IMAGE_FILE, number,
+                                  file->name) &&
+             pfs_image_put_file(write, ctx, file);
+        pfs_unlock(&file->lock);
+      }
+    }
+  }
+  free(queue);
+  pfs_unlock(&pfs_ns_lock);
+
+  if (!ok || !pfs_image_put_record(write, ctx, PFS_IMAGE_END, 0, NULL)) {
+    ESP_LOGE(TAG, "Image export failed");
+    return -1;
+  }
+  ESP_LOGD(TAG, "Exported %d directories", tail);
+  return 0;
+}
+
+// compressed files are read one block at a time into their cache
+static bool pfs_image_get_zfile(pfs_image_read_cb read, void *ctx,
+                                pfs_file_t *file, uint32_t size) {
+  if (!pfs_z_start(file))
+    return false;
+  pfs_zfile_t *z = file->z;
+  bool ok = true;
+  pthread_mutex_lock(&z->lock);
+  while (ok && file->size < size) {
+    size_t len = size - file->size < PFS_Z_BLOCK_SIZE ? size - file->size
+                                                      : PFS_Z_BLOCK_SIZE;
+    ok = pfs_z_load(file, file->size / PFS_Z_BLOCK_SIZE, true) &&
+         read(ctx, z->cache, len) == len;
+    if (ok) {
+      z->cache_len = len;
+      z->dirty = true;
+      pfs_set_size(file, file->size + len);
+    }
+  }
+  pthread_mutex_unlock(&z->lock);
+  pfs_z_release_cache(file);
+  return ok;
+}
+
+// fills [file] with [size] bytes from the image, straight into its storage
+static bool pfs_image_get_file(pfs_image_read_cb read, void *ctx,
+                               pfs_file_t *file, uint32_t size) {
+  pfs_free_bytes(file);
+  pfs_set_size(file, 0);
+  file->flags |= PFS_F_CHANGED;
+  if (file->flags & PFS_F_COMPRESSED)
+    return pfs_image_get_zfile(read, ctx, file, size);
+  if (!pfs_reserve(file, size, true))
+    return false;
+  while (file->size < size) {
+    size_t len = size - file->size;
+    char *dst;
+    if (file->chunks != NULL) {
+      uint32_t chunk_pos = file->size % file->chunk_size;
+      if (len > file->chunk_size - chunk_pos)
+        len = file->chunk_size - chunk_pos;
+      dst = &file->chunks[file->size / file->chunk_size][chunk_pos];
+    } else {
+      dst = &file->bytes[file->size];
+    }
+    if (read(ctx, dst, len) != len)
+      return false;
+    pfs_set_size(file, file->size + len);
+  }
+  return true;
+}
+
+// in-memory image walked by pfs_image_mount()
+typedef struct _pfs_image_rom_t {
+  const uint8_t *data;
+  size_t size;
+  size_t pos;
+} pfs_image_rom_t;
+
+static size_t pfs_image_rom_read(void *ctx, void *data, size_t len) {
+  pfs_image_rom_t *rom = (pfs_image_rom_t *)ctx;
+  if (len > rom->size - rom->pos)
+    len = rom->size - rom->pos;
+  memcpy(data, &rom->data[rom->pos], len);
+  rom->pos += len;
+  return len;
+}
+
+// links [file] to its [size] bytes of contents, in place in the image
+static bool pfs_image_link_file(pfs_image_rom_t *rom, pfs_file_t *file,
+                                uint32_t size) {
+  if (size > rom->size - rom->pos)
+    return false;
+  pfs_link_rom_bytes(file, &rom->data[rom->pos], size);
+  rom->pos += size;
+  return true;
+}
+
+// Restores an image on top of the current tree: existing directories are
+// reused and existing files replaced. With [rom], files contents are not
+// copied but linked from the image.
+static int pfs_image_restore(pfs_image_read_cb read, void *ctx,
+                             pfs_image_rom_t *rom) {
+  if (pfs_files == NULL || pfs_dirs == NULL) {
+    ESP_LOGE(TAG, "Can't import an image before pfs is mounted");
+    return -1;
+  }
+  uint8_t header[PFS_IMAGE_HEADER_SIZE];
+  if (read(ctx, header, sizeof(header)) != sizeof(header) ||
+      memcmp(header, PFS_IMAGE_MAGIC, 4) != 0) {
+    ESP_LOGE(TAG, "Not a pfs image");
+    return -1;
+  }
+  uint16_t version = pfs_image_get_u16(&header[4]);
+  if (version > PFS_IMAGE_VERSION) {
+    ESP_LOGE(TAG, "Unsupported image version %d (max %d)", version,
+             PFS_IMAGE_VERSION);
+    return -1;
+  }
+
+  int capacity = 16;
+  int *numbers = (int *)pfs_malloc(capacity * sizeof(int)); // to dir_id
+  int count = 1;
+  char *name = (char *)pfs_malloc(PFS_IMAGE_NAME_MAX);
+  int files = 0;
+  bool ok = numbers != NULL && name != NULL;
+  if (ok)
+    numbers[0] = 0; // root
+
+  pfs_ns_write_lock();
+  while (ok) {
+    uint8_t record[PFS_IMAGE_RECORD_SIZE];
+    if (read(ctx, record, sizeof(record)) != sizeof(record)) {
+      ok = false;
+      break;
+    }
+    if (record[0] == PFS_IMAGE_END)
+      break;
+    uint32_t parent = pfs_image_get_u32(&record[1]);
+    size_t len = pfs_image_get_u16(&record[5]);
+    if (parent >= (uint32_t)count || len == 0 ||
+        read(ctx, name, len) != len || memchr(name, '/', len) != NULL) {
+      ok = false;
+      break;
+    }
+    int dir_id = numbers[parent];
+    if (record[0] == PFS_IMAGE_DIR) {
+      if (count == capacity) {
+        int *grown =
+            (int *)pfs_realloc(numbers, capacity * 2 * sizeof(int));
+        if (grown == NULL) {
+          ok = false;
+          break;
+        }
+        numbers = grown;
+        capacity *= 2;
+      }
+      int id = pfs_lookup_dir(dir_id, name, len);
+      if (id < 0)
+        id = pfs_mkdir_at(dir_id, name, len);
+      numbers[count++] = id;
+      ok = id > -1;
+    } else if (record[0] == PFS_IMAGE_FILE) {
+      uint8_t size[4];
+      int file_id = pfs_lookup_file(dir_id, name, len);
+      pfs_file_t *file = file_id > -1 ? pfs_files[file_id]
+                                      : pfs_create_file_at(dir_id, name, len);
+      ok = file != NULL && read(ctx, size, sizeof(size)) == sizeof(size);
+      if (ok) {
+        pfs_wrlock(&file->lock);
+        if (file->maps > 0) {
+          ESP_LOGE(TAG, "Can't replace %s while it's mapped", file->name);
+          ok = false;
+        } else if (rom != NULL) {
+          ok = pfs_image_link_file(rom, file, pfs_image_get_u32(size));
+        } else {
+          ok = pfs_image_get_file(read, ctx, file, pfs_image_get_u32(size));
+        }
+        pfs_unlock(&file->lock);
+      }
+      files++;
+    } else {
+      ESP_LOGE(TAG, "Unknown image record type %d", record[0]);
+      ok = false;
+    }
+  }
+  pfs_ns_write_unlock();
+  free(numbers);
+  free(name);
+
+  if (!ok) {
+    ESP_LOGE(TAG, "Image import failed (truncated or corrupted image?)");
+    return -1;
+  }
+  ESP_LOGD(TAG, "Imported %d files and %d directories", files, count - 1);
+  return 0;
+}
+
+int pfs_image_import(pfs_image_read_cb read, void *ctx) {
+  return pfs_image_restore(read, ctx, NULL);
+}
+
+int pfs_image_mount(const void *image, size_t size) {
+  if (image == NULL) {
+    ESP_LOGE(TAG, "Invalid image");
+    return -1;
+  }
+  pfs_image_rom_t rom = {(const uint8_t *)image, size, 0};
+  return pfs_image_restore(pfs_image_rom_read, &rom, &rom);
+}
+
 int vfs_pfs_fopen(const char *path, int flags, int mode) {
+  int fd = -1;
+  // opening an existing file doesn't change the namespace
+  pfs_rdlock(&pfs_ns_lock);
+  bool exists = pfs_find_file(path) > -1;
+  if (exists) {
+    pfs_file_t *tmp = pfs_fopen(path, flags, mode);
+    pthread_mutex_lock(&pfs_fds_lock);
+    fd = pfs_fd_open(tmp, flags);
+    pthread_mutex_unlock(&pfs_fds_lock);
+  }
+  pfs_unlock(&pfs_ns_lock);
+  if (exists)
+    return fd;
+
+  // not in memory, the backing store may have it (no need when truncating)
+  if (pfs_backing != NULL && !(flags & O_TRUNC)) {
+    pthread_mutex_lock(&pfs_backing_lock);
+    int fetched = pfs_backing_fetch(path);
+    pthread_mutex_unlock(&pfs_backing_lock);
+    if (fetched < 0)
+      return -1;
+  }
 
+  pfs_ns_write_lock();
   pfs_file_t *tmp = pfs_fopen(path, flags, mode);
   if (tmp != NULL) {
-    return tmp->file_id;
+    pthread_mutex_lock(&pfs_fds_lock);
+    fd = pfs_fd_open(tmp, flags);
+    pthread_mutex_unlock(&pfs_fds_lock);
   }
-  return -1;
+  pfs_ns_write_unlock();
+  return fd;
 }
 
 ssize_t vfs_pfs_read(int fd, void *dst, size_t size) {
-  if (pfs_files[fd] == NULL)
-    return 0;
-  return pfs_fread(dst, size, 1, pfs_files[fd]);
+  pfs_fd_t *handle = pfs_fd_get(fd);
+  if (handle == NULL)
+    return -1;
+  size_t res = 0;
+  pfs_rdlock(&handle->file->lock);
+  // the file may have been truncated below the cursor
+  if (handle->index < handle->file->size)
+    res = pfs_pread(handle->file, dst, size, handle->index);
+  pfs_unlock(&handle->file->lock);
+  if (res == (size_t)-1)
+    return -1;
+  handle->index += res;
+  return res;
+}
+
+// cache mode: a write that didn't fit gets another chance once the least
+// recently used files are evicted, enough for the write and a new block
+static bool pfs_write_retry(size_t size) {
+  if (!pfs_cache_mode)
+    return false;
+  pthread_mutex_lock(&pfs_backing_lock);
+  int evicted = pfs_make_room(size + pfs_alloc_block_size);
+  pthread_mutex_unlock(&pfs_backing_lock);
+  return evicted > 0;
 }
 
 ssize_t vfs_pfs_write(int fd, const void *data, size_t size) {
-  if (pfs_files[fd] == NULL)
-    return 0;
-  return pfs_fwrite(data, size, 1, pfs_files[fd]);
+  pfs_fd_t *handle = pfs_fd_get(fd);
+  if (handle == NULL)
+    return -1;
+  size_t res;
+  for (bool retry = false;; retry = true) {
+    pfs_wrlock(&handle->file->lock);
+    if (handle->flags & PFS_O_APPEND)
+      handle->index = handle->file->size;
+    res = pfs_pwrite(handle->file, data, size, handle->index);
+    pfs_unlock(&handle->file->lock);
+    if (res != (size_t)-1 || retry || !pfs_write_retry(size))
+      break;
+  }
+  if (res == (size_t)-1)
+    return -1;
+  handle->index += res;
+  return res;
 }
 
-int vfs_pfs_close(int fd) {
-  if (pfs_files[fd] == NULL)
+// positional i/o, the handle cursor is left untouched so several tasks can
+// share a descriptor without seeking
+ssize_t vfs_pfs_pread(int fd, void *dst, size_t size, off_t offset) {
+  pfs_fd_t *handle = pfs_fd_get(fd);
+  if (handle == NULL)
     return -1;
-  pfs_fclose(pfs_files[fd]);
-  return 0;
+  if (offset < 0) {
+    ESP_LOGE(TAG, "Invalid read offset (%ld)", (long)offset);
+    return -1;
+  }
+  size_t res = 0;
+  pfs_rdlock(&handle->file->lock);
+  // reading past the end is not an error, there's just nothing to read
+  if (offset < handle->file->size)
+    res = pfs_pread(handle->file, dst, size, offset);
+  pfs_unlock(&handle->file->lock);
+  if (res == (size_t)-1)
+    return -1;
+  return res;
+}
+
+ssize_t vfs_pfs_pwrite(int fd, const void *data, size_t size, off_t offset) {
+  pfs_fd_t *handle = pfs_fd_get(fd);
+  if (handle == NULL)
+    return -1;
+  if (offset < 0 || (uint64_t)offset + size > UINT32_MAX) {
+    ESP_LOGE(TAG, "Invalid write offset (%ld)", (long)offset);
+    return -1;
+  }
+  size_t res;
+  for (bool retry = false;; retry = true) {
+    pfs_wrlock(&handle->file->lock);
+    res = pfs_pwrite(handle->file, data, size, offset);
+    pfs_unlock(&handle->file->lock);
+    if (res != (size_t)-1 || retry || !pfs_write_retry(size))
+      break;
+  }
+  if (res == (size_t)-1)
+    return -1;
+  return res;
+}
+
+int vfs_pfs_truncate(const char *path, off_t length) {
+  if (length < 0) {
+    ESP_LOGE(TAG, "Invalid length (%ld)", (long)length);
+    return -1;
+  }
+  return pfs_truncate(path, length);
+}
+
+int vfs_pfs_ftruncate(int fd, off_t length) {
+  pfs_fd_t *handle = pfs_fd_get(fd);
+  if (handle == NULL)
+    return -1;
+  if (length < 0) {
+    ESP_LOGE(TAG, "Invalid length (%ld)", (long)length);
+    return -1;
+  }
+  return pfs_ftruncate(handle->file, length);
+}
+
+int vfs_pfs_close(int fd) {
+  int res = -1;
+  bool releases = false;
+  pfs_file_t *file;
+  int trim;
+  pfs_rdlock(&pfs_ns_lock);
+  pthread_mutex_lock(&pfs_fds_lock);
+  pfs_fd_t *handle = pfs_fd_get(fd);
+  if (handle != NULL) {
+    // the last handle on an unlinked file releases it, which changes the
+    // namespace
+    releases = handle->file->name == NULL && handle->file->refcount == 1;
+    if (!releases)
+      res = pfs_fd_close(fd, &file, &trim);
+  }
+  pthread_mutex_unlock(&pfs_fds_lock);
+  if (res == 0)
+    pfs_fd_trim(file, trim);
+  pfs_unlock(&pfs_ns_lock);
+
+  if (releases) {
+    pfs_ns_write_lock();
+    res = pfs_fd_close(fd, &file, &trim); // nothing left to trim
+    pfs_ns_write_unlock();
+  }
+  return res;
 }
 
 int vfs_pfs_fsync(int fd) {
-  // not sure it's needed with ramdisk
-  return fd;
+  pfs_fd_t *handle = pfs_fd_get(fd);
+  if (handle == NULL)
+    return -1;
+  // only does something with a backing store
+  return pfs_fflush(handle->file);
 }
 
 int vfs_pfs_fstat(int fd, struct stat *st) {
   assert(st);
-  if (pfs_files[fd] == NULL) {
-    ESP_LOGE(TAG, "Invalid file descriptor (%d)", fd);
-    return -1;
-  }
-  struct stat s;
-  int res = pfs_stat(pfs_files[fd]->name, &s);
-  if (res == 1)
+  pfs_fd_t *handle = pfs_fd_get(fd);
+  if (handle == NULL)
     return -1;
+  // the handle may outlive the path (unlinked while opened)
   memset(st, 0, sizeof(*st));
-  st->st_size = s.st_size;
-  st->st_mode = s.st_mode; // S_IRWXU | S_IRWXG | S_IRWXO | S_IFREG;
-  return res;
+  pfs_rdlock(&handle->file->lock);
+  st->st_size = handle->file->size;
+  pfs_unlock(&handle->file->lock);
+  st->st_mode = S_IFREG;
+  return 0;
 }
 
 int vfs_pfs_stat(const char *path, struct stat *st) {
-  int res = pfs_stat(path, st);
+  int res = 1;
+  bool done = false;
+  pfs_ns_read_enter();
+  for (int i = 0; i < PFS_NS_READ_TRIES && !done; i++) {
+    uint32_t seq = pfs_ns_read_begin();
+    if (seq & 1) { // writer active
+      sched_yield();
+      continue;
+    }
+    res = pfs_stat(path, st);
+    done = !pfs_ns_read_retry(seq);
+  }
+  pfs_ns_read_leave();
+  if (!done) { // writers kept the namespace busy, wait for them
+    pfs_rdlock(&pfs_ns_lock);
+    res = pfs_stat(path, st);
+    pfs_unlock(&pfs_ns_lock);
+  }
+  if (res == 1) { // not fetched yet?
+    pthread_mutex_lock(&pfs_backing_lock);
+    if (pfs_backing != NULL &&
+        pfs_backing->stat(pfs_backing->ctx, path, st) == 0)
+      res = 0;
+    pthread_mutex_unlock(&pfs_backing_lock);
+  }
   if (res == 1)
     return -1;
   return 0;
 }
 
 off_t vfs_pfs_lseek(int fd, off_t offset, int mode) {
-
-  if (pfs_files[fd] == NULL)
+  pfs_fd_t *handle = pfs_fd_get(fd);
+  if (handle == NULL)
     return -1;
-  if (pfs_fseek(pfs_files[fd], offset, mode) == 0)
-    return offset;
+  pfs_rdlock(&handle->file->lock);
+  int res = pfs_seek(handle->file, &handle->index, offset, mode);
+  pfs_unlock(&handle->file->lock);
+  if (res == 0)
+    return handle->index;
   return -1;
 }
 
+int vfs_pfs_fcntl(int fd, int cmd, int arg) {
+  pfs_fd_t *handle = pfs_fd_get(fd);
+  if (handle == NULL)
+    return -1;
+  switch (cmd) {
+  case PFS_F_PREALLOCATE:
+    if (arg < 0)
+      return -1;
+    return pfs_fallocate(handle->file, arg);
+  default:
+    ESP_LOGW(TAG, "Unsupported fcntl command 0x%04x", cmd);
+    return -1;
+  }
+}
+
 int vfs_pfs_unlink(const char *path) {
+  pthread_mutex_lock(&pfs_backing_lock);
+  pfs_ns_write_lock();
   int res = pfs_unlink(path); // 0 = success, 1 = fail
+  pfs_ns_write_unlock();
+  // the file may be in memory, in the store or both
+  if (pfs_backing != NULL &&
+      pfs_backing->remove(pfs_backing->ctx, path) == 0)
+    res = 0;
+  pthread_mutex_unlock(&pfs_backing_lock);
   if (res == 1)
     return -1;
   return 0;
 }
 
+// renames in the backing store too: files and directories not fetched yet
+// are only renamed there, files the store couldn't rename are written
+// again under their new name
+static int pfs_backing_rename(const char *src, const char *dst) {
+  pfs_ns_write_lock();
+  int file_id = pfs_find_file(src);
+  pfs_file_t *file = file_id > -1 ? pfs_files[file_id] : NULL;
+  bool cached = file != NULL || pfs_find_dir(src) > -1;
+  int res = cached ? pfs_rename(src, dst) : 0;
+  if (!cached && (pfs_find_file(dst) > -1 || pfs_find_dir(dst) > -1))
+    res = -1; // same rule as pfs_rename()
+  pfs_ns_write_unlock();
+  if (res != 0)
+    return res;
+  res = pfs_backing->rename(pfs_backing->ctx, src, dst);
+  if (res == 0 || !cached)
+    return res;
+  if (file != NULL) { // pfs_backing_lock keeps it linked
+    pfs_backing->remove(pfs_backing->ctx, src);
+    pfs_wrlock(&file->lock);
+    file->flags |= PFS_F_CHANGED;
+    pfs_unlock(&file->lock);
+  }
+  return 0;
+}
+
 int vfs_pfs_rename(const char *src, const char *dst) {
-  return pfs_rename(src, dst);
+  pthread_mutex_lock(&pfs_backing_lock);
+  int res;
+  if (pfs_backing != NULL) {
+    res = pfs_backing_rename(src, dst);
+  } else {
+    pfs_ns_write_lock();
+    res = pfs_rename(src, dst);
+    pfs_ns_write_unlock();
+  }
+  pthread_mutex_unlock(&pfs_backing_lock);
+  return res;
 }
 
-int vfs_pfs_rmdir(const char *name) { return pfs_rmdir(name); }
+int vfs_pfs_rmdir(const char *name) {
+  struct stat st;
+  bool stored = false;
+  pthread_mutex_lock(&pfs_backing_lock);
+  if (pfs_backing != NULL) {
+    // the store may hold files that were not fetched
+    stored = pfs_backing->remove(pfs_backing->ctx, name) == 0;
+    if (!stored && pfs_backing->stat(pfs_backing->ctx, name, &st) == 0) {
+      pthread_mutex_unlock(&pfs_backing_lock);
+      ESP_LOGE(TAG, "Can't remove %s from the backing store", name);
+      return -1;
+    }
+  }
+  pfs_ns_write_lock();
+  int res = -1;
+  if (pfs_find_dir(name) > -1)
+    res = pfs_rmdir(name);
+  else if (stored)
+    res = 0;
+  pfs_ns_write_unlock();
+  pthread_mutex_unlock(&pfs_backing_lock);
+  return res;
+}
 
 int vfs_pfs_mkdir(const char *name, mode_t mode) {
+  (void)mode; // no permissions
+  pfs_ns_write_lock();
   int dir_id = pfs_mkdir(name);
+  pfs_ns_write_unlock();
   if (dir_id < 0)
     return -1;
   return 0;
 }
 
 DIR *vfs_pfs_opendir(const char *name) {
+  pfs_dir_handle_t *handle = NULL;
+  pfs_ns_write_lock();
   pfs_dir_t *tmp = pfs_opendir(name);
   if (tmp == NULL) {
     ESP_LOGD(TAG, "Can't open dir %s", name);
-    return NULL;
   } else {
-    tmp->pos = 0;
     ESP_LOGV(TAG, "Opening dir '%s' (#%d, %d items)", tmp->name, tmp->dir_id,
              tmp->itemscount);
+    handle = pfs_dir_handle_open(tmp);
   }
-  return (DIR *)tmp;
+  pfs_ns_write_unlock();
+  return (DIR *)handle;
 }
 
 struct dirent *vfs_pfs_readdir(DIR *pdir) {
   assert(pdir);
-  pfs_dir_t *dir = (pfs_dir_t *)pdir;
-  if (pfs_dirs[dir->dir_id] == NULL) {
-    ESP_LOGE(TAG, "Invalid index #%d", dir->dir_id);
-    return NULL;
-  } else {
-    ESP_LOGV(TAG, "Reading dir #%d (path='%s', %d items)", dir->dir_id,
-             dir->name, dir->itemscount);
-  }
-  struct dirent *tmp = pfs_readdir(pfs_dirs[dir->dir_id]);
-  return tmp;
+  pfs_dir_handle_t *handle = (pfs_dir_handle_t *)pdir;
+  pfs_rdlock(&pfs_ns_lock);
+  ESP_LOGV(TAG, "Reading dir #%d (path='%s', %d items)", handle->dir->dir_id,
+           handle->dir->name, handle->dir->itemscount);
+  struct dirent *entry = pfs_readdir(handle);
+  pfs_unlock(&pfs_ns_lock);
+  return entry;
 }
 
 int vfs_pfs_closedir(DIR *pdir) {
   assert(pdir);
-  pfs_dir_t *dir = (pfs_dir_t *)pdir;
-
-  if (pfs_dirs[dir->dir_id] == NULL) {
-    ESP_LOGE(TAG, "Attempting to close unknown dir #%d", dir->dir_id);
-    return -1;
-  }
-  pfs_closedir(pfs_dirs[dir->dir_id]);
+  pfs_ns_write_lock();
+  pfs_closedir((pfs_dir_handle_t *)pdir);
+  pfs_ns_write_unlock();
   return 0;
 }
 
 long vfs_pfs_telldir(DIR *pdir) {
-  pfs_dir_t *dir = (pfs_dir_t *)pdir;
-  return dir->pos;
+  pfs_dir_handle_t *handle = (pfs_dir_handle_t *)pdir;
+  return handle->pos;
 }
 
 size_t vfs_pfs_ftell(FILE *stream) { return pfs_ftell((pfs_file_t *)stream); }
@@ -1420,16 +4636,27 @@ esp_err_t esp_vfs_pfs_register(const esp_vfs_pfs_conf_t *conf) {
                        .open = &vfs_pfs_fopen,
                        .read = &vfs_pfs_read,
                        .write = &vfs_pfs_write,
+#if (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 0, 0))
+                       .pread = &vfs_pfs_pread,
+                       .pwrite = &vfs_pfs_pwrite,
+#endif
                        .close = &vfs_pfs_close,
                        .fsync = &vfs_pfs_fsync,
                        //.ftell       = &vfs_pfs_ftell, // you wish
                        .fstat = &vfs_pfs_fstat,
                        .stat = &vfs_pfs_stat,
                        .lseek = &vfs_pfs_lseek,
+                       .fcntl = &vfs_pfs_fcntl,
                        .unlink = &vfs_pfs_unlink,
                        .rename = &vfs_pfs_rename,
                        .mkdir = &vfs_pfs_mkdir,
                        .rmdir = &vfs_pfs_rmdir,
+#if (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 0, 0))
+                       .truncate = &vfs_pfs_truncate,
+#endif
+#if (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0))
+                       .ftruncate = &vfs_pfs_ftruncate,
+#endif
                        .opendir = &vfs_pfs_opendir,
                        .readdir = &vfs_pfs_readdir,
                        .closedir = &vfs_pfs_closedir,
@@ -1462,6 +4689,9 @@ esp_err_t esp_vfs_pfs_unregister(const char *base_path) {
 
   ESP_LOGD(TAG, "Unregistering \"%s\"", base_path);
 
+  // last chance to write dirty files back
+  pfs_set_backing(NULL, 0);
+
   esp_err_t err = esp_vfs_unregister(base_path);
 
   if (err != ESP_OK) {
@@ -1476,12 +4706,13 @@ esp_err_t esp_vfs_pfs_unregister(const char *base_path) {
 
 esp_err_t esp_vfs_pfs_info(const char *partition_label, size_t *total_bytes,
                            size_t *used_bytes) {
+  (void)partition_label; // there is only one
   // this makes no sense as there is no "real" partition
   if (pfs_partition_label == NULL || pfs_partition_label[0] == '\0') {
     return ESP_ERR_INVALID_STATE;
   }
 
-  *total_bytes = pfs_used_bytes();
-  *used_bytes = pfs_get_partition_size();
+  *total_bytes = pfs_get_partition_size();
+  *used_bytes = pfs_used_bytes();
   return ESP_OK;
 }
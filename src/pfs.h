@@ -34,7 +34,19 @@ extern "C" {
 #include <ctype.h>
 #include <dirent.h>
 #include <sys/fcntl.h>
+#include <pthread.h>
 #include "esp_heap_caps.h"
+#include "esp_idf_version.h"
+#include "pfs_image.h"
+#include "pfs_backing.h"
+
+// pthread rwlocks are only available since IDF 5, readers of the same file
+// serialize on older versions
+#if (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0))
+typedef pthread_rwlock_t pfs_rwlock_t;
+#else
+typedef pthread_mutex_t pfs_rwlock_t;
+#endif
 
 // Configuration structure for esp_vfs_pfs_register.
 typedef struct
@@ -46,33 +58,88 @@ typedef struct
 } esp_vfs_pfs_conf_t;
 
 
+// Bytes of data a file can keep in its own entry, see pfs_set_inline_size()
+// build with -DPFS_INLINE_SIZE=0 to drop the space from every file entry
+#ifndef PFS_INLINE_SIZE
+#define PFS_INLINE_SIZE 32
+#endif
+
 // File structure for pfs
 typedef struct _pfs_file_t
 {
   int      file_id; // file descriptor
-  char*    name;    // file path
+  char*    name;    // file name, relative to its directory
   char*    bytes;   // data
   uint32_t size;    // number of bytes in data
   uint32_t memsize; // size of allocated memory (hopefully more than size)
   uint32_t index;   // read cursor position
   int      dir_id;  // parent directory
   //int      next_file_id; // id of the next file in directory if any
-  //uint32_t flags;   // file flags (not used yet)
+  uint32_t flags;   // storage flags (PFS_F_ROM, PFS_F_COMPRESSED, PFS_F_INTERNAL...) and backing store state (PFS_F_DIRTY, ...)
+  int      refcount; // number of open handles on this file
+  char**   chunks;   // data when using chunked storage, bytes is then NULL
+  uint32_t chunk_size;      // size of each chunk
+  uint32_t chunks_count;    // number of allocated chunks
+  uint32_t chunks_capacity; // size of the chunks list
+  int      dir_pos;  // position in the parent directory items
+  int      maps;     // number of pfs_map() views pinning the data
+  int      writers;  // number of open handles with write access
+  struct _pfs_shared_t* shared; // data shared with clones, NULL when private
+  struct _pfs_zfile_t* z; // compressed data, NULL when stored as is
+  struct _pfs_file_t* lru_newer; // eviction list links, see pfs_set_cache_mode()
+  struct _pfs_file_t* lru_older;
+  bool     pinned;   // never evicted
+  pfs_rwlock_t lock; // guards data, size and memsize
+  char     inline_data[PFS_INLINE_SIZE]; // data of tiny files (PFS_F_INLINE), bytes then points here
 } pfs_file_t;
 
+// Open file handle, one per vfs file descriptor
+typedef struct _pfs_fd_t
+{
+  pfs_file_t* file;  // opened file, NULL when the handle is free
+  uint32_t    index; // read/write cursor position, private to this handle
+  int         flags; // pfs_open_flags given at open time
+} pfs_fd_t;
+
+// Read-only view on a file range, see pfs_map()
+typedef struct _pfs_map_t
+{
+  pfs_file_t*    file; // mapped file, pinned until pfs_unmap()
+  const uint8_t* data; // first mapped byte, NULL when nothing is mapped
+  size_t         size; // number of mapped bytes
+} pfs_map_t;
+
+// Directory item, names are not stored but taken from the file/dir entry
+typedef struct _pfs_dir_item_t
+{
+  int     ino;  // file or directory slot
+  uint8_t type; // DT_REG or DT_DIR
+} pfs_dir_item_t;
+
 // Directory structure for pfs
 typedef struct _pfs_dir_t
 {
-  uint16_t dd_vfs_idx; /*!< VFS index, not to be used by applications */
-  uint16_t dd_rsv;     /*!< field reserved for future extension */
   int    dir_id; // dir descriptor
-  char * name;   // dir path
-  int    pos;    // position while reading dir (reset by opendir)
+  char * name;   // dir name, relative to its parent ("/" for root)
   int    itemscount;
   struct _pfs_dir_t* parent_dir; // parent directory if any
-  struct dirent ** items; // collection of items (file or dir) in that directory
+  pfs_dir_item_t* items; // collection of items (file or dir) in that directory
+  int    itemscapacity; // allocated size of items
+  int    parent_pos;    // position in the parent directory items
+  uint32_t flags;       // PFS_F_COMPRESSED, PFS_F_PLACE_*: inherited by new items
+  int    refcount;      // number of open handles on this dir
 } pfs_dir_t;
 
+// Open directory handle, one per vfs DIR stream
+typedef struct _pfs_dir_handle_t
+{
+  uint16_t dd_vfs_idx; /*!< VFS index, not to be used by applications */
+  uint16_t dd_rsv;     /*!< field reserved for future extension */
+  pfs_dir_t* dir;      // opened directory
+  int        pos;      // position while reading dir
+  struct dirent entry; // last entry returned by readdir
+} pfs_dir_handle_t;
+
 // Seek modes
 typedef enum
 {
@@ -81,6 +148,26 @@ typedef enum
   pfs_seek_end = 2
 } pfs_seek_mode;
 
+// Growth policies for contiguous file buffers
+typedef enum
+{
+  pfs_growth_fixed     = 0, // grow by pfs_alloc_block_size (default)
+  pfs_growth_geometric = 1, // double the buffer
+  pfs_growth_capped    = 2, // double the buffer, but grow by no more than a cap
+} pfs_growth_policy_t;
+
+// Heap placement of file data, see pfs_set_placement()
+typedef enum
+{
+  pfs_place_by_size  = 0, // internal RAM up to pfs_set_internal_threshold(), psram above (default)
+  pfs_place_internal = 1, // always internal RAM
+  pfs_place_psram    = 2, // always psram
+} pfs_placement_t;
+
+// fcntl() command to reserve memory for an opened file, e.g.
+// fcntl(fileno(f), PFS_F_PREALLOCATE, expected_size);
+#define PFS_F_PREALLOCATE 0x5046
+
 // File open flags
 typedef enum  {
   // open flags
@@ -93,12 +180,17 @@ typedef enum  {
   PFS_O_APPEND = 0x0800,    // Move to end of file on every write
 
   // internally used flags
-  PFS_F_DIRTY   = 0x010000, // File does not match storage
-  PFS_F_WRITING = 0x020000, // File has been written since last flush
+  PFS_F_DIRTY   = 0x010000, // File does not match the backing store
+  PFS_F_WRITING = 0x020000, // File has been written since the last flush started
   PFS_F_READING = 0x040000, // File has been read since last flush
-  PFS_F_ERRED   = 0x080000, // An error occured during write
-  PFS_F_INLINE  = 0x100000, // Currently inlined in directory entry
+  PFS_F_ERRED   = 0x080000, // The last flush to the backing store failed
+  PFS_F_INLINE  = 0x100000, // Data is kept in the file entry (inline_data)
   PFS_F_OPENED  = 0x200000, // File has been opened
+  PFS_F_ROM     = 0x400000, // Data is read-only memory owned by the caller
+  PFS_F_COMPRESSED = 0x800000, // Data is written compressed
+  PFS_F_INTERNAL   = 0x1000000, // Data is in internal RAM (psram being the default heap)
+  PFS_F_PLACE_INTERNAL = 0x2000000, // Data goes to internal RAM whatever its size
+  PFS_F_PLACE_PSRAM    = 0x4000000, // Data goes to psram whatever its size
 
 } pfs_open_flags;
 
@@ -108,14 +200,53 @@ typedef enum  {
 pfs_file_t** pfs_get_files(); // returns pointer to the files array
 pfs_dir_t**  pfs_get_dirs();  // returns pointer to the directories array
 int          pfs_get_max_items(); // how many items in the files/directories arrays (same for both)
-void         pfs_set_max_items(size_t max_items); // applies to both files and directories
+void         pfs_set_max_items(size_t max_items); // initial size of both files and directories arrays, they grow on demand
+int          pfs_shrink_tables(); // give back unused slots, returns the new max items
+int          pfs_get_max_open_files(); // how many handles can be opened at the same time
+void         pfs_set_max_open_files(size_t max_open_files);
 size_t       pfs_get_block_size();
 void         pfs_set_block_size(size_t block_size); // smaller value = more calls to realloc()
 size_t       pfs_get_partition_size();
 void         pfs_set_partition_size( size_t size );
 bool         pfs_get_psram();
 void         pfs_set_psram( bool use );
+size_t       pfs_get_internal_threshold();
+void         pfs_set_internal_threshold( size_t size ); // with psram, contiguous files using up to [size] bytes of memory live in internal RAM (0 = none), they move when crossing it
+int          pfs_set_placement( const char* path, pfs_placement_t placement ); // heap rule for a file (moved now) or for the new items of a directory
+size_t       pfs_get_inline_size();
+void         pfs_set_inline_size( size_t size ); // new files up to [size] bytes (at most PFS_INLINE_SIZE, 0 = none) keep their data in the file entry, no allocation until they grow past it
+bool         pfs_get_chunked();
+void         pfs_set_chunked( bool use ); // new files data in [block_size] chunks instead of one contiguous buffer
+bool         pfs_get_shrink_on_close();
+void         pfs_set_shrink_on_close( bool use ); // trim files to their size when their last writer closes
+pfs_growth_policy_t pfs_get_growth_policy();
+void         pfs_set_growth_policy( pfs_growth_policy_t policy, size_t cap ); // cap only applies to pfs_growth_capped
+int          pfs_fallocate( pfs_file_t* stream, size_t size ); // reserve memory for [size] bytes, file size is unchanged
+int          pfs_preallocate( const char* path, size_t size ); // same as pfs_fallocate, creates the file if needed
+int          pfs_ftruncate( pfs_file_t* stream, size_t size ); // shrinking frees memory, growing allocates lazily
+int          pfs_truncate( const char* path, size_t size );
+int          pfs_map( const char* path, size_t offset, size_t length, pfs_map_t* map ); // zero-copy view on [length] bytes at [offset] (0 = up to the end), returns 0 on success
+int          pfs_unmap( pfs_map_t* map ); // releases the view, the file may move or be freed again
+int          pfs_adopt( const char* path, void* buf, size_t size ); // [buf] becomes the file contents, it must be freeable with free(), ownership is transferred on success
+int          pfs_detach( const char* path, void** buf, size_t* size ); // hands the file contents over to the caller, the file is left empty
+int          pfs_clone( const char* src, const char* dst ); // copy-on-write copy, [dst] is created or replaced
+int          pfs_link_rom( const char* path, const void* data, size_t size ); // serves [data] (const or flash memory) as [path] without copying, it's only copied when written and must outlive the file
+int          pfs_image_export( pfs_image_write_cb write, void* ctx ); // streams the whole tree, see pfs_image.h
+int          pfs_image_import( pfs_image_read_cb read, void* ctx ); // restores an image on top of the current tree
+int          pfs_image_mount( const void* image, size_t size ); // same as pfs_image_import, files point into [image] like pfs_link_rom()
+int          pfs_set_compressed( const char* path, bool use ); // compressed storage for a file (converted now) or for the new items of a directory
+int          pfs_compression_stats( size_t* raw_bytes, size_t* stored_bytes ); // totals for compressed files, returns how many there are
+int          pfs_set_backing( const pfs_backing_t* backing, uint32_t flush_interval_ms ); // cache over a persistent store, dirty files are written back every [flush_interval_ms] (0 = only on fsync/pfs_sync), NULL flushes and detaches
+int          pfs_sync(); // writes all dirty files back to the backing store, returns -1 when any failed
+bool         pfs_get_cache_mode();
+void         pfs_set_cache_mode( bool use ); // writes that don't fit evict the least recently used idle files (only clean ones with a backing store)
+int          pfs_pin( const char* path, bool pin ); // pinned files are never evicted
+size_t       pfs_evictions(); // files evicted since mounting
+size_t       pfs_compact( int max_files ); // repack up to [max_files] idle files (0 = all), returns the reclaimed bytes, meant for idle time
+size_t       pfs_reclaimed_bytes(); // total bytes given back by shrink on close and compaction
 size_t       pfs_used_bytes();
+size_t       pfs_used_bytes_internal(); // part of pfs_used_bytes() in internal RAM
+size_t       pfs_used_bytes_psram(); // part of pfs_used_bytes() in psram
 void         pfs_clean_files();
 void         pfs_free();
 void         pfs_deinit();
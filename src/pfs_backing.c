@@ -0,0 +1,109 @@
+/*\
+
+  MIT License
+
+  Copyright (c) 2021-now tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+\*/
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "pfs_backing.h"
+
+#define PFS_BACKING_DIR_PATH_MAX 256
+
+// prefixes [path] with the store root, returns false when it doesn't fit
+static bool pfs_backing_dir_path(void *ctx, const char *path, char *buf) {
+  return snprintf(buf, PFS_BACKING_DIR_PATH_MAX, "%s%s", (const char *)ctx,
+                  path) < PFS_BACKING_DIR_PATH_MAX;
+}
+
+// creates the directories leading to [full_path], existing ones are fine
+static void pfs_backing_dir_mkdirs(char *full_path, size_t root_len) {
+  for (char *p = strchr(&full_path[root_len + 1], '/'); p != NULL;
+       p = strchr(p + 1, '/')) {
+    *p = '\0';
+    mkdir(full_path, 0755);
+    *p = '/';
+  }
+}
+
+static void *pfs_backing_dir_open(void *ctx, const char *path, bool write) {
+  char full_path[PFS_BACKING_DIR_PATH_MAX];
+  if (!pfs_backing_dir_path(ctx, path, full_path))
+    return NULL;
+  if (write) {
+    pfs_backing_dir_mkdirs(full_path, strlen((const char *)ctx));
+    return fopen(full_path, "wb");
+  }
+  return fopen(full_path, "rb");
+}
+
+static size_t pfs_backing_dir_read(void *handle, void *data, size_t len) {
+  return fread(data, 1, len, (FILE *)handle);
+}
+
+static size_t pfs_backing_dir_write(void *handle, const void *data,
+                                    size_t len) {
+  return fwrite(data, 1, len, (FILE *)handle);
+}
+
+static int pfs_backing_dir_close(void *handle) {
+  return fclose((FILE *)handle) == 0 ? 0 : -1;
+}
+
+static int pfs_backing_dir_stat(void *ctx, const char *path,
+                                struct stat *st) {
+  char full_path[PFS_BACKING_DIR_PATH_MAX];
+  if (!pfs_backing_dir_path(ctx, path, full_path))
+    return -1;
+  return stat(full_path, st);
+}
+
+static int pfs_backing_dir_remove(void *ctx, const char *path) {
+  char full_path[PFS_BACKING_DIR_PATH_MAX];
+  if (!pfs_backing_dir_path(ctx, path, full_path))
+    return -1;
+  return remove(full_path);
+}
+
+static int pfs_backing_dir_rename(void *ctx, const char *from,
+                                  const char *to) {
+  char full_from[PFS_BACKING_DIR_PATH_MAX];
+  char full_to[PFS_BACKING_DIR_PATH_MAX];
+  if (!pfs_backing_dir_path(ctx, from, full_from) ||
+      !pfs_backing_dir_path(ctx, to, full_to))
+    return -1;
+  pfs_backing_dir_mkdirs(full_to, strlen((const char *)ctx));
+  return rename(full_from, full_to);
+}
+
+void pfs_backing_dir(pfs_backing_t *backing, const char *root) {
+  backing->ctx = (void *)root;
+  backing->open = pfs_backing_dir_open;
+  backing->read = pfs_backing_dir_read;
+  backing->write = pfs_backing_dir_write;
+  backing->close = pfs_backing_dir_close;
+  backing->stat = pfs_backing_dir_stat;
+  backing->remove = pfs_backing_dir_remove;
+  backing->rename = pfs_backing_dir_rename;
+}
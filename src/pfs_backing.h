@@ -0,0 +1,65 @@
+/*\
+
+  MIT License
+
+  Copyright (c) 2021-now tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+\*/
+
+#ifndef _PFS_BACKING_H_
+#define _PFS_BACKING_H_
+
+// Backing store for the write-back cache mode, see pfs_set_backing().
+// Paths are relative to the mount point ("/dir/file.txt"). File handles
+// returned by open() are given as the context of read() and write(), which
+// follow the pfs image callbacks contract: anything short of [len] is an
+// error.
+
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "pfs_image.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _pfs_backing_t
+{
+  void*  ctx; // given to open(), stat(), remove() and rename()
+  void*  (*open)( void* ctx, const char* path, bool write ); // NULL on error, write mode truncates and creates the missing parent directories
+  pfs_image_read_cb  read;
+  pfs_image_write_cb write;
+  int    (*close)( void* handle ); // 0 when everything was written
+  int    (*stat)( void* ctx, const char* path, struct stat* st ); // 0 when [path] exists, only st_mode and st_size are used
+  int    (*remove)( void* ctx, const char* path ); // removes a file or an empty directory
+  int    (*rename)( void* ctx, const char* from, const char* to );
+} pfs_backing_t;
+
+// fills [backing] with a store keeping the files under the [root] directory
+// with stdio, [root] must outlive it. Works with any vfs mount (LittleFS,
+// SD, ...) on the device and with a local directory on the host.
+void pfs_backing_dir( pfs_backing_t* backing, const char* root );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
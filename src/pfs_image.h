@@ -0,0 +1,97 @@
+/*\
+
+  MIT License
+
+  Copyright (c) 2021-now tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+\*/
+
+#ifndef _PFS_IMAGE_H_
+#define _PFS_IMAGE_H_
+
+// Filesystem image format, shared by pfs.c and the host tool in
+// extras/pfsimage, so it must not depend on esp-idf.
+//
+// All integers are little endian.
+//
+//   header: "PFSI" magic, u16 version, u16 flags (none yet)
+//   then records, each starting with:
+//     u8 type, u32 parent directory number, u16 name length, name bytes
+//   PFS_IMAGE_DIR:  nothing else, the directory gets the next number (the
+//                   root directory is number 0 and has no record)
+//   PFS_IMAGE_FILE: u32 size, then [size] bytes of contents
+//   PFS_IMAGE_END:  parent and name are zero, last record of the image
+//
+// A directory record always comes before the records of its items, so an
+// image is restored in a single sequential pass.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PFS_IMAGE_MAGIC       "PFSI"
+#define PFS_IMAGE_VERSION     1
+#define PFS_IMAGE_HEADER_SIZE 8
+#define PFS_IMAGE_RECORD_SIZE 7 // type, parent and name length
+#define PFS_IMAGE_NAME_MAX    0xffff
+
+typedef enum
+{
+  PFS_IMAGE_END  = 0,
+  PFS_IMAGE_DIR  = 1,
+  PFS_IMAGE_FILE = 2,
+} pfs_image_record_t;
+
+// Stream callbacks, they return how many bytes were written/read, anything
+// short of [len] aborts the export/import
+typedef size_t (*pfs_image_write_cb)( void* ctx, const void* data, size_t len );
+typedef size_t (*pfs_image_read_cb)( void* ctx, void* data, size_t len );
+
+static inline void pfs_image_put_u16( uint8_t* p, uint16_t v )
+{
+  p[0] = v & 0xff;
+  p[1] = v >> 8;
+}
+
+static inline void pfs_image_put_u32( uint8_t* p, uint32_t v )
+{
+  pfs_image_put_u16( p, v & 0xffff );
+  pfs_image_put_u16( p + 2, v >> 16 );
+}
+
+static inline uint16_t pfs_image_get_u16( const uint8_t* p )
+{
+  return p[0] | ( p[1] << 8 );
+}
+
+static inline uint32_t pfs_image_get_u32( const uint8_t* p )
+{
+  return pfs_image_get_u16( p ) | ( (uint32_t)pfs_image_get_u16( p + 2 ) << 16 );
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
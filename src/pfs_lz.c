@@ -0,0 +1,235 @@
+/*\
+
+  MIT License
+
+  Copyright (c) 2021-now tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+\*/
+
+#include <stdbool.h>
+#include <string.h>
+#include "pfs_lz.h"
+
+#define PFS_LZ_MIN_MATCH     4
+#define PFS_LZ_LAST_LITERALS 5  // the block always ends with literals
+#define PFS_LZ_MATCH_LIMIT   12 // no match starts in the last bytes
+#define PFS_LZ_SKIP_TRIGGER  6  // search step grows every 2^6 misses
+#define PFS_LZ_WILD_COPY     16 // fast paths copy that much at once
+
+static inline uint32_t pfs_lz_read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline size_t pfs_lz_read_word(const uint8_t *p) {
+  size_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// length of the common prefix of [p] and [ref], stopping at [limit]
+static inline const uint8_t *pfs_lz_match_end(const uint8_t *p,
+                                              const uint8_t *ref,
+                                              const uint8_t *limit) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  // the lowest set bit of the difference is in the first differing byte
+  while (p + sizeof(size_t) <= limit) {
+    size_t diff = pfs_lz_read_word(p) ^ pfs_lz_read_word(ref);
+    if (diff != 0)
+      return p + (__builtin_ctzll(diff) >> 3);
+    p += sizeof(size_t);
+    ref += sizeof(size_t);
+  }
+#endif
+  while (p < limit && *p == *ref) {
+    p++;
+    ref++;
+  }
+  return p;
+}
+
+static inline uint32_t pfs_lz_hash(uint32_t seq) {
+  return (seq * 2654435761u) >> (32 - PFS_LZ_HASH_BITS);
+}
+
+// worst case room taken by a length of [len] past its token nibble
+static inline size_t pfs_lz_len_size(size_t len) {
+  return len >= 15 ? (len - 15) / 255 + 1 : 0;
+}
+
+static uint8_t *pfs_lz_put_len(uint8_t *op, size_t len) {
+  len -= 15;
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+// writes a sequence, [offset] 0 for the last one (literals only)
+static uint8_t *pfs_lz_put_sequence(uint8_t *op, uint8_t *oend,
+                                    const uint8_t *literals, size_t lit,
+                                    uint16_t offset, size_t mlen) {
+  size_t need = 1 + pfs_lz_len_size(lit) + lit;
+  if (offset != 0)
+    need += 2 + pfs_lz_len_size(mlen);
+  if (need > (size_t)(oend - op))
+    return NULL;
+  uint8_t *token = op++;
+  *token = (lit >= 15 ? 15 : lit) << 4;
+  if (lit >= 15)
+    op = pfs_lz_put_len(op, lit);
+  memcpy(op, literals, lit);
+  op += lit;
+  if (offset != 0) {
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    *token |= mlen >= 15 ? 15 : mlen;
+    if (mlen >= 15)
+      op = pfs_lz_put_len(op, mlen);
+  }
+  return op;
+}
+
+size_t pfs_lz_compress(const uint8_t *src, size_t len, uint8_t *dst,
+                       size_t cap, uint16_t *table) {
+  const uint8_t *ip = src;
+  const uint8_t *anchor = src;
+  const uint8_t *end = src + len;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + cap;
+
+  if (len > PFS_LZ_MAX_INPUT)
+    return 0;
+
+  if (len > PFS_LZ_MATCH_LIMIT) {
+    const uint8_t *mflimit = end - PFS_LZ_MATCH_LIMIT;
+    const uint8_t *matchlimit = end - PFS_LZ_LAST_LITERALS;
+    memset(table, 0, PFS_LZ_HASH_SIZE * sizeof(uint16_t));
+    ip++; // position 0 is what empty entries point at
+    unsigned misses = 1 << PFS_LZ_SKIP_TRIGGER;
+    while (ip < mflimit) {
+      uint32_t seq = pfs_lz_read32(ip);
+      uint32_t h = pfs_lz_hash(seq);
+      const uint8_t *ref = src + table[h];
+      table[h] = ip - src;
+      if (pfs_lz_read32(ref) != seq) {
+        // incompressible data is skipped faster and faster
+        ip += misses++ >> PFS_LZ_SKIP_TRIGGER;
+        continue;
+      }
+      misses = 1 << PFS_LZ_SKIP_TRIGGER;
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      const uint8_t *mp = pfs_lz_match_end(ip + PFS_LZ_MIN_MATCH,
+                                           ref + PFS_LZ_MIN_MATCH, matchlimit);
+      op = pfs_lz_put_sequence(op, oend, anchor, ip - anchor, ip - ref,
+                               mp - ip - PFS_LZ_MIN_MATCH);
+      if (op == NULL)
+        return 0;
+      anchor = ip = mp;
+      table[pfs_lz_hash(pfs_lz_read32(ip - 2))] = ip - 2 - src;
+    }
+  }
+
+  op = pfs_lz_put_sequence(op, oend, anchor, end - anchor, 0, 0);
+  return op != NULL ? (size_t)(op - dst) : 0;
+}
+
+// reads the rest of a length whose token nibble was 15
+static bool pfs_lz_get_len(const uint8_t **ip, const uint8_t *iend,
+                           size_t *len) {
+  uint8_t b;
+  do {
+    if (*ip >= iend)
+      return false;
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return true;
+}
+
+size_t pfs_lz_decompress(const uint8_t *src, size_t len, uint8_t *dst,
+                         size_t cap) {
+  const uint8_t *ip = src;
+  const uint8_t *iend = src + len;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + cap;
+
+  while (ip < iend) {
+    uint8_t token = *ip++;
+    size_t lit = token >> 4;
+    // short literals and match with room around: fixed size copies the
+    // compiler turns into a few loads and stores
+    if (lit < 15 && (token & 15) < 15 &&
+        iend - ip >= PFS_LZ_WILD_COPY + 2 && oend - op >= 2 * PFS_LZ_WILD_COPY) {
+      memcpy(op, ip, PFS_LZ_WILD_COPY);
+      op += lit;
+      ip += lit;
+      size_t offset = ip[0] | (ip[1] << 8);
+      size_t mlen = (token & 15) + PFS_LZ_MIN_MATCH;
+      if (offset >= 8 && offset <= (size_t)(op - dst)) {
+        ip += 2;
+        const uint8_t *ref = op - offset;
+        memcpy(op, ref, 8);
+        memcpy(op + 8, ref + 8, 8);
+        memcpy(op + 16, ref + 16, 2); // mlen is 18 at most
+        op += mlen;
+        continue;
+      }
+      ip -= lit; // general case below
+      op -= lit;
+    }
+    if (lit == 15 && !pfs_lz_get_len(&ip, iend, &lit))
+      return -1;
+    if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+      return -1;
+    memcpy(op, ip, lit);
+    ip += lit;
+    op += lit;
+    if (ip == iend)
+      break; // last sequence has no match
+    if (iend - ip < 2)
+      return -1;
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    size_t mlen = token & 15;
+    if (mlen == 15 && !pfs_lz_get_len(&ip, iend, &mlen))
+      return -1;
+    mlen += PFS_LZ_MIN_MATCH;
+    if (offset == 0 || offset > (size_t)(op - dst) ||
+        mlen > (size_t)(oend - op))
+      return -1;
+    const uint8_t *ref = op - offset;
+    if (offset >= mlen) {
+      memcpy(op, ref, mlen);
+      op += mlen;
+    } else {
+      while (mlen-- > 0) // overlapping, repeats the last [offset] bytes
+        *op++ = *ref++;
+    }
+  }
+  return op - dst;
+}
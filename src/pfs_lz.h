@@ -0,0 +1,58 @@
+/*\
+
+  MIT License
+
+  Copyright (c) 2021-now tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+\*/
+
+#ifndef _PFS_LZ_H_
+#define _PFS_LZ_H_
+
+// Small LZ77 block codec used by compressed files, with the LZ4 block
+// layout: a token holding the literals and match lengths, the literals,
+// then a 16 bits little endian match offset. No esp-idf dependency so the
+// host tools can use it.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PFS_LZ_MAX_INPUT  65536 // match offsets are 16 bits
+#define PFS_LZ_HASH_BITS  12
+#define PFS_LZ_HASH_SIZE  (1 << PFS_LZ_HASH_BITS) // entries in the table given to pfs_lz_compress()
+
+// compresses [len] bytes of [src] into [dst], [table] is scratch memory of
+// PFS_LZ_HASH_SIZE entries, returns the compressed length or 0 when it
+// doesn't fit in [cap] bytes
+size_t pfs_lz_compress( const uint8_t* src, size_t len, uint8_t* dst, size_t cap, uint16_t* table );
+// returns the decompressed length, or -1 for a malformed block or when the
+// output doesn't fit in [cap] bytes
+size_t pfs_lz_decompress( const uint8_t* src, size_t len, uint8_t* dst, size_t cap );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif